@@ -0,0 +1,283 @@
+/*
+MultiDownload 的本地压测，不依赖外网：子进程中运行 LoopbackHttpServer 提供合成数据，
+父进程在不同并发数下用 MultiDownload 下载，输出每秒请求数、吞吐、每 GB 数据消耗的 CPU 时间
+（只统计父进程，不含服务器）与请求耗时的分位数。
+每个并发级别保持 c 个请求在途，一个结束就补一个，耗时不含排队时间。
+一段时间没有任何进展时报告卡住的请求数并以非 0 退出，用于离线复现下载卡住的问题。
+
+用法: bench_multi_download [-s 大小] [-n 请求数] [-c 1,8,64] [-l 延迟ms] [-b 每连接字节/秒]
+                           [-f 失败比例] [-r] [-L 循环数] [-k 消费线程数] [-p] [-w 卡住判定秒数]
+  -r  失败的请求发送一半内容后断开连接，默认返回 503
+  -k  开启背压模式，见 MultiDownload::setBackpressure
+  -p  用 POST 上传 -s 大小的数据，响应为空
+*/
+
+#include <algorithm>
+#include <condition_variable>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "multi_download.h"
+#include "loopback_http_server.h"
+
+struct Config {
+	uint64_t size = 1 << 20;
+	size_t requests = 2000;
+	std::vector<size_t> concurrency = {1, 8, 32, 128};
+	int latency_ms = 0;
+	size_t bandwidth = 0;
+	double failureRate = 0;
+	bool failByReset = false;
+	size_t loops = 1;
+	size_t consumers = 0;
+	bool post = false;
+	int stallSeconds = 10;
+};
+
+struct Result {
+	double seconds = 0;
+	double cpuSeconds = 0;
+	uint64_t bytes = 0;
+	size_t ok = 0;
+	size_t failed = 0;
+	std::vector<double> latencies;      // 毫秒
+	bool stalled = false;
+};
+
+static double CpuSeconds() {
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static double Percentile(const std::vector<double>& sorted, double p) {
+	if (sorted.empty()) {
+		return 0;
+	}
+	size_t index = std::min(sorted.size() - 1, (size_t)(p * sorted.size()));
+	return sorted[index];
+}
+
+// 在子进程中运行服务器，返回端口；父进程关闭 control 写端后子进程退出
+static uint16_t StartServer(const Config& config, pid_t& child, int& control) {
+	int portPipe[2];
+	int controlPipe[2];
+	if (pipe(portPipe) != 0 || pipe(controlPipe) != 0) {
+		return 0;
+	}
+	child = fork();
+	if (child == 0) {
+		close(portPipe[0]);
+		close(controlPipe[1]);
+		LoopbackHttpServer::Options options;
+		options.latency_ms = config.latency_ms;
+		options.failureRate = config.failureRate;
+		options.failByReset = config.failByReset;
+		size_t bandwidth = config.bandwidth;
+		if (bandwidth) {
+			options.bandwidth = [bandwidth](const LoopbackHttpServer::Request&) {
+				return bandwidth;
+			};
+		}
+		LoopbackHttpServer server(options);
+		server.addFile("/payload", config.size);
+		server.addFile("/upload", 0);
+		uint16_t port = server.port();
+		ssize_t ret = write(portPipe[1], &port, sizeof(port));
+		(void)ret;
+		char c;
+		while (read(controlPipe[0], &c, 1) > 0) {
+		}
+		_exit(0);
+	}
+	close(portPipe[1]);
+	close(controlPipe[0]);
+	control = controlPipe[1];
+	uint16_t port = 0;
+	if (read(portPipe[0], &port, sizeof(port)) != sizeof(port)) {
+		port = 0;
+	}
+	close(portPipe[0]);
+	return port;
+}
+
+static Result Run(const Config& config, size_t concurrency, const std::string& url) {
+	Result result;
+	// 所有请求共享同一块内存作为请求体，不逐个复制
+	auto body = std::make_shared<const std::string>(config.post ? config.size : 0, 'x');
+	std::mutex lock;
+	std::condition_variable cv;
+	std::atomic<uint64_t> bytes{0};
+	std::atomic<size_t> finished{0};
+	size_t submitted = 0;
+	// 回调引用上面的局部变量，返回前先释放 download，让下载线程退出
+	std::unique_ptr<MultiDownload<>> download(new MultiDownload<>(concurrency, 0, config.loops));
+	if (config.consumers) {
+		download->setBackpressure(config.consumers);
+	}
+
+	std::function<void()> submitOne = [&]() {
+		auto start = std::chrono::steady_clock::now();
+		MultiDownload<>::DownloadCallback cb = [&, start](const char*, const char*, const CallbackData& data) {
+			if (data.type == CONTENT) {
+				bytes += data.size;
+				return;
+			}
+			if (data.type != RESULT) {
+				return;
+			}
+			double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			bool next = false;
+			{
+				std::lock_guard<std::mutex> _(lock);
+				result.latencies.push_back(ms);
+				if (data.result == E_OK) {
+					result.ok++;
+				} else {
+					result.failed++;
+				}
+				if (submitted < config.requests) {
+					submitted++;
+					next = true;
+				}
+			}
+			if (config.post && data.result == E_OK) {
+				bytes += config.size;
+			}
+			// 回调在下载线程上，提交只是入队
+			if (next) {
+				submitOne();
+			}
+			finished++;
+			cv.notify_all();
+		};
+		if (config.post) {
+			download->addPost("bench", (url + "/upload").c_str(), std::make_shared<BufferSource>(body), 0, cb);
+		} else {
+			download->addDownload("bench", (url + "/payload").c_str(), 0, cb);
+		}
+	};
+
+	double cpuStart = CpuSeconds();
+	auto start = std::chrono::steady_clock::now();
+	size_t initial = std::min(concurrency, config.requests);
+	{
+		std::lock_guard<std::mutex> _(lock);
+		submitted = initial;
+	}
+	for (size_t i = 0; i < initial; ++i) {
+		submitOne();
+	}
+	uint64_t lastBytes = 0;
+	size_t lastFinished = 0;
+	auto lastProgress = std::chrono::steady_clock::now();
+	{
+		std::unique_lock<std::mutex> lk(lock);
+		while (finished < config.requests) {
+			cv.wait_for(lk, std::chrono::milliseconds(500));
+			if (bytes != lastBytes || finished != lastFinished) {
+				lastBytes = bytes;
+				lastFinished = finished;
+				lastProgress = std::chrono::steady_clock::now();
+			} else if (std::chrono::steady_clock::now() - lastProgress > std::chrono::seconds(config.stallSeconds)) {
+				fprintf(stderr, "STALL: concurrency %zu, %zu/%zu finished, %zu queued, no progress for %d s\n",
+						concurrency, (size_t)finished, config.requests, download->QueueSize(), config.stallSeconds);
+				result.stalled = true;
+				break;
+			}
+		}
+	}
+	result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	if (result.stalled) {
+		// 强制停止，不再等待卡住的请求
+		download.reset();
+		return result;
+	}
+	download->join();
+	download.reset();
+	result.cpuSeconds = CpuSeconds() - cpuStart;
+	result.bytes = bytes;
+	std::sort(result.latencies.begin(), result.latencies.end());
+	return result;
+}
+
+static std::vector<size_t> ParseList(const char* text) {
+	std::vector<size_t> values;
+	const char* p = text;
+	while (*p) {
+		char* end;
+		size_t v = strtoull(p, &end, 10);
+		if (end == p) {
+			break;
+		}
+		values.push_back(v);
+		p = *end == ',' ? end + 1 : end;
+	}
+	return values;
+}
+
+int main(int argc, char* argv[])
+{
+	Config config;
+	int opt;
+	while ((opt = getopt(argc, argv, "s:n:c:l:b:f:rL:k:pw:")) != -1) {
+		switch (opt) {
+		case 's': config.size = strtoull(optarg, NULL, 10); break;
+		case 'n': config.requests = strtoull(optarg, NULL, 10); break;
+		case 'c': config.concurrency = ParseList(optarg); break;
+		case 'l': config.latency_ms = atoi(optarg); break;
+		case 'b': config.bandwidth = strtoull(optarg, NULL, 10); break;
+		case 'f': config.failureRate = atof(optarg); break;
+		case 'r': config.failByReset = true; break;
+		case 'L': config.loops = strtoull(optarg, NULL, 10); break;
+		case 'k': config.consumers = strtoull(optarg, NULL, 10); break;
+		case 'p': config.post = true; break;
+		case 'w': config.stallSeconds = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-s size] [-n requests] [-c 1,8,64] [-l latency_ms] [-b bytes_per_sec] "
+					"[-f failure_rate] [-r] [-L loops] [-k consumers] [-p] [-w stall_seconds]\n", argv[0]);
+			return 2;
+		}
+	}
+	if (config.concurrency.empty() || config.requests == 0) {
+		fprintf(stderr, "no concurrency level or requests\n");
+		return 2;
+	}
+
+	// 先 fork 出服务器再初始化 curl 与任何线程
+	pid_t child = -1;
+	int control = -1;
+	uint16_t port = StartServer(config, child, control);
+	if (port == 0) {
+		fprintf(stderr, "failed to start server\n");
+		return 1;
+	}
+	curl_global_init(CURL_GLOBAL_ALL);
+	std::string url = "http://127.0.0.1:" + std::to_string(port);
+
+	printf("%s %llu bytes, %zu requests, latency %d ms, bandwidth %zu B/s, failure %.3f%s, loops %zu, consumers %zu\n",
+		   config.post ? "POST" : "GET", (unsigned long long)config.size, config.requests, config.latency_ms,
+		   config.bandwidth, config.failureRate, config.failByReset ? " (reset)" : "", config.loops, config.consumers);
+	printf("%11s %10s %10s %10s %9s %9s %9s %9s %7s\n",
+		   "concurrency", "req/s", "MB/s", "CPU s/GB", "p50 ms", "p90 ms", "p99 ms", "max ms", "failed");
+	fflush(stdout);
+	int status = 0;
+	for (size_t concurrency : config.concurrency) {
+		Result r = Run(config, std::max<size_t>(concurrency, 1), url);
+		if (r.stalled) {
+			status = 1;
+			break;
+		}
+		double gb = r.bytes / 1e9;
+		printf("%11zu %10.1f %10.1f %10.3f %9.2f %9.2f %9.2f %9.2f %7zu\n",
+			   concurrency, (r.ok + r.failed) / r.seconds, r.bytes / r.seconds / 1e6,
+			   gb > 0 ? r.cpuSeconds / gb : 0.0,
+			   Percentile(r.latencies, 0.5), Percentile(r.latencies, 0.9), Percentile(r.latencies, 0.99),
+			   r.latencies.empty() ? 0.0 : r.latencies.back(), r.failed);
+		fflush(stdout);
+	}
+	curl_global_cleanup();
+	close(control);
+	waitpid(child, NULL, 0);
+	return status;
+}
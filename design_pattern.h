@@ -2,9 +2,16 @@
 
 #if __cplusplus >= 201703L
 #include <any>
+#include <shared_mutex>
+#include <string_view>
+#include <variant>
 #endif // __cplusplus >= 201703L
 
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <condition_variable>
+#include <cstdint>
 #include <deque>
 #include <exception>
 #include <functional>
@@ -12,8 +19,15 @@
 #include <map>
 #include <memory>
 #include <mutex>
+#include <new>
 #include <sstream>
+#include <thread>
+#include <tuple>
 #include <type_traits>
+#include <typeindex>
+#include <typeinfo>
+#include <unordered_map>
+#include <vector>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -22,12 +36,20 @@
 #else
 #include <cxxabi.h>
 #endif
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 #include <iostream>
 
 #define NESTED_LESS(l, r) \
 if (l < r) return true; \
 if (r < l) return false
 
+/// 用于对齐/填充以避免伪共享
+constexpr size_t kCacheLineSize = 64;
+
 class noncopyable
 {
     noncopyable(const noncopyable &) = delete;
@@ -75,6 +97,525 @@ inline std::string GetClearName(const char *name)
 #endif
 }
 
+/// 运行时类型名缓存，每个类型只反修饰一次，之后返回缓存的引用（unordered_map 的节点地址不变）。
+/// C++17 起命中时只加共享锁，多线程读不互相阻塞；已知类型的代码应使用 TypeName<T>()
+inline const std::string &GetClearName(const std::type_info &info)
+{
+    static std::unordered_map<std::type_index, std::string> cache;
+#if __cplusplus >= 201703L
+    static std::shared_mutex lock;
+    {
+        std::shared_lock<std::shared_mutex> _(lock);
+        auto it = cache.find(info);
+        if (it != cache.end())
+        {
+            return it->second;
+        }
+    }
+    // 反修饰在锁外进行，插入时另一个线程可能已经放入
+    std::string name = GetClearName(info.name());
+    std::unique_lock<std::shared_mutex> _(lock);
+    return cache.emplace(info, std::move(name)).first->second;
+#else
+    static std::mutex lock;
+    std::lock_guard<std::mutex> _(lock);
+    auto it = cache.find(info);
+    if (it == cache.end())
+    {
+        it = cache.emplace(info, GetClearName(info.name())).first;
+    }
+    return it->second;
+#endif
+}
+
+#if __cplusplus >= 201703L
+
+namespace detail
+{
+template <typename T>
+constexpr std::string_view RawTypeName()
+{
+#if defined(__clang__) || defined(__GNUC__)
+    return __PRETTY_FUNCTION__;
+#elif defined(_MSC_VER)
+    return __FUNCSIG__;
+#else
+    return "";
+#endif
+}
+
+// 以 int 为探针，得到函数签名中类型名前后的固定部分长度
+constexpr std::string_view kTypeNameProbe = RawTypeName<int>();
+constexpr size_t kTypeNamePrefix = kTypeNameProbe.find("int");
+constexpr size_t kTypeNameSuffix =
+    kTypeNamePrefix == std::string_view::npos ? 0 : kTypeNameProbe.size() - kTypeNamePrefix - 3;
+
+template <typename T>
+constexpr std::string_view ExtractTypeName()
+{
+    constexpr std::string_view raw = RawTypeName<T>();
+    if constexpr (kTypeNamePrefix == std::string_view::npos)
+    {
+        return std::string_view();
+    }
+    else
+    {
+        return raw.substr(kTypeNamePrefix, raw.size() - kTypeNamePrefix - kTypeNameSuffix);
+    }
+}
+} // namespace detail
+
+/// 编译期类型名，由 __PRETTY_FUNCTION__ / __FUNCSIG__ 截取，运行时零开销。
+/// 编译器不支持时退回到 GetClearName(typeid(T))，每个类型只查一次，结果保存在函数内的静态变量中。
+/// 注意：结果是编译器的书写形式，与 abi::__cxa_demangle 的输出不一定逐字相同。
+template <typename T>
+inline constexpr std::string_view TypeName_v = detail::ExtractTypeName<T>();
+
+template <typename T>
+std::string_view TypeName()
+{
+    if constexpr (!TypeName_v<T>.empty())
+    {
+        return TypeName_v<T>;
+    }
+    else
+    {
+        static const std::string &name = GetClearName(typeid(T));
+        return name;
+    }
+}
+
+#else
+
+template <typename T>
+const std::string &TypeName()
+{
+    static const std::string &name = GetClearName(typeid(T));
+    return name;
+}
+
+#endif // __cplusplus >= 201703L
+
+#if __cplusplus >= 201703L
+
+/// T 是否提供 void merge(const T &)，用于把已退出线程的数据并入汇总
+template <typename T, typename = void>
+struct has_merge : std::false_type
+{
+};
+
+template <typename T>
+struct has_merge<T, decltype(std::declval<T &>().merge(std::declval<const T &>()))> : std::true_type
+{
+};
+
+/// 每个线程一份实例的单例，实例按缓存行对齐，写入时不与其他线程共享缓存行。
+/// 线程退出后其实例保留数据供 combine() 统计。T 提供 merge(const T &) 时，分片可被之后新建的线程复用：
+/// 复用前旧实例的数据先并入一份汇总实例（同样由 for_each_shard()/combine() 访问），再重新构造 T，
+/// 新线程看不到上一个线程的状态，combine() 的结果也不会因线程更替而减少；T 没有 merge 时分片不复用。
+/// 线程退出时其他 thread_local 的析构函数若在本类归还分片之后调用 Instance()，得到同一组内共享的
+/// 一份备用实例，多个线程可能同时写入它，T 的字段应使用 std::atomic。
+/// for_each_shard()/combine() 与各线程的写入并发进行，T 的字段若需在读侧看到一致的值，
+/// 应使用 std::atomic 并且写线程只做 relaxed 的 load + store（只有本线程写，无需 fetch_add）。
+/// Tag 用于区分同一 T 的多个独立实例组。
+template <typename T, typename Tag = void>
+class ThreadLocalSingleton : noncopyable
+{
+  public:
+    static T &Instance()
+    {
+        Shard *shard = local_;
+        if (shard == nullptr)
+        {
+            shard = Attach();
+        }
+        return shard->value;
+    }
+
+    template <typename F>
+    static void for_each_shard(F &&f)
+    {
+        auto &reg = Registry();
+        std::lock_guard<std::mutex> _(reg.lock);
+        for (auto &shard : reg.shards)
+        {
+            f(static_cast<const T &>(shard->value));
+        }
+        if (reg.retired)
+        {
+            f(static_cast<const T &>(reg.retired->value));
+        }
+    }
+
+    template <typename R, typename F>
+    static R combine(R init, F &&op)
+    {
+        for_each_shard([&](const T &v) { init = op(std::move(init), v); });
+        return init;
+    }
+
+    /// 分片数，不含已退出线程的汇总实例
+    static size_t shard_count()
+    {
+        auto &reg = Registry();
+        std::lock_guard<std::mutex> _(reg.lock);
+        return reg.shards.size();
+    }
+
+  protected:
+    ThreadLocalSingleton() = default;
+    ~ThreadLocalSingleton() = default;
+
+  private:
+    static constexpr bool kRecycle = has_merge<T>::value;
+
+    struct alignas(kCacheLineSize) Shard
+    {
+        T value;
+    };
+
+    struct ShardRegistry
+    {
+        ShardRegistry()
+        {
+            if constexpr (kRecycle)
+            {
+                retired.reset(new Shard());
+            }
+        }
+
+        std::mutex lock;
+        std::vector<std::unique_ptr<Shard>> shards;
+        std::vector<size_t> idle;         // 已退出线程留下的分片在 shards 中的下标
+        std::unique_ptr<Shard> retired;   // 被复用的分片在复用前并入这里
+        Shard *fallback = nullptr;        // 归还分片之后的 Instance() 共用，也登记在 shards 中
+    };
+
+    // 线程退出时归还本线程的实例
+    struct Releaser
+    {
+        size_t slot = 0;
+        bool attached = false;
+        ~Releaser()
+        {
+            if (kRecycle && attached)
+            {
+                auto &reg = Registry();
+                std::lock_guard<std::mutex> _(reg.lock);
+                reg.idle.push_back(slot);
+            }
+            local_ = nullptr;
+            released_ = true;
+        }
+    };
+
+    // 刻意不析构，其他线程可能在 main 返回后才退出
+    static ShardRegistry &Registry()
+    {
+        static ShardRegistry *reg = new ShardRegistry;
+        return *reg;
+    }
+
+    // T 在锁外构造与析构，构造函数中可以使用其他 ThreadLocalSingleton
+    static Shard *Attach()
+    {
+        std::unique_ptr<Shard> fresh(new Shard());
+        std::unique_ptr<Shard> previous;
+        Shard *shard = fresh.get();
+        auto &reg = Registry();
+        if (released_)
+        {
+            // Releaser 已析构，无从得知何时可以归还，改用共享的备用实例，分片数不随这类线程增长
+            std::lock_guard<std::mutex> _(reg.lock);
+            if (reg.fallback == nullptr)
+            {
+                reg.fallback = shard;
+                reg.shards.push_back(std::move(fresh));
+            }
+            shard = reg.fallback;
+        }
+        else
+        {
+            static thread_local Releaser releaser;
+            std::lock_guard<std::mutex> _(reg.lock);
+            if (!reg.idle.empty())
+            {
+                releaser.slot = reg.idle.back();
+                reg.idle.pop_back();
+                previous = std::move(reg.shards[releaser.slot]);
+                if constexpr (kRecycle)
+                {
+                    reg.retired->value.merge(previous->value);
+                }
+                reg.shards[releaser.slot] = std::move(fresh);
+            }
+            else
+            {
+                releaser.slot = reg.shards.size();
+                reg.shards.push_back(std::move(fresh));
+            }
+            releaser.attached = true;
+        }
+        local_ = shard;
+        return shard;
+    }
+
+    static thread_local Shard *local_;
+    static thread_local bool released_;
+};
+
+template <typename T, typename Tag>
+thread_local typename ThreadLocalSingleton<T, Tag>::Shard *ThreadLocalSingleton<T, Tag>::local_ = nullptr;
+template <typename T, typename Tag>
+thread_local bool ThreadLocalSingleton<T, Tag>::released_ = false;
+
+
+/// 启动期单例注册表：登记各单例的依赖关系后由 Initialize() 统一按拓扑序构造，
+/// 互不依赖的单例在多个线程上并行构造；Shutdown() 按构造完成的逆序析构。
+class SingletonRegistry
+{
+  public:
+    using CreateFunc = void (*)();
+    using DestroyFunc = void (*)();
+
+    static SingletonRegistry &Instance()
+    {
+        static SingletonRegistry instance;
+        return instance;
+    }
+
+    /// 重复登记同一类型时返回 false
+    bool Regist(std::type_index type, std::vector<std::type_index> deps, CreateFunc create, DestroyFunc destroy)
+    {
+        std::lock_guard<std::mutex> _(lock_);
+        if (nodes_.find(type) != nodes_.end())
+        {
+            return false;
+        }
+        if (initialized_)
+        {
+            throw std::runtime_error("singleton registry already initialized: " + GetClearName(type.name()));
+        }
+        nodes_.emplace(type, Node{std::move(deps), create, destroy});
+        return true;
+    }
+
+    /// 构造所有已登记的单例，parallelism 为并行构造的线程数。
+    /// 任一构造函数抛出异常时，已构造的单例按逆序析构后重新抛出该异常。
+    void Initialize(size_t parallelism = std::thread::hardware_concurrency())
+    {
+        std::unique_lock<std::mutex> lk(lock_);
+        if (initialized_)
+        {
+            return;
+        }
+
+        std::map<std::type_index, size_t> pending;
+        std::map<std::type_index, std::vector<std::type_index>> dependents;
+        std::deque<std::type_index> ready;
+        for (auto &node : nodes_)
+        {
+            for (auto &dep : node.second.deps)
+            {
+                if (nodes_.find(dep) == nodes_.end())
+                {
+                    throw std::runtime_error("singleton " + GetClearName(node.first.name()) +
+                                             " depends on unregisted " + GetClearName(dep.name()));
+                }
+                dependents[dep].push_back(node.first);
+            }
+            pending[node.first] = node.second.deps.size();
+            if (node.second.deps.empty())
+            {
+                ready.push_back(node.first);
+            }
+        }
+        CheckCycle(pending, dependents, ready);
+        // 构造期间禁止再登记，工作线程可以不加锁读取 nodes_
+        initialized_ = true;
+
+        std::condition_variable cv;
+        size_t running = 0;
+        std::exception_ptr error;
+        auto worker = [&] {
+            std::unique_lock<std::mutex> wlk(lock_);
+            while (true)
+            {
+                cv.wait(wlk, [&] { return !ready.empty() || running == 0 || error; });
+                if (error || ready.empty())
+                {
+                    break;
+                }
+                auto type = ready.front();
+                ready.pop_front();
+                ++running;
+                wlk.unlock();
+                try
+                {
+                    nodes_.at(type).create();
+                }
+                catch (...)
+                {
+                    wlk.lock();
+                    error = std::current_exception();
+                    --running;
+                    cv.notify_all();
+                    break;
+                }
+                wlk.lock();
+                --running;
+                constructed_.push_back(type);
+                for (auto &next : dependents[type])
+                {
+                    if (--pending[next] == 0)
+                    {
+                        ready.push_back(next);
+                    }
+                }
+                cv.notify_all();
+            }
+        };
+
+        std::vector<std::thread> workers;
+        parallelism = std::max<size_t>(1, std::min(parallelism, nodes_.size()));
+        for (size_t i = 1; i < parallelism; ++i)
+        {
+            workers.emplace_back(worker);
+        }
+        lk.unlock();
+        worker();
+        for (auto &t : workers)
+        {
+            t.join();
+        }
+        lk.lock();
+
+        if (error)
+        {
+            DestroyConstructed();
+            initialized_ = false;
+            std::rethrow_exception(error);
+        }
+    }
+
+    /// 按构造完成的逆序析构，保证依赖者先于被依赖者析构
+    void Shutdown()
+    {
+        std::lock_guard<std::mutex> _(lock_);
+        DestroyConstructed();
+        initialized_ = false;
+    }
+
+  private:
+    struct Node
+    {
+        std::vector<std::type_index> deps;
+        CreateFunc create;
+        DestroyFunc destroy;
+    };
+
+    SingletonRegistry() = default;
+    SingletonRegistry(const SingletonRegistry &) = delete;
+    ~SingletonRegistry()
+    {
+        Shutdown();
+    }
+
+    void CheckCycle(std::map<std::type_index, size_t> pending,
+                    std::map<std::type_index, std::vector<std::type_index>> &dependents,
+                    std::deque<std::type_index> ready)
+    {
+        size_t visited = 0;
+        while (!ready.empty())
+        {
+            auto type = ready.front();
+            ready.pop_front();
+            ++visited;
+            for (auto &next : dependents[type])
+            {
+                if (--pending[next] == 0)
+                {
+                    ready.push_back(next);
+                }
+            }
+        }
+        if (visited != nodes_.size())
+        {
+            std::ostringstream oss;
+            oss << "singleton dependency cycle among:";
+            for (auto &v : pending)
+            {
+                if (v.second != 0)
+                {
+                    oss << ' ' << GetClearName(v.first.name());
+                }
+            }
+            throw std::runtime_error(oss.str());
+        }
+    }
+
+    void DestroyConstructed()
+    {
+        while (!constructed_.empty())
+        {
+            nodes_.at(constructed_.back()).destroy();
+            constructed_.pop_back();
+        }
+    }
+
+    std::mutex lock_;
+    bool initialized_ = false;
+    std::map<std::type_index, Node> nodes_;
+    std::vector<std::type_index> constructed_;
+};
+
+/// 由 SingletonRegistry 在启动时构造的单例，Deps 为构造前必须就绪的其他 EagerSingleton。
+/// Initialize() 之后 Instance() 只是一次普通的指针读取，没有局部静态变量的初始化检查。
+template <typename T, typename... Deps>
+class EagerSingleton : noncopyable
+{
+  public:
+    static T &Instance() noexcept
+    {
+        return *instance_;
+    }
+
+    static bool Initialized() noexcept
+    {
+        return instance_ != nullptr;
+    }
+
+    /// 登记自身及其依赖，可重复调用
+    static void Regist()
+    {
+        if (SingletonRegistry::Instance().Regist(typeid(T), {std::type_index(typeid(Deps))...}, &Create, &Destroy))
+        {
+            (Deps::Regist(), ...);
+        }
+    }
+
+  protected:
+    EagerSingleton() = default;
+    ~EagerSingleton() = default;
+
+  private:
+    static void Create()
+    {
+        instance_ = new T();
+    }
+
+    static void Destroy()
+    {
+        delete instance_;
+        instance_ = nullptr;
+    }
+
+    static inline T *instance_ = nullptr;
+};
+
+#endif // __cplusplus >= 201703L
+
+
 /// 工厂模板，相同类型的key值，不同的构造函数参数列表，
 /// 会由不同的map管理，更容易创建出多个不同类型的单例工厂实例，但NewProduct时无需类型转换
 template <typename Product_t, typename ProductName_t = std::string, typename... Args>
@@ -123,8 +664,8 @@ class Factory
         std::ostringstream oss;
         for (auto & v : producers_)
         {
-            oss << std::left << std::setw(10) << v.first << " [" << GetClearName(typeid(ProductName_t).name())
-                << "] : [" << GetClearName(typeid(ProduceFuncType).name()) << "]\n";
+            oss << std::left << std::setw(10) << v.first << " [" << TypeName<ProductName_t>()
+                << "] : [" << TypeName<ProduceFuncType>() << "]\n";
         }
         return oss.str();
     }
@@ -183,7 +724,7 @@ class Factory<Product_t, ProductName_t>
         using ProduceFuncType = std::function<std::unique_ptr<Product_t>(Args && ...)>;
 
         ProduceFuncType produce_func;
-        std::any produce_func_registed = it->second;
+        const std::any &produce_func_registed = it->second;
 
         try
         {
@@ -193,9 +734,9 @@ class Factory<Product_t, ProductName_t>
         {
             std::ostringstream oss_err;
             oss_err << "==================================================\n" << e.what() << '\n';
-            oss_err << "registed producer raw type: " << GetClearName(typeid(produce_func_registed).name()) << '\n';
-            oss_err << "registed producer real type: " << GetClearName(produce_func_registed.type().name()) << '\n';
-            oss_err << "target bad_cast_func type: " << GetClearName(typeid(produce_func).name()) << '\n';
+            oss_err << "registed producer raw type: " << TypeName<std::any>() << '\n';
+            oss_err << "registed producer real type: " << GetClearName(produce_func_registed.type()) << '\n';
+            oss_err << "target bad_cast_func type: " << TypeName<ProduceFuncType>() << '\n';
             oss_err << "==================================================";
             throw std::runtime_error(oss_err.str());
         }
@@ -209,8 +750,8 @@ class Factory<Product_t, ProductName_t>
         std::ostringstream oss;
         for (auto & v : producers_)
         {
-            oss << std::left << std::setw(10) << v.first << " [" << GetClearName(typeid(ProductName_t).name())
-                << "] : [" << GetClearName(v.second.type().name()) << "]\n";
+            oss << std::left << std::setw(10) << v.first << " [" << TypeName<ProductName_t>()
+                << "] : [" << GetClearName(v.second.type()) << "]\n";
         }
         return oss.str();
     }
@@ -257,17 +798,158 @@ struct Vistor;
 
 template<typename T, typename ...Types>
 struct Vistor<T, Types...> : Vistor<Types...> {
-	using Vistor<Types...>::Visit;
+	using Vistor<Types...>::visit;
 	virtual void visit(const T&) const = 0;
 	virtual ~Vistor() {}
 };
 
 template<typename T>
 struct Vistor<T> {
-	virtual void visit(const T&) = 0;
+	virtual void visit(const T&) const = 0;
 	virtual ~Vistor() {}
 };
 
+#if __cplusplus >= 201703L
+
+/// 多个 lambda 合并为一个重载集合，配合 visit_static / visit_batched 使用
+template<typename ...Fs>
+struct overloaded : Fs... {
+	using Fs::operator()...;
+};
+template<typename ...Fs>
+overloaded(Fs...) -> overloaded<Fs...>;
+
+namespace detail {
+template<size_t I, typename F, typename Variant>
+decltype(auto) variant_invoke(F& f, Variant& v) {
+	return f(*std::get_if<I>(&v));
+}
+
+template<typename F, typename Variant, typename Seq =
+	std::make_index_sequence<std::variant_size_v<std::remove_const_t<Variant>>>>
+struct variant_dispatch_table;
+
+template<typename F, typename Variant, size_t ...Is>
+struct variant_dispatch_table<F, Variant, std::index_sequence<Is...>> {
+	using result_type = decltype(std::declval<F&>()(*std::get_if<0>(std::declval<Variant*>())));
+	using func_type = result_type (*)(F&, Variant&);
+	static constexpr func_type table[] = { &variant_invoke<Is, F, Variant>... };
+};
+
+// 从 first 开始访问连续的第 I 种类型的元素，返回第一个类型不同的位置。判断与访问在同一遍中，只读一次内存
+template<size_t I, typename It, typename F>
+It variant_run(It first, It last, F& f) {
+	do {
+		f(*std::get_if<I>(&*first));
+	} while (++first != last && first->index() == I);
+	return first;
+}
+
+template<typename It, typename F, typename Seq>
+struct variant_run_table;
+
+template<typename It, typename F, size_t ...Is>
+struct variant_run_table<It, F, std::index_sequence<Is...>> {
+	using func_type = It (*)(It, It, F&);
+	static constexpr func_type table[] = { &variant_run<Is, It, F>... };
+};
+} // namespace detail
+
+/// 编译期生成的分发表，按 index() 直接查表调用，不经过虚函数。
+/// 所有分支的返回类型需与第一个备选类型的一致。
+template<typename F, typename Variant>
+decltype(auto) visit_static(F&& f, Variant& v) {
+	using table_type = detail::variant_dispatch_table<std::remove_reference_t<F>, Variant>;
+	if (v.valueless_by_exception()) {
+		throw std::bad_variant_access();
+	}
+	return table_type::table[v.index()](f, v);
+}
+
+/// 批量访问：按原顺序遍历，每段连续的同类型元素只查一次分发表，段内是没有间接跳转的紧凑循环。
+/// 不分配内存。类型交错排列时退化为逐个分发，与 visit_static 相当；
+/// 处理顺序无关时先用 group_by_type 原地归并同类型元素，需要长期按类型处理时用 VariantBatch。
+template<typename Range, typename F>
+void visit_batched(Range& items, F&& f) {
+	auto it = std::begin(items);
+	auto last = std::end(items);
+	using iterator = decltype(it);
+	using elem_type = std::remove_reference_t<decltype(*it)>;
+	constexpr size_t N = std::variant_size_v<std::remove_const_t<elem_type>>;
+	using table_type = detail::variant_run_table<iterator, std::remove_reference_t<F>, std::make_index_sequence<N>>;
+
+	while (it != last) {
+		if (it->valueless_by_exception()) {
+			throw std::bad_variant_access();
+		}
+		it = table_type::table[it->index()](it, last, f);
+	}
+}
+
+/// 原地把同类型元素移到一起（按备选类型的序号排列，同类型内的顺序不保证），之后 visit_batched 每种类型只分发一次
+template<typename Range>
+void group_by_type(Range& items) {
+	using elem_type = std::remove_reference_t<decltype(*std::begin(items))>;
+	constexpr size_t N = std::variant_size_v<std::remove_const_t<elem_type>>;
+	auto it = std::begin(items);
+	for (size_t i = 0; i + 1 < N; ++i) {
+		it = std::partition(it, std::end(items), [i](const elem_type& v) { return v.index() == i; });
+	}
+}
+
+/// 按类型分开存储的异构容器，每种类型一个连续数组，visit 时逐类型顺序遍历。
+/// 适合“先收集、后统一处理”的场景；要求 Types 互不相同。
+template<typename ...Types>
+class VariantBatch {
+public:
+	template<typename T, typename = std::enable_if_t<!std::is_same_v<std::decay_t<T>, std::variant<Types...>>>>
+	void push(T&& v) {
+		std::get<std::vector<std::decay_t<T>>>(_items).emplace_back(std::forward<T>(v));
+	}
+	template<typename T, typename ...Args>
+	T& emplace(Args&&... args) {
+		return std::get<std::vector<T>>(_items).emplace_back(std::forward<Args>(args)...);
+	}
+	void push(const std::variant<Types...>& v) {
+		visit_static([this](const auto& alt) { push(alt); }, v);
+	}
+	template<typename F>
+	void visit(F&& f) {
+		std::apply([&](auto&... vecs) {
+			(for_each_of(vecs, f), ...);
+		}, _items);
+	}
+	template<typename F>
+	void visit(F&& f) const {
+		std::apply([&](const auto&... vecs) {
+			(for_each_of(vecs, f), ...);
+		}, _items);
+	}
+	template<typename T>
+	const std::vector<T>& of() const {
+		return std::get<std::vector<T>>(_items);
+	}
+	size_t size() const {
+		return std::apply([](const auto&... vecs) { return (vecs.size() + ... + size_t(0)); }, _items);
+	}
+	bool empty() const {
+		return size() == 0;
+	}
+	void clear() {
+		std::apply([](auto&... vecs) { (vecs.clear(), ...); }, _items);
+	}
+private:
+	template<typename Vec, typename F>
+	static void for_each_of(Vec& vec, F& f) {
+		for (auto& v : vec) {
+			f(v);
+		}
+	}
+	std::tuple<std::vector<Types>...> _items;
+};
+
+#endif // __cplusplus >= 201703L
+
 template<typename ExecuteFunction>
 struct Command {
 	template<class F, class ...BindArgs>
@@ -423,3 +1105,447 @@ public:
 private:
 	std::deque<T*> _objs;
 };
+
+#if __cplusplus >= 201703L
+
+namespace detail {
+inline size_t round_up_pow2(size_t n) {
+	size_t v = 1;
+	while (v < n) {
+		v <<= 1;
+	}
+	return v;
+}
+
+inline void cpu_relax() noexcept {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+	asm volatile("yield" ::: "memory");
+#else
+	std::this_thread::yield();
+#endif
+}
+} // namespace detail
+
+/// 单生产者单消费者的无锁环形队列，push/pop 均为 wait-free。
+/// 容量向上取整为 2 的幂；读写下标各占一个缓存行，并各自缓存对方下标以减少缓存行往返。
+template<typename T>
+class SpscQueue : noncopyable {
+public:
+	explicit SpscQueue(size_t capacity)
+		: _mask(detail::round_up_pow2(std::max<size_t>(capacity, 2)) - 1)
+		, _slots(new Slot[_mask + 1]) {}
+	~SpscQueue() {
+		const size_t tail = _tail.load(std::memory_order_acquire);
+		for (size_t i = _head.load(std::memory_order_relaxed); i != tail; ++i) {
+			_slots[i & _mask].get()->~T();
+		}
+	}
+
+	template<typename ...Args>
+	bool try_emplace(Args&&... args) {
+		const size_t tail = _tail.load(std::memory_order_relaxed);
+		if (tail - _head_cache == _mask + 1) {
+			_head_cache = _head.load(std::memory_order_acquire);
+			if (tail - _head_cache == _mask + 1) {
+				return false;
+			}
+		}
+		new (_slots[tail & _mask].data) T(std::forward<Args>(args)...);
+		_tail.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+	bool try_push(const T& v) {
+		return try_emplace(v);
+	}
+	bool try_push(T&& v) {
+		return try_emplace(std::move(v));
+	}
+	bool try_pop(T& out) {
+		const size_t head = _head.load(std::memory_order_relaxed);
+		if (head == _tail_cache) {
+			_tail_cache = _tail.load(std::memory_order_acquire);
+			if (head == _tail_cache) {
+				return false;
+			}
+		}
+		T* p = _slots[head & _mask].get();
+		out = std::move(*p);
+		p->~T();
+		_head.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+	/// 批量入队，返回实际入队个数；整批只发布一次 tail
+	template<typename InputIt>
+	size_t try_push_batch(InputIt first, size_t n) {
+		const size_t tail = _tail.load(std::memory_order_relaxed);
+		if (_mask + 1 - (tail - _head_cache) < n) {
+			_head_cache = _head.load(std::memory_order_acquire);
+		}
+		n = std::min(n, _mask + 1 - (tail - _head_cache));
+		for (size_t i = 0; i < n; ++i, ++first) {
+			new (_slots[(tail + i) & _mask].data) T(std::move(*first));
+		}
+		if (n) {
+			_tail.store(tail + n, std::memory_order_release);
+		}
+		return n;
+	}
+	/// 批量出队到 out，最多 max 个，返回实际个数
+	template<typename OutputIt>
+	size_t try_pop_batch(OutputIt out, size_t max) {
+		const size_t head = _head.load(std::memory_order_relaxed);
+		if (_tail_cache - head < max) {
+			_tail_cache = _tail.load(std::memory_order_acquire);
+		}
+		const size_t n = std::min(max, _tail_cache - head);
+		for (size_t i = 0; i < n; ++i, ++out) {
+			T* p = _slots[(head + i) & _mask].get();
+			*out = std::move(*p);
+			p->~T();
+		}
+		if (n) {
+			_head.store(head + n, std::memory_order_release);
+		}
+		return n;
+	}
+
+	size_t capacity() const noexcept {
+		return _mask + 1;
+	}
+	size_t size_approx() const noexcept {
+		return _tail.load(std::memory_order_acquire) - _head.load(std::memory_order_acquire);
+	}
+	bool empty() const noexcept {
+		return size_approx() == 0;
+	}
+private:
+	struct Slot {
+		alignas(T) unsigned char data[sizeof(T)];
+		T* get() noexcept {
+			return std::launder(reinterpret_cast<T*>(data));
+		}
+	};
+
+	const size_t _mask;
+	const std::unique_ptr<Slot[]> _slots;
+	// 消费者独占
+	alignas(kCacheLineSize) std::atomic<size_t> _head{0};
+	size_t _tail_cache = 0;
+	// 生产者独占
+	alignas(kCacheLineSize) std::atomic<size_t> _tail{0};
+	size_t _head_cache = 0;
+	char _pad[kCacheLineSize - sizeof(std::atomic<size_t>) - sizeof(size_t)];
+};
+
+/// 多生产者多消费者的有界无锁队列（Dmitry Vyukov 的序号环形数组算法）。
+/// 每个槽位带序号，生产者/消费者通过一次 CAS 抢占位置；批量操作一次 CAS 抢占连续多个槽位。
+template<typename T>
+class MpmcQueue : noncopyable {
+public:
+	explicit MpmcQueue(size_t capacity)
+		: _mask(detail::round_up_pow2(std::max<size_t>(capacity, 2)) - 1)
+		, _cells(new Cell[_mask + 1]) {
+		for (size_t i = 0; i <= _mask; ++i) {
+			_cells[i].seq.store(i, std::memory_order_relaxed);
+		}
+	}
+	~MpmcQueue() {
+		for (size_t i = 0; i <= _mask; ++i) {
+			// 已写入未取走的槽位序号比其下标大 1（模容量）
+			if ((_cells[i].seq.load(std::memory_order_acquire) & _mask) == ((i + 1) & _mask)) {
+				_cells[i].get()->~T();
+			}
+		}
+	}
+
+	template<typename ...Args>
+	bool try_emplace(Args&&... args) {
+		size_t pos = _enqueue_pos.load(std::memory_order_relaxed);
+		Cell* cell;
+		while (true) {
+			cell = &_cells[pos & _mask];
+			const size_t seq = cell->seq.load(std::memory_order_acquire);
+			const intptr_t diff = intptr_t(seq) - intptr_t(pos);
+			if (diff == 0) {
+				if (_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					break;
+				}
+			} else if (diff < 0) {
+				return false;
+			} else {
+				pos = _enqueue_pos.load(std::memory_order_relaxed);
+			}
+		}
+		new (cell->data) T(std::forward<Args>(args)...);
+		cell->seq.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+	bool try_push(const T& v) {
+		return try_emplace(v);
+	}
+	bool try_push(T&& v) {
+		return try_emplace(std::move(v));
+	}
+	bool try_pop(T& out) {
+		size_t pos = _dequeue_pos.load(std::memory_order_relaxed);
+		Cell* cell;
+		while (true) {
+			cell = &_cells[pos & _mask];
+			const size_t seq = cell->seq.load(std::memory_order_acquire);
+			const intptr_t diff = intptr_t(seq) - intptr_t(pos + 1);
+			if (diff == 0) {
+				if (_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					break;
+				}
+			} else if (diff < 0) {
+				return false;
+			} else {
+				pos = _dequeue_pos.load(std::memory_order_relaxed);
+			}
+		}
+		T* p = cell->get();
+		out = std::move(*p);
+		p->~T();
+		cell->seq.store(pos + _mask + 1, std::memory_order_release);
+		return true;
+	}
+
+	/// 批量入队：统计从当前位置起连续空闲的槽位数，一次 CAS 全部占下，返回实际入队个数
+	template<typename InputIt>
+	size_t try_push_batch(InputIt first, size_t n) {
+		size_t pos = _enqueue_pos.load(std::memory_order_relaxed);
+		size_t k;
+		while (true) {
+			k = 0;
+			while (k < n && k <= _mask &&
+				   _cells[(pos + k) & _mask].seq.load(std::memory_order_acquire) == pos + k) {
+				++k;
+			}
+			if (k == 0) {
+				const size_t seq = _cells[pos & _mask].seq.load(std::memory_order_acquire);
+				if (intptr_t(seq) - intptr_t(pos) < 0) {
+					return 0;
+				}
+				pos = _enqueue_pos.load(std::memory_order_relaxed);
+				continue;
+			}
+			if (_enqueue_pos.compare_exchange_weak(pos, pos + k, std::memory_order_relaxed)) {
+				break;
+			}
+		}
+		for (size_t i = 0; i < k; ++i, ++first) {
+			Cell& cell = _cells[(pos + i) & _mask];
+			new (cell.data) T(std::move(*first));
+			cell.seq.store(pos + i + 1, std::memory_order_release);
+		}
+		return k;
+	}
+	/// 批量出队：一次 CAS 占下连续已就绪的槽位，最多 max 个，返回实际个数
+	template<typename OutputIt>
+	size_t try_pop_batch(OutputIt out, size_t max) {
+		size_t pos = _dequeue_pos.load(std::memory_order_relaxed);
+		size_t k;
+		while (true) {
+			k = 0;
+			while (k < max && k <= _mask &&
+				   _cells[(pos + k) & _mask].seq.load(std::memory_order_acquire) == pos + k + 1) {
+				++k;
+			}
+			if (k == 0) {
+				const size_t seq = _cells[pos & _mask].seq.load(std::memory_order_acquire);
+				if (intptr_t(seq) - intptr_t(pos + 1) < 0) {
+					return 0;
+				}
+				pos = _dequeue_pos.load(std::memory_order_relaxed);
+				continue;
+			}
+			if (_dequeue_pos.compare_exchange_weak(pos, pos + k, std::memory_order_relaxed)) {
+				break;
+			}
+		}
+		for (size_t i = 0; i < k; ++i, ++out) {
+			Cell& cell = _cells[(pos + i) & _mask];
+			T* p = cell.get();
+			*out = std::move(*p);
+			p->~T();
+			cell.seq.store(pos + i + _mask + 1, std::memory_order_release);
+		}
+		return k;
+	}
+
+	size_t capacity() const noexcept {
+		return _mask + 1;
+	}
+	size_t size_approx() const noexcept {
+		const size_t enq = _enqueue_pos.load(std::memory_order_acquire);
+		const size_t deq = _dequeue_pos.load(std::memory_order_acquire);
+		return enq > deq ? enq - deq : 0;
+	}
+	bool empty() const noexcept {
+		return size_approx() == 0;
+	}
+private:
+	struct Cell {
+		std::atomic<size_t> seq;
+		alignas(T) unsigned char data[sizeof(T)];
+		T* get() noexcept {
+			return std::launder(reinterpret_cast<T*>(data));
+		}
+	};
+
+	const size_t _mask;
+	const std::unique_ptr<Cell[]> _cells;
+	alignas(kCacheLineSize) std::atomic<size_t> _enqueue_pos{0};
+	alignas(kCacheLineSize) std::atomic<size_t> _dequeue_pos{0};
+	char _pad[kCacheLineSize - sizeof(std::atomic<size_t>)];
+};
+
+namespace detail {
+/// AdaptiveLock 的争用计数；不记录时为空基类，不占锁对象的空间
+template<bool Stats>
+struct LockCounters {
+	std::atomic<uint64_t> _acquisitions{0};
+	std::atomic<uint64_t> _contended{0};
+	std::atomic<uint64_t> _spin_acquired{0};
+	std::atomic<uint64_t> _parked{0};
+};
+
+template<>
+struct LockCounters<false> {};
+} // namespace detail
+
+/// 先自旋后休眠的自适应锁，可直接作为 ObjectPool / MultiDownload 的 LockType。
+/// 争用时按指数退避执行 pause 自旋，超出自旋预算后在 futex 上休眠；
+/// 自旋预算根据最近几次“自旋多久拿到锁”动态调整：持锁时间短则多自旋，长则少自旋尽早休眠。
+/// Stats 为 true 时记录争用计数，为 false 时计数代码与计数字段在编译期去掉，锁只占 8 字节。
+template<bool Stats = false>
+class AdaptiveLock : detail::LockCounters<Stats> {
+public:
+	AdaptiveLock() = default;
+	AdaptiveLock(const AdaptiveLock&) = delete;
+	AdaptiveLock& operator=(const AdaptiveLock&) = delete;
+
+	struct Counters {
+		uint64_t acquisitions;  // 总加锁次数
+		uint64_t contended;     // 首次 CAS 失败、进入慢路径的次数
+		uint64_t spin_acquired; // 在自旋阶段拿到锁的次数
+		uint64_t parked;        // 进入 futex 休眠的次数
+	};
+
+	void lock() noexcept {
+		uint32_t expected = kUnlocked;
+		if (!_state.compare_exchange_strong(expected, kLocked, std::memory_order_acquire)) {
+			lock_slow();
+		}
+		if constexpr (Stats) {
+			this->_acquisitions.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+	bool try_lock() noexcept {
+		uint32_t expected = kUnlocked;
+		if (!_state.compare_exchange_strong(expected, kLocked, std::memory_order_acquire)) {
+			return false;
+		}
+		if constexpr (Stats) {
+			this->_acquisitions.fetch_add(1, std::memory_order_relaxed);
+		}
+		return true;
+	}
+	void unlock() noexcept {
+		if (_state.exchange(kUnlocked, std::memory_order_release) == kParked) {
+			wake_one();
+		}
+	}
+
+	/// Stats 为 false 时全为 0
+	Counters counters() const noexcept {
+		if constexpr (Stats) {
+			return Counters{this->_acquisitions.load(std::memory_order_relaxed),
+							this->_contended.load(std::memory_order_relaxed),
+							this->_spin_acquired.load(std::memory_order_relaxed),
+							this->_parked.load(std::memory_order_relaxed)};
+		} else {
+			return Counters{0, 0, 0, 0};
+		}
+	}
+	/// 当前的自旋预算（pause 次数）
+	int spin_budget() const noexcept {
+		return _spin_budget.load(std::memory_order_relaxed);
+	}
+private:
+	static constexpr uint32_t kUnlocked = 0;
+	static constexpr uint32_t kLocked = 1;
+	static constexpr uint32_t kParked = 2;  // 已加锁且可能有线程在休眠
+	static constexpr int kMinSpin = 16;
+	static constexpr int kMaxSpin = 4096;
+	static constexpr int kMaxBackoff = 64;
+
+	void lock_slow() noexcept {
+		if constexpr (Stats) {
+			this->_contended.fetch_add(1, std::memory_order_relaxed);
+		}
+		const int budget = _spin_budget.load(std::memory_order_relaxed);
+		int spins = 0;
+		for (int backoff = 1; spins < budget; backoff = std::min(backoff * 2, kMaxBackoff)) {
+			for (int i = 0; i < backoff; ++i) {
+				detail::cpu_relax();
+			}
+			spins += backoff;
+			uint32_t expected = kUnlocked;
+			if (_state.load(std::memory_order_relaxed) == kUnlocked &&
+				_state.compare_exchange_weak(expected, kLocked, std::memory_order_acquire)) {
+				// 自旋有效：预算向实际所需的两倍靠拢
+				adjust_budget(budget, budget + (std::min(spins * 2, kMaxSpin) - budget) / 8);
+				if constexpr (Stats) {
+					this->_spin_acquired.fetch_add(1, std::memory_order_relaxed);
+				}
+				return;
+			}
+		}
+		// 自旋无效：持锁时间超出预算，缩减预算以便下次更早休眠
+		adjust_budget(budget, budget - budget / 8);
+
+		uint32_t state = _state.exchange(kParked, std::memory_order_acquire);
+		while (state != kUnlocked) {
+			if constexpr (Stats) {
+				this->_parked.fetch_add(1, std::memory_order_relaxed);
+			}
+			wait(kParked);
+			state = _state.exchange(kParked, std::memory_order_acquire);
+		}
+	}
+	// 预算与 _state 在同一缓存行，等待者都在读这一行，预算收敛后不再写入
+	void adjust_budget(int current, int budget) noexcept {
+		budget = std::clamp(budget, kMinSpin, kMaxSpin);
+		if (budget != current) {
+			_spin_budget.store(budget, std::memory_order_relaxed);
+		}
+	}
+	void wait(uint32_t expected) noexcept {
+#ifdef __linux__
+		syscall(SYS_futex, reinterpret_cast<uint32_t*>(&_state), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+#elif defined(__cpp_lib_atomic_wait)
+		_state.wait(expected, std::memory_order_relaxed);
+#else
+		if (_state.load(std::memory_order_relaxed) == expected) {
+			std::this_thread::yield();
+		}
+#endif
+	}
+	void wake_one() noexcept {
+#ifdef __linux__
+		syscall(SYS_futex, reinterpret_cast<uint32_t*>(&_state), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+#elif defined(__cpp_lib_atomic_wait)
+		_state.notify_one();
+#endif
+	}
+
+	static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex needs a plain 32-bit word");
+	std::atomic<uint32_t> _state{kUnlocked};
+	std::atomic<int> _spin_budget{256};
+};
+
+#endif // __cplusplus >= 201703L
@@ -0,0 +1,376 @@
+#ifndef _DOWNLOAD_COROUTINE_H_
+#define _DOWNLOAD_COROUTINE_H_
+
+/*
+MultiDownload 的 C++20 协程接口，例如
+
+	Task<size_t> modelSize(MultiDownload<>& download, std::string url) {
+		FetchResult r = co_await fetch(download, url);
+		co_return r.ok() ? r.body.size() : 0;
+	}
+	std::vector<Task<size_t>> tasks;
+	for (auto& url : urls) {
+		tasks.push_back(modelSize(download, url));
+	}
+	std::vector<size_t> sizes = syncWait(whenAll(std::move(tasks)));
+
+请求结束时由下载线程（背压模式下为消费线程）在 RESULT 回调中直接恢复等待的协程，不需要轮询。
+因此 co_await 之后的代码运行在下载线程上：不能阻塞等待其他请求，也不能析构 MultiDownload。
+MultiDownload 被强制停止（未 join 就析构）时进行中的请求不再回调，等待它们的协程不会恢复。
+带捕获的 lambda 协程通过闭包访问捕获的变量，闭包须在协程结束前一直有效，不能是临时对象。
+*/
+
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include "multi_download.h"
+
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
+#include <coroutine>
+
+template<typename T = void>
+class Task;
+
+namespace coro_detail {
+
+// 协程结束时转到等待它的协程，没有等待者时挂起，由 Task 析构释放
+struct FinalAwaiter {
+	bool await_ready() noexcept {
+		return false;
+	}
+	template<typename Promise>
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept {
+		std::coroutine_handle<> next = h.promise().continuation;
+		return next ? next : std::noop_coroutine();
+	}
+	void await_resume() noexcept {}
+};
+
+struct PromiseBase {
+	std::coroutine_handle<> continuation;
+	std::exception_ptr error;
+
+	std::suspend_always initial_suspend() noexcept {
+		return {};
+	}
+	FinalAwaiter final_suspend() noexcept {
+		return {};
+	}
+	void unhandled_exception() noexcept {
+		error = std::current_exception();
+	}
+};
+
+template<typename T>
+struct Promise : PromiseBase {
+	std::optional<T> value;
+
+	template<typename U>
+	void return_value(U&& v) {
+		value.emplace(std::forward<U>(v));
+	}
+	T result() {
+		if (error) {
+			std::rethrow_exception(error);
+		}
+		return std::move(*value);
+	}
+};
+
+template<>
+struct Promise<void> : PromiseBase {
+	void return_void() noexcept {}
+	void result() {
+		if (error) {
+			std::rethrow_exception(error);
+		}
+	}
+};
+
+// 立即开始、结束时自行释放的协程，用于同时启动多个 Task
+struct Detached {
+	struct promise_type {
+		Detached get_return_object() noexcept {
+			return {};
+		}
+		std::suspend_never initial_suspend() noexcept {
+			return {};
+		}
+		std::suspend_never final_suspend() noexcept {
+			return {};
+		}
+		void return_void() noexcept {}
+		void unhandled_exception() noexcept {
+			std::terminate();
+		}
+	};
+};
+
+template<typename T>
+struct Outcome {
+	std::optional<T> value;
+	std::exception_ptr error;
+	T get() {
+		if (error) {
+			std::rethrow_exception(error);
+		}
+		return std::move(*value);
+	}
+};
+
+template<>
+struct Outcome<void> {
+	std::exception_ptr error;
+	void get() {
+		if (error) {
+			std::rethrow_exception(error);
+		}
+	}
+};
+
+// 等待 task 结束，结果存入 out 后调用 done；done 按值保存在协程帧中
+template<typename T, typename F>
+Detached drive(Task<T>& task, Outcome<T>& out, F done) {
+	try {
+		if constexpr (std::is_void_v<T>) {
+			co_await task;
+		} else {
+			out.value.emplace(co_await task);
+		}
+	} catch (...) {
+		out.error = std::current_exception();
+	}
+	done();
+}
+
+// 计数归零时恢复等待者。等待者自己也占一个计数，子任务在启动过程中就全部完成时不会提前恢复
+class Latch {
+public:
+	explicit Latch(size_t count) : m_count(count + 1) {}
+	void arrive() {
+		if (m_count.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+			m_waiter.resume();
+		}
+	}
+	bool await_ready() const noexcept {
+		return false;
+	}
+	bool await_suspend(std::coroutine_handle<> h) noexcept {
+		m_waiter = h;
+		return m_count.fetch_sub(1, std::memory_order_acq_rel) > 1;
+	}
+	void await_resume() noexcept {}
+private:
+	std::atomic<size_t> m_count;
+	std::coroutine_handle<> m_waiter;
+};
+
+} // namespace coro_detail
+
+/// 惰性开始的协程：被 co_await 或交给 whenAll/whenAny/syncWait 时才开始执行，结束后恢复等待者。
+/// 只能被等待一次，协程内未捕获的异常在等待处重新抛出
+template<typename T>
+class Task {
+public:
+	struct promise_type : coro_detail::Promise<T> {
+		Task get_return_object() noexcept {
+			return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+	};
+
+	Task(Task&& rhs) noexcept : m_handle(std::exchange(rhs.m_handle, nullptr)) {}
+	Task& operator=(Task&& rhs) noexcept {
+		if (this != &rhs) {
+			reset();
+			m_handle = std::exchange(rhs.m_handle, nullptr);
+		}
+		return *this;
+	}
+	Task(const Task&) = delete;
+	Task& operator=(const Task&) = delete;
+	~Task() {
+		reset();
+	}
+
+	bool await_ready() const noexcept {
+		return false;
+	}
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> waiter) noexcept {
+		m_handle.promise().continuation = waiter;
+		return m_handle;
+	}
+	T await_resume() {
+		return m_handle.promise().result();
+	}
+private:
+	explicit Task(std::coroutine_handle<promise_type> handle) : m_handle(handle) {}
+	void reset() {
+		if (m_handle) {
+			m_handle.destroy();
+			m_handle = nullptr;
+		}
+	}
+
+	std::coroutine_handle<promise_type> m_handle;
+};
+
+/// co_await fetch(...) 的结果
+struct FetchResult {
+	DownloadResult result = E_MEMORY;
+	uint64_t fileSize = 0;          // Content-Length，没有时为 0
+	std::string body;               // 请求设置了 sink 时为空，数据已交给 sink
+
+	bool ok() const {
+		return result == E_OK;
+	}
+};
+
+/// 提交请求并挂起，RESULT 回调中恢复。MultiDownload 已停止、无法提交时不挂起，结果为 E_MEMORY
+template<typename LockType>
+class FetchAwaiter {
+public:
+	typedef typename MultiDownload<LockType>::Request Request;
+
+	FetchAwaiter(MultiDownload<LockType>& download, Request&& request)
+	:m_download(download)
+	,m_request(std::move(request))
+	{}
+
+	bool await_ready() const noexcept {
+		return false;
+	}
+	bool await_suspend(std::coroutine_handle<> waiter) {
+		m_waiter = waiter;
+		// 请求被移走后不能再看 sink；有 sink 时数据不经过 body，不预留
+		bool collect = !m_request.sink;
+		m_request.cb = [this, collect](const char*, const char*, const CallbackData& data) {
+			if (data.type == FILESIZE) {
+				m_result.fileSize = data.fileSize;
+				if (collect) {
+					m_result.body.reserve(std::min<size_t>(data.fileSize, 64 << 20));
+				}
+			} else if (data.type == CONTENT) {
+				m_result.body.append(data.data, data.size);
+			} else if (data.type == RESULT) {
+				m_result.result = data.result;
+				m_waiter.resume();
+			}
+		};
+		// 提交成功后回调可能已在下载线程上恢复并结束了协程，不能再访问成员
+		if (!m_download.submit(std::move(m_request))) {
+			m_result.result = E_MEMORY;
+			return false;
+		}
+		return true;
+	}
+	FetchResult await_resume() {
+		return std::move(m_result);
+	}
+private:
+	MultiDownload<LockType>& m_download;
+	Request m_request;
+	std::coroutine_handle<> m_waiter;
+	FetchResult m_result;
+};
+
+/// 下载 url，响应体保存在 FetchResult::body 中
+template<typename LockType>
+FetchAwaiter<LockType> fetch(MultiDownload<LockType>& download, const std::string& url, int timeout_ms = 0, DownloadPriority priority = PRIORITY_NORMAL) {
+	typename MultiDownload<LockType>::Request request;
+	request.fileId = url;
+	request.url = url;
+	request.timeout_ms = timeout_ms;
+	request.priority = priority;
+	return FetchAwaiter<LockType>(download, std::move(request));
+}
+
+/// 任意请求（POST、sink、摘要校验等），request.cb 被忽略
+template<typename LockType>
+FetchAwaiter<LockType> fetch(MultiDownload<LockType>& download, typename MultiDownload<LockType>::Request request) {
+	return FetchAwaiter<LockType>(download, std::move(request));
+}
+
+/// 同时开始所有任务，全部结束后按原顺序返回结果；有任务抛出异常时在全部结束后抛出第一个
+template<typename T>
+Task<std::vector<T>> whenAll(std::vector<Task<T>> tasks) {
+	std::vector<coro_detail::Outcome<T>> outcomes(tasks.size());
+	coro_detail::Latch latch(tasks.size());
+	for (size_t i = 0; i < tasks.size(); ++i) {
+		coro_detail::drive(tasks[i], outcomes[i], [&latch] { latch.arrive(); });
+	}
+	co_await latch;
+	std::vector<T> results;
+	results.reserve(outcomes.size());
+	for (auto& outcome : outcomes) {
+		results.push_back(outcome.get());
+	}
+	co_return results;
+}
+
+inline Task<void> whenAll(std::vector<Task<void>> tasks) {
+	std::vector<coro_detail::Outcome<void>> outcomes(tasks.size());
+	coro_detail::Latch latch(tasks.size());
+	for (size_t i = 0; i < tasks.size(); ++i) {
+		coro_detail::drive(tasks[i], outcomes[i], [&latch] { latch.arrive(); });
+	}
+	co_await latch;
+	for (auto& outcome : outcomes) {
+		outcome.get();
+	}
+}
+
+/// 同时开始所有任务，返回最先结束的一个的序号与结果。tasks 不能为空。
+/// 其余任务在后台继续执行，结束后自行释放；需要中止时给请求设置 cancelToken 并调用 MultiDownload::cancel
+template<typename T>
+Task<std::pair<size_t, T>> whenAny(std::vector<Task<T>> tasks) {
+	struct State {
+		std::vector<Task<T>> tasks;
+		std::vector<coro_detail::Outcome<T>> outcomes;
+		std::atomic<bool> decided{false};
+		size_t winner = 0;
+		coro_detail::Latch latch{1};
+	};
+	auto state = std::make_shared<State>();
+	state->tasks = std::move(tasks);
+	state->outcomes.resize(state->tasks.size());
+	for (size_t i = 0; i < state->tasks.size(); ++i) {
+		// 每个子任务持有 state，最后结束的一个释放它
+		coro_detail::drive(state->tasks[i], state->outcomes[i], [state, i] {
+			if (!state->decided.exchange(true)) {
+				state->winner = i;
+				state->latch.arrive();
+			}
+		});
+	}
+	co_await state->latch;
+	size_t winner = state->winner;
+	co_return std::make_pair(winner, state->outcomes[winner].get());
+}
+
+/// 在当前线程上阻塞等待任务结束，用于 main 等非协程代码；不能在下载线程上调用
+template<typename T>
+T syncWait(Task<T> task) {
+	struct State {
+		std::mutex lock;
+		std::condition_variable cv;
+		bool done = false;
+		coro_detail::Outcome<T> outcome;
+	};
+	// 通知之后本函数可能立即返回，状态由通知方共同持有
+	auto state = std::make_shared<State>();
+	coro_detail::drive(task, state->outcome, [state] {
+		std::lock_guard<std::mutex> _(state->lock);
+		state->done = true;
+		state->cv.notify_all();
+	});
+	{
+		std::unique_lock<std::mutex> lk(state->lock);
+		state->cv.wait(lk, [&] { return state->done; });
+	}
+	return state->outcome.get();
+}
+#endif
+
+#endif
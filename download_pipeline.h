@@ -0,0 +1,399 @@
+#ifndef _DOWNLOAD_PIPELINE_H_
+#define _DOWNLOAD_PIPELINE_H_
+
+/*
+可组合的 DownloadSink：每个 sink 把处理后的数据交给下一个 sink，例如
+
+	auto file = std::make_shared<FileSink>("model.bin");
+	auto sink = std::make_shared<AsyncSink>(std::make_shared<InflateSink>(INFLATE_GZIP, file));
+	download.addDownload("model", url, 0, sink, cb);
+
+边下载边解压，解压在 AsyncSink 的线程上进行，下载线程只把数据块放入有界队列，
+模型可用的时间接近网络与解压耗时中较大的一个，而不是两者之和。
+
+上传方向 GzipSource 包装一个 UploadSource，发送时边读边压缩：
+
+	auto body = std::make_shared<GzipSource>(std::make_shared<FileSource>("log.txt"));
+	download.addPost("log", url, body, 0, cb);
+*/
+
+#include <climits>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "zlib.h"
+#include "design_pattern.h"
+#include "multi_download.h"
+
+/// 数据保存在内存中，RESULT 回调之后可以读取
+class MemorySink : public DownloadSink {
+public:
+	explicit MemorySink(size_t maxReserve = 64 << 20) : m_maxReserve(maxReserve) {}
+	void reserve(size_t size) override {
+		m_data.reserve(std::min(size, m_maxReserve));
+	}
+	bool write(const char* data, size_t size) override {
+		m_data.append(data, size);
+		return true;
+	}
+	bool finish(DownloadResult) override {
+		return true;
+	}
+	const std::string& data() const {
+		return m_data;
+	}
+	std::string take() {
+		return std::move(m_data);
+	}
+private:
+	std::string m_data;
+	size_t m_maxReserve;
+};
+
+enum InflateFormat {
+	INFLATE_RAW,        // 不带头的 deflate 数据
+	INFLATE_ZLIB,
+	INFLATE_GZIP,       // 支持多个 gzip 成员首尾相连
+	INFLATE_AUTO        // 根据数据头判断 zlib 或 gzip
+};
+
+/// 流式解压，解压后的数据按 chunkSize 分块交给下一个 sink。
+/// 数据错误时 write 返回 false；下载成功但压缩流不完整时 finish 返回 false
+class InflateSink : public DownloadSink {
+public:
+	InflateSink(InflateFormat format, std::shared_ptr<DownloadSink> next, size_t chunkSize = 256 << 10)
+	:m_next(next)
+	,m_format(format)
+	,m_chunkSize(chunkSize)
+	,m_out(new unsigned char[chunkSize])
+	,m_init(false)
+	,m_ended(false)
+	{
+		memset(&m_strm, 0, sizeof(m_strm));
+	}
+	~InflateSink() {
+		if (m_init) {
+			inflateEnd(&m_strm);
+		}
+	}
+	void header(const char* data, size_t size) override {
+		m_next->header(data, size);
+	}
+	// Content-Length 是压缩后的大小，不转发 reserve
+	bool write(const char* data, size_t size) override {
+		if (!m_init) {
+			if (inflateInit2(&m_strm, windowBits()) != Z_OK) {
+				return false;
+			}
+			m_init = true;
+		}
+		m_strm.next_in = (Bytef*)data;
+		m_strm.avail_in = (uInt)size;
+		while (m_strm.avail_in > 0) {
+			if (m_ended) {
+				// gzip 允许多个成员首尾相连，其他格式忽略流结束后的数据
+				if (m_format != INFLATE_GZIP && m_format != INFLATE_AUTO) {
+					return true;
+				}
+				inflateReset(&m_strm);
+				m_ended = false;
+			}
+			m_strm.next_out = m_out.get();
+			m_strm.avail_out = (uInt)m_chunkSize;
+			int ret = inflate(&m_strm, Z_NO_FLUSH);
+			if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+				return false;
+			}
+			size_t have = m_chunkSize - m_strm.avail_out;
+			if (have && !m_next->write((const char*)m_out.get(), have)) {
+				return false;
+			}
+			if (ret == Z_STREAM_END) {
+				m_ended = true;
+			} else if (ret == Z_BUF_ERROR && have == 0) {
+				break;
+			}
+		}
+		return true;
+	}
+	bool finish(DownloadResult result) override {
+		if (result == E_OK && !m_ended) {
+			m_next->finish(E_WRITEFAIL);
+			return false;
+		}
+		return m_next->finish(result);
+	}
+private:
+	int windowBits() const {
+		switch (m_format) {
+		case INFLATE_RAW:
+			return -MAX_WBITS;
+		case INFLATE_ZLIB:
+			return MAX_WBITS;
+		case INFLATE_GZIP:
+			return MAX_WBITS + 16;
+		default:
+			return MAX_WBITS + 32;
+		}
+	}
+
+	std::shared_ptr<DownloadSink> m_next;
+	InflateFormat m_format;
+	size_t m_chunkSize;
+	std::unique_ptr<unsigned char[]> m_out;
+	z_stream m_strm;
+	bool m_init;
+	bool m_ended;
+};
+
+/// 发送时压缩的 gzip 请求体，带 Content-Encoding: gzip，长度未知因此以 chunked 编码发送。
+/// 内层有 data() 时直接从其内存压缩，否则每次读 chunkSize 字节
+class GzipSource : public UploadSource {
+public:
+	explicit GzipSource(std::shared_ptr<UploadSource> inner, int level = Z_DEFAULT_COMPRESSION, size_t chunkSize = 64 << 10)
+	:m_inner(inner)
+	,m_level(level)
+	,m_chunkSize(chunkSize)
+	,m_init(false)
+	,m_flushed(false)
+	,m_ended(false)
+	,m_next(NULL)
+	,m_left(0)
+	{
+		memset(&m_strm, 0, sizeof(m_strm));
+	}
+	~GzipSource() {
+		if (m_init) {
+			deflateEnd(&m_strm);
+		}
+	}
+	int64_t size() const override {
+		return -1;
+	}
+	int64_t read(char* buffer, size_t size) override {
+		if (!m_init) {
+			if (deflateInit2(&m_strm, m_level, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+				return -1;
+			}
+			m_init = true;
+			if (m_inner->data()) {
+				m_next = m_inner->data();
+				m_left = (uint64_t)m_inner->size();
+			}
+		}
+		size = std::min<size_t>(size, UINT_MAX);
+		m_strm.next_out = (Bytef*)buffer;
+		m_strm.avail_out = (uInt)size;
+		while (m_strm.avail_out > 0 && !m_ended) {
+			if (m_strm.avail_in == 0 && !m_flushed && m_next) {
+				// 内存中的请求体直接作为输入，avail_in 是 32 位的，4GB 以上分多次交给 deflate
+				uInt n = (uInt)std::min<uint64_t>(m_left, UINT_MAX);
+				m_strm.next_in = (Bytef*)m_next;
+				m_strm.avail_in = n;
+				m_next += n;
+				m_left -= n;
+				m_flushed = m_left == 0;
+			} else if (m_strm.avail_in == 0 && !m_flushed) {
+				if (!m_in) {
+					m_in.reset(new char[m_chunkSize]);
+				}
+				int64_t n = m_inner->read(m_in.get(), m_chunkSize);
+				if (n < 0) {
+					return -1;
+				}
+				m_strm.next_in = (Bytef*)m_in.get();
+				m_strm.avail_in = (uInt)n;
+				m_flushed = n == 0;
+			}
+			int ret = deflate(&m_strm, m_flushed ? Z_FINISH : Z_NO_FLUSH);
+			if (ret == Z_STREAM_END) {
+				m_ended = true;
+			} else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+				return -1;
+			}
+		}
+		return (int64_t)(size - m_strm.avail_out);
+	}
+	bool rewind() override {
+		if (!m_init) {
+			return true;
+		}
+		if (!m_inner->data() && !m_inner->rewind()) {
+			return false;
+		}
+		deflateEnd(&m_strm);
+		memset(&m_strm, 0, sizeof(m_strm));
+		m_init = false;
+		m_flushed = false;
+		m_ended = false;
+		return true;
+	}
+	const char* contentEncoding() const override {
+		return "gzip";
+	}
+private:
+	std::shared_ptr<UploadSource> m_inner;
+	int m_level;
+	size_t m_chunkSize;
+	std::unique_ptr<char[]> m_in;
+	z_stream m_strm;
+	bool m_init;
+	bool m_flushed;     // 输入已全部交给 deflate
+	bool m_ended;
+	const char* m_next; // 内存中的请求体尚未交给 deflate 的部分
+	uint64_t m_left;
+};
+
+#if __cplusplus >= 201703L
+/// 把下一个 sink 的调用移到单独的线程上执行，下载线程只把数据块放入最多 maxChunks 个的队列。
+/// 下一个 sink 处理不过来时 write 阻塞下载线程，内存占用不会随下载速度增长。
+/// finish 等待队列中的数据处理完后返回下一个 sink 的结果
+class AsyncSink : public DownloadSink {
+public:
+	explicit AsyncSink(std::shared_ptr<DownloadSink> next, size_t maxChunks = 64)
+	:m_next(next)
+	,m_queue(maxChunks)
+	,m_failed(false)
+	,m_result(false)
+	,m_consumerWaiting(false)
+	,m_producerWaiting(false)
+	{
+		m_worker = std::thread(&AsyncSink::workerRoutine, this);
+	}
+	~AsyncSink() {
+		if (m_worker.joinable()) {
+			// 没有 finish 就被释放：让线程退出，由下一个 sink 自己的析构处理未完成的数据
+			Message msg;
+			msg.kind = STOP;
+			push(std::move(msg));
+			m_worker.join();
+		}
+	}
+	void header(const char* data, size_t size) override {
+		Message msg;
+		msg.kind = HEADER;
+		msg.data.assign(data, size);
+		push(std::move(msg));
+	}
+	void reserve(size_t size) override {
+		Message msg;
+		msg.kind = RESERVE;
+		msg.size = size;
+		push(std::move(msg));
+	}
+	bool write(const char* data, size_t size) override {
+		if (m_failed.load(std::memory_order_relaxed)) {
+			return false;
+		}
+		Message msg;
+		msg.kind = WRITE;
+		msg.data.assign(data, size);
+		push(std::move(msg));
+		return true;
+	}
+	bool finish(DownloadResult result) override {
+		if (!m_worker.joinable()) {
+			return m_result;
+		}
+		Message msg;
+		msg.kind = FINISH;
+		msg.result = result;
+		push(std::move(msg));
+		m_worker.join();
+		return m_result;
+	}
+private:
+	enum Kind {
+		HEADER,
+		RESERVE,
+		WRITE,
+		FINISH,
+		STOP
+	};
+	struct Message {
+		Kind kind = WRITE;
+		std::string data;
+		size_t size = 0;
+		DownloadResult result = E_OK;
+	};
+
+	// 队列满时等待消费者取走数据。等待标志与队列状态之间用 seq_cst 栅栏，
+	// 对方只在看到标志时才加锁通知，没有等待时不碰互斥量
+	void push(Message&& msg) {
+		while (!m_queue.try_push(std::move(msg))) {
+			std::unique_lock<std::mutex> lk(m_lock);
+			m_producerWaiting.store(true);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (m_queue.size_approx() >= m_queue.capacity()) {
+				m_cv.wait(lk);
+			}
+			m_producerWaiting.store(false);
+		}
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (m_consumerWaiting.load()) {
+			std::lock_guard<std::mutex> _(m_lock);
+			m_cv.notify_all();
+		}
+	}
+	Message pop() {
+		Message msg;
+		while (!m_queue.try_pop(msg)) {
+			std::unique_lock<std::mutex> lk(m_lock);
+			m_consumerWaiting.store(true);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (m_queue.empty()) {
+				m_cv.wait(lk);
+			}
+			m_consumerWaiting.store(false);
+		}
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (m_producerWaiting.load()) {
+			std::lock_guard<std::mutex> _(m_lock);
+			m_cv.notify_all();
+		}
+		return msg;
+	}
+	void workerRoutine() {
+		bool failed = false;
+		while (true) {
+			Message msg = pop();
+			switch (msg.kind) {
+			case HEADER:
+				m_next->header(msg.data.data(), msg.data.size());
+				break;
+			case RESERVE:
+				m_next->reserve(msg.size);
+				break;
+			case WRITE:
+				if (!failed && !m_next->write(msg.data.data(), msg.data.size())) {
+					failed = true;
+					m_failed.store(true, std::memory_order_relaxed);
+				}
+				break;
+			case FINISH:
+				if (failed) {
+					m_next->finish(msg.result == E_OK ? E_WRITEFAIL : msg.result);
+					m_result = false;
+				} else {
+					m_result = m_next->finish(msg.result);
+				}
+				return;
+			case STOP:
+				return;
+			}
+		}
+	}
+
+	std::shared_ptr<DownloadSink> m_next;
+	SpscQueue<Message> m_queue;
+	std::thread m_worker;
+	std::atomic<bool> m_failed;
+	bool m_result;                  // worker 退出前写入，join 之后读取
+	std::mutex m_lock;
+	std::condition_variable m_cv;
+	std::atomic<bool> m_consumerWaiting;
+	std::atomic<bool> m_producerWaiting;
+};
+#endif
+
+#endif
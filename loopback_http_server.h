@@ -0,0 +1,482 @@
+#ifndef _LOOPBACK_HTTP_SERVER_H_
+#define _LOOPBACK_HTTP_SERVER_H_
+
+/*
+测试用的本地 HTTP/1.1 服务器：监听 127.0.0.1 的随机端口，每个连接一个线程。
+文件内容由偏移确定生成，不占内存，可用 byteAt() 校验下载结果；支持 HEAD、Range 与 keep-alive，
+可按请求限速以模拟慢连接；设置 etag 后支持 If-Range 与 If-None-Match。
+POST 的请求体（Content-Length 或 chunked）被读取后丢弃，响应与 GET 相同；可设置响应延迟与失败比例用于压测。
+*/
+
+#include <string>
+#include <map>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <fstream>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+class LoopbackHttpServer {
+public:
+	struct Request {
+		std::string method;
+		std::string path;
+		bool hasRange;
+		uint64_t rangeBegin;
+		uint64_t rangeEnd;      // 闭区间，未指定结尾时为文件末尾
+	};
+	struct Options {
+		bool acceptRanges;
+		// 按请求返回限速（字节/秒），返回 0 或未设置表示不限速
+		std::function<size_t(const Request& req)> bandwidth;
+		// 非空时作为 ETag 返回，请求带 If-Range 且不一致时忽略 Range 返回整个文件，If-None-Match 一致时返回 304
+		std::string etag;
+		// 收到请求后等待多久再响应，模拟网络往返与服务器处理时间
+		int latency_ms;
+		// 按请求序号确定地选出这一比例的请求失败：返回 503，或 failByReset 时发送一半内容后断开连接
+		double failureRate;
+		bool failByReset;
+		// 设置后收到带请求体的请求时调用，head 为请求行与请求头，body 为解码 chunked 之后的内容
+		std::function<void(const std::string& head, const std::string& body)> onBody;
+		// 设置后在响应前调用，可阻塞以让请求停在途中
+		std::function<void(const Request& req)> beforeResponse;
+
+		Options() : acceptRanges(true), latency_ms(0), failureRate(0), failByReset(false) {}
+	};
+
+	explicit LoopbackHttpServer(const Options& options = Options())
+	:m_options(options)
+	,m_listenFd(-1)
+	,m_port(0)
+	,m_stop(false)
+	,m_requests(0)
+	,m_bytesSent(0)
+	,m_bytesReceived(0)
+	,m_accepted(0)
+	{
+		m_listenFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		int on = 1;
+		setsockopt(m_listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		addr.sin_port = 0;
+		bind(m_listenFd, (sockaddr*)&addr, sizeof(addr));
+		listen(m_listenFd, 1024);
+		socklen_t len = sizeof(addr);
+		getsockname(m_listenFd, (sockaddr*)&addr, &len);
+		m_port = ntohs(addr.sin_port);
+		m_acceptThread = std::thread(&LoopbackHttpServer::acceptRoutine, this);
+	}
+	~LoopbackHttpServer() {
+		m_stop = true;
+		shutdown(m_listenFd, SHUT_RDWR);
+		m_acceptThread.join();
+		close(m_listenFd);
+		std::vector<std::thread> threads;
+		{
+			std::lock_guard<std::mutex> _(m_lock);
+			for (int fd : m_connections) {
+				shutdown(fd, SHUT_RDWR);
+			}
+			threads.swap(m_threads);
+		}
+		for (auto& t : threads) {
+			t.join();
+		}
+	}
+
+	void addFile(const std::string& path, uint64_t size) {
+		std::lock_guard<std::mutex> _(m_lock);
+		m_files[path] = size;
+	}
+	// 内容由调用者给出的文件，如压缩数据
+	void addContent(const std::string& path, const std::string& content) {
+		std::lock_guard<std::mutex> _(m_lock);
+		m_files[path] = content.size();
+		m_contents[path] = std::make_shared<std::string>(content);
+	}
+	uint16_t port() const {
+		return m_port;
+	}
+	std::string url(const std::string& path) const {
+		return "http://127.0.0.1:" + std::to_string(m_port) + path;
+	}
+	uint64_t requests() const {
+		return m_requests;
+	}
+	// 已接受的 TCP 连接数
+	uint64_t connections() const {
+		return m_accepted;
+	}
+	// 已发送的响应体字节数
+	uint64_t bytesSent() const {
+		return m_bytesSent;
+	}
+	// 已收到的请求体字节数
+	uint64_t bytesReceived() const {
+		return m_bytesReceived;
+	}
+	void setEtag(const std::string& etag) {
+		std::lock_guard<std::mutex> _(m_lock);
+		m_options.etag = etag;
+	}
+
+	static char byteAt(uint64_t offset) {
+		uint64_t x = offset * 0x9E3779B97F4A7C15ull;
+		return char(x >> 56);
+	}
+	// 校验本地文件是否与服务器上 size 字节的内容一致
+	static bool verify(const std::string& file, uint64_t size) {
+		std::ifstream in(file, std::ios::binary);
+		std::vector<char> buf(1 << 16);
+		uint64_t offset = 0;
+		while (in) {
+			in.read(buf.data(), buf.size());
+			std::streamsize n = in.gcount();
+			for (std::streamsize i = 0; i < n; ++i, ++offset) {
+				if (offset >= size || buf[i] != byteAt(offset)) {
+					return false;
+				}
+			}
+		}
+		return offset == size;
+	}
+
+private:
+	void acceptRoutine() {
+		while (!m_stop) {
+			int fd = accept4(m_listenFd, NULL, NULL, SOCK_CLOEXEC);
+			if (fd < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				break;
+			}
+			m_accepted++;
+			int on = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+			std::lock_guard<std::mutex> _(m_lock);
+			m_connections.push_back(fd);
+			m_threads.emplace_back(&LoopbackHttpServer::connectionRoutine, this, fd);
+		}
+	}
+
+	void connectionRoutine(int fd) {
+		std::string pending;
+		char buf[4096];
+		while (!m_stop) {
+			size_t end;
+			while ((end = pending.find("\r\n\r\n")) == std::string::npos) {
+				ssize_t n = recv(fd, buf, sizeof(buf), 0);
+				if (n <= 0) {
+					closeConnection(fd);
+					return;
+				}
+				pending.append(buf, n);
+			}
+			std::string head = pending.substr(0, end + 2);
+			pending.erase(0, end + 4);
+			if (!readBody(fd, head, pending)) {
+				break;
+			}
+			uint64_t index = m_requests++;
+			if (!serve(fd, head, index)) {
+				break;
+			}
+		}
+		closeConnection(fd);
+	}
+
+	// 读掉请求体，多读到的属于下一个请求，留在 pending 中
+	bool readBody(int fd, const std::string& head, std::string& pending) {
+		uint64_t length = 0;
+		bool chunked = false;
+		size_t pos = head.find("\r\n");
+		while (pos != std::string::npos && pos + 2 < head.size()) {
+			size_t next = head.find("\r\n", pos + 2);
+			std::string line = head.substr(pos + 2, next - pos - 2);
+			pos = next;
+			if (strncasecmp(line.c_str(), "Content-Length:", 15) == 0) {
+				length = strtoull(line.c_str() + 15, NULL, 10);
+			} else if (strncasecmp(line.c_str(), "Transfer-Encoding:", 18) == 0 && line.find("chunked") != std::string::npos) {
+				chunked = true;
+			}
+		}
+		std::string body;
+		std::string* keep = m_options.onBody ? &body : NULL;
+		if (!chunked) {
+			if (!consume(fd, pending, length, keep)) {
+				return false;
+			}
+		} else {
+			std::string line;
+			while (true) {
+				if (!readLine(fd, pending, line)) {
+					return false;
+				}
+				uint64_t size = strtoull(line.c_str(), NULL, 16);
+				if (size == 0) {
+					// 跳过 trailer 直到空行
+					do {
+						if (!readLine(fd, pending, line)) {
+							return false;
+						}
+					} while (!line.empty());
+					break;
+				}
+				if (!consume(fd, pending, size, keep) || !readLine(fd, pending, line)) {
+					return false;
+				}
+				length += size;
+			}
+		}
+		if (keep && (length || chunked)) {
+			m_options.onBody(head, body);
+		}
+		return true;
+	}
+	// 从 pending 与 socket 中取出 n 字节，body 为空时丢弃
+	bool consume(int fd, std::string& pending, uint64_t n, std::string* body) {
+		m_bytesReceived += n;
+		size_t take = (size_t)std::min<uint64_t>(n, pending.size());
+		if (body) {
+			body->append(pending, 0, take);
+		}
+		pending.erase(0, take);
+		n -= take;
+		char buf[65536];
+		while (n) {
+			ssize_t got = recv(fd, buf, sizeof(buf), 0);
+			if (got <= 0) {
+				return false;
+			}
+			size_t used = (size_t)std::min<uint64_t>(n, (uint64_t)got);
+			if (body) {
+				body->append(buf, used);
+			}
+			pending.append(buf + used, got - used);
+			n -= used;
+		}
+		return true;
+	}
+	bool readLine(int fd, std::string& pending, std::string& line) {
+		size_t end;
+		char buf[4096];
+		while ((end = pending.find("\r\n")) == std::string::npos) {
+			ssize_t got = recv(fd, buf, sizeof(buf), 0);
+			if (got <= 0) {
+				return false;
+			}
+			pending.append(buf, got);
+		}
+		line = pending.substr(0, end);
+		pending.erase(0, end + 2);
+		return true;
+	}
+
+	bool serve(int fd, const std::string& head, uint64_t index) {
+		Request req;
+		req.hasRange = false;
+		req.rangeBegin = 0;
+		req.rangeEnd = 0;
+		size_t sp1 = head.find(' ');
+		size_t sp2 = head.find(' ', sp1 + 1);
+		req.method = head.substr(0, sp1);
+		req.path = head.substr(sp1 + 1, sp2 - sp1 - 1);
+		bool keepAlive = true;
+		bool openEnded = false;
+		std::string ifRange;
+		std::string ifNoneMatch;
+		size_t pos = head.find("\r\n");
+		while (pos != std::string::npos && pos + 2 < head.size()) {
+			size_t next = head.find("\r\n", pos + 2);
+			std::string line = head.substr(pos + 2, next - pos - 2);
+			pos = next;
+			size_t colon = line.find(':');
+			if (colon == std::string::npos) {
+				continue;
+			}
+			std::string name = line.substr(0, colon);
+			std::string value = line.substr(colon + 1);
+			value.erase(0, value.find_first_not_of(' '));
+			if (strcasecmp(name.c_str(), "Range") == 0 && value.compare(0, 6, "bytes=") == 0) {
+				req.hasRange = true;
+				req.rangeBegin = strtoull(value.c_str() + 6, NULL, 10);
+				size_t dash = value.find('-');
+				openEnded = (dash == std::string::npos || dash + 1 == value.size());
+				if (!openEnded) {
+					req.rangeEnd = strtoull(value.c_str() + dash + 1, NULL, 10);
+				}
+			} else if (strcasecmp(name.c_str(), "If-Range") == 0) {
+				ifRange = value;
+			} else if (strcasecmp(name.c_str(), "If-None-Match") == 0) {
+				ifNoneMatch = value;
+			} else if (strcasecmp(name.c_str(), "Connection") == 0 && strcasecmp(value.c_str(), "close") == 0) {
+				keepAlive = false;
+			}
+		}
+
+		uint64_t size = 0;
+		bool found = false;
+		std::string etag;
+		std::shared_ptr<std::string> content;
+		{
+			std::lock_guard<std::mutex> _(m_lock);
+			etag = m_options.etag;
+			auto it = m_files.find(req.path);
+			if (it != m_files.end()) {
+				found = true;
+				size = it->second;
+			}
+			auto c = m_contents.find(req.path);
+			if (c != m_contents.end()) {
+				content = c->second;
+			}
+		}
+		if (m_options.latency_ms > 0) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(m_options.latency_ms));
+		}
+		if (m_options.beforeResponse) {
+			m_options.beforeResponse(req);
+		}
+		if (!found) {
+			return sendAll(fd, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n") && keepAlive;
+		}
+		// 序号经乘法散列后均匀分布在 [0, 1)
+		bool fail = m_options.failureRate > 0 &&
+			double((index + 1) * 0x9E3779B97F4A7C15ull >> 11) / double(1ull << 53) < m_options.failureRate;
+		if (fail && !m_options.failByReset) {
+			return sendAll(fd, "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n\r\n") && keepAlive;
+		}
+		if (!etag.empty() && ifNoneMatch == etag) {
+			return sendAll(fd, "HTTP/1.1 304 Not Modified\r\nETag: " + etag + "\r\n\r\n") && keepAlive;
+		}
+
+		std::string resp;
+		uint64_t begin = 0;
+		uint64_t length = size;
+		if (!ifRange.empty() && ifRange != etag) {
+			req.hasRange = false;
+		}
+		if (req.hasRange && m_options.acceptRanges) {
+			if (openEnded || req.rangeEnd >= size) {
+				req.rangeEnd = size - 1;
+			}
+			if (req.rangeBegin >= size || req.rangeBegin > req.rangeEnd) {
+				return sendAll(fd, "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Length: 0\r\n\r\n") && keepAlive;
+			}
+			begin = req.rangeBegin;
+			length = req.rangeEnd - req.rangeBegin + 1;
+			resp = "HTTP/1.1 206 Partial Content\r\nContent-Range: bytes " + std::to_string(begin) + "-" +
+				   std::to_string(req.rangeEnd) + "/" + std::to_string(size) + "\r\n";
+		} else {
+			req.hasRange = false;
+			resp = "HTTP/1.1 200 OK\r\n";
+		}
+		resp += m_options.acceptRanges ? "Accept-Ranges: bytes\r\n" : "Accept-Ranges: none\r\n";
+		if (!etag.empty()) {
+			resp += "ETag: " + etag + "\r\n";
+		}
+		resp += "Content-Length: " + std::to_string(length) + "\r\n\r\n";
+		if (!sendAll(fd, resp)) {
+			return false;
+		}
+		if (req.method == "HEAD") {
+			return keepAlive;
+		}
+		size_t bandwidth = m_options.bandwidth ? m_options.bandwidth(req) : 0;
+		if (fail) {
+			sendBody(fd, begin, length / 2, bandwidth, content.get());
+			return false;
+		}
+		return sendBody(fd, begin, length, bandwidth, content.get()) && keepAlive;
+	}
+
+	bool sendBody(int fd, uint64_t begin, uint64_t length, size_t bandwidth, const std::string* content) {
+		std::vector<char> chunk(1 << 16);
+		size_t chunkSize = chunk.size();
+		if (bandwidth) {
+			// 限速时减小块大小，让速率更平滑
+			chunkSize = std::max<size_t>(1024, std::min(chunkSize, bandwidth / 20));
+		}
+		auto start = std::chrono::steady_clock::now();
+		uint64_t sent = 0;
+		while (sent < length && !m_stop) {
+			size_t n = (size_t)std::min<uint64_t>(chunkSize, length - sent);
+			if (content) {
+				memcpy(chunk.data(), content->data() + begin + sent, n);
+			} else {
+				for (size_t i = 0; i < n; ++i) {
+					chunk[i] = byteAt(begin + sent + i);
+				}
+			}
+			if (!sendAll(fd, chunk.data(), n)) {
+				return false;
+			}
+			sent += n;
+			m_bytesSent += n;
+			if (bandwidth) {
+				std::this_thread::sleep_until(start + std::chrono::microseconds(sent * 1000000 / bandwidth));
+			}
+		}
+		return sent == length;
+	}
+
+	static bool sendAll(int fd, const std::string& data) {
+		return sendAll(fd, data.data(), data.size());
+	}
+	static bool sendAll(int fd, const char* data, size_t size) {
+		while (size) {
+			ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+			if (n < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				return false;
+			}
+			data += n;
+			size -= n;
+		}
+		return true;
+	}
+
+	void closeConnection(int fd) {
+		std::lock_guard<std::mutex> _(m_lock);
+		for (auto it = m_connections.begin(); it != m_connections.end(); ++it) {
+			if (*it == fd) {
+				m_connections.erase(it);
+				close(fd);
+				return;
+			}
+		}
+	}
+
+	Options m_options;
+	int m_listenFd;
+	uint16_t m_port;
+	std::atomic<bool> m_stop;
+	std::atomic<uint64_t> m_requests;
+	std::atomic<uint64_t> m_bytesSent;
+	std::atomic<uint64_t> m_bytesReceived;
+	std::atomic<uint64_t> m_accepted;
+	std::thread m_acceptThread;
+	std::mutex m_lock;
+	std::map<std::string, uint64_t> m_files;
+	std::map<std::string, std::shared_ptr<std::string>> m_contents;
+	std::vector<int> m_connections;
+	std::vector<std::thread> m_threads;
+};
+
+#endif
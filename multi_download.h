@@ -0,0 +1,4333 @@
+/*
+这段代码在jetson nano 平台会出现公网下载失败的情况，监听的curl句柄一直不返回，也不增加新增的下载内容。
+*/
+
+
+#ifndef _MULTI_DOWNLOAD_H_
+#define _MULTI_DOWNLOAD_H_
+
+#include <iomanip>
+#include <fstream>
+#include <iostream>
+#include <functional>
+#include <string>
+#include <deque>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <chrono>
+#include <string.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <random>
+#include <cmath>
+#include <ctype.h>
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <errno.h>
+#include <linux/fs.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#endif
+
+#include "curl/curl.h"
+#include "digest.h"
+
+// ����E_RESPONSE_CODEΪHTTP��response code�����
+enum DownloadResult {
+	E_OK,
+	E_MEMORY,
+	E_TIMEOUT,
+	E_DOWNLOADFAIL,
+	E_WRITEFAIL,
+	E_CHECKSUM,         // 内容与请求中给出的 SHA-256/CRC32C 不一致
+	E_CANCELLED,        // 被 MultiDownload::cancel 取消，或对冲请求中落后的尝试
+
+	E_RESPONSE_CODE = 399,
+	E_FORBIDDEN = 403,
+	E_NOTFOUND = 404,
+	E_GATEWAYTIMEOUT = 502,
+};
+enum CallbackType {
+	RESULT,
+	FILESIZE,
+	CONTENT,
+	PROGRESS            // 调用 setProgressInterval 后才会收到
+};
+// 任务的优先级，PRIORITY_HIGH 用于需要尽快响应的交互请求
+enum DownloadPriority {
+	PRIORITY_HIGH,
+	PRIORITY_NORMAL,
+	PRIORITY_LOW
+};
+// 多个事件循环时新任务的分配方式
+enum LoopAssignment {
+	LEAST_LOADED,       // 分给排队与进行中任务最少的循环
+	HOST_AFFINITY       // 同一主机的任务总在同一循环，复用该循环的连接与 TLS 会话
+};
+struct CallbackData {
+	CallbackType type;
+	union {
+		size_t fileSize;
+		struct {
+			char* data;
+			size_t size;
+		};
+		DownloadResult result;
+		struct {
+			uint64_t downloaded;    // 已收到的字节数
+			uint64_t total;         // 总大小，未知时为 0
+		};
+	};
+};
+
+/// 一次传输（分段下载的每个内部请求各算一次）结束时从 curl 取得的指标，时间单位为微秒
+struct TransferMetrics {
+	DownloadResult result = E_OK;
+	long responseCode = 0;
+	long httpVersion = 0;           // CURL_HTTP_VERSION_*
+	uint64_t queue_us = 0;          // 提交到开始传输
+	uint64_t dns_us = 0;
+	uint64_t connect_us = 0;        // TCP 建连，不含 DNS
+	uint64_t tls_us = 0;            // TLS 握手，明文时为 0
+	uint64_t ttfb_us = 0;           // 开始传输到收到首字节，包含上面各阶段
+	uint64_t total_us = 0;
+	uint64_t bytesDownloaded = 0;
+	uint64_t bytesUploaded = 0;
+	uint64_t speed = 0;             // 平均下载速度，字节/秒
+	long redirects = 0;
+	int retries = 0;                // 分段下载中该段已重试的次数，对冲请求中为尝试的序号
+	bool newConnection = false;     // false 表示复用了已有连接，dns/connect/tls 为 0
+};
+
+/// Histogram 某一时刻的副本
+struct HistogramSnapshot {
+	std::vector<uint64_t> counts;
+	uint64_t count = 0;
+	uint64_t sum = 0;
+	uint64_t max = 0;
+
+	double mean() const {
+		return count ? double(sum) / count : 0;
+	}
+	// p 取 0 到 1，返回所在桶的上界，不超过 max
+	uint64_t percentile(double p) const;
+};
+
+/// 对数分桶的直方图：小于 16 的值各占一桶，之后每个 2 的幂区间分 8 桶，相对误差不超过 12.5%。
+/// record 只做几次原子加，可在多个线程上同时调用
+class Histogram {
+public:
+	static const size_t kBuckets = 16 + 60 * 8;
+
+	void record(uint64_t value) {
+		m_counts[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+		m_count.fetch_add(1, std::memory_order_relaxed);
+		m_sum.fetch_add(value, std::memory_order_relaxed);
+		uint64_t max = m_max.load(std::memory_order_relaxed);
+		while (value > max && !m_max.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+		}
+	}
+	HistogramSnapshot snapshot() const {
+		HistogramSnapshot snap;
+		snap.counts.resize(kBuckets);
+		for (size_t i = 0; i < kBuckets; ++i) {
+			snap.counts[i] = m_counts[i].load(std::memory_order_relaxed);
+			snap.count += snap.counts[i];
+		}
+		snap.sum = m_sum.load(std::memory_order_relaxed);
+		snap.max = m_max.load(std::memory_order_relaxed);
+		return snap;
+	}
+	static size_t bucket(uint64_t value) {
+		if (value < 16) {
+			return (size_t)value;
+		}
+#if defined(__GNUC__)
+		int e = 63 - __builtin_clzll(value);
+#else
+		int e = 63;
+		while (!(value >> e)) {
+			e--;
+		}
+#endif
+		return 16 + (e - 4) * 8 + ((value >> (e - 3)) & 7);
+	}
+	// 桶中的最大值
+	static uint64_t upperBound(size_t index) {
+		if (index < 16) {
+			return index;
+		}
+		int e = (int)(index - 16) / 8 + 4;
+		uint64_t sub = (index - 16) % 8;
+		return (uint64_t(1) << e) + ((sub + 1) << (e - 3)) - 1;
+	}
+private:
+	std::atomic<uint64_t> m_counts[kBuckets] = {};
+	std::atomic<uint64_t> m_count{0};
+	std::atomic<uint64_t> m_sum{0};
+	std::atomic<uint64_t> m_max{0};
+};
+
+inline uint64_t HistogramSnapshot::percentile(double p) const {
+	if (count == 0) {
+		return 0;
+	}
+	uint64_t target = std::max<uint64_t>(1, (uint64_t)(p * count + 0.5));
+	uint64_t seen = 0;
+	for (size_t i = 0; i < counts.size(); ++i) {
+		seen += counts[i];
+		if (seen >= target) {
+			return std::min(Histogram::upperBound(i), max);
+		}
+	}
+	return max;
+}
+
+/// MultiDownload::stats 的返回值，从创建起累计
+struct DownloadStats {
+	uint64_t transfers = 0;
+	uint64_t failed = 0;
+	uint64_t retries = 0;
+	uint64_t newConnections = 0;
+	uint64_t bytesDownloaded = 0;
+	uint64_t bytesUploaded = 0;
+	std::map<int, uint64_t> results;    // DownloadResult 到次数
+	// 微秒；dns/connect/tls 只统计新建连接的传输
+	HistogramSnapshot queue, dns, connect, tls, ttfb, total;
+	HistogramSnapshot speed;            // 有响应体的成功传输的平均下载速度，字节/秒
+};
+
+/// 汇总各传输的指标，record 在下载线程上调用，snapshot 可在任意线程调用
+class DownloadMetrics {
+public:
+	void record(const TransferMetrics& m) {
+		m_transfers++;
+		if (m.result != E_OK) {
+			m_failed++;
+		}
+		m_retries += m.retries;
+		m_bytesDownloaded += m.bytesDownloaded;
+		m_bytesUploaded += m.bytesUploaded;
+		m_queue.record(m.queue_us);
+		if (m.newConnection) {
+			m_newConnections++;
+			m_dns.record(m.dns_us);
+			m_connect.record(m.connect_us);
+			if (m.tls_us) {
+				m_tls.record(m.tls_us);
+			}
+		}
+		if (m.ttfb_us) {
+			m_ttfb.record(m.ttfb_us);
+		}
+		m_total.record(m.total_us);
+		if (m.result == E_OK && m.bytesDownloaded) {
+			m_speed.record(m.speed);
+		}
+		std::lock_guard<std::mutex> _(m_lock);
+		m_results[m.result]++;
+	}
+	DownloadStats snapshot() const {
+		DownloadStats stats;
+		stats.transfers = m_transfers;
+		stats.failed = m_failed;
+		stats.retries = m_retries;
+		stats.newConnections = m_newConnections;
+		stats.bytesDownloaded = m_bytesDownloaded;
+		stats.bytesUploaded = m_bytesUploaded;
+		{
+			std::lock_guard<std::mutex> _(m_lock);
+			stats.results = m_results;
+		}
+		stats.queue = m_queue.snapshot();
+		stats.dns = m_dns.snapshot();
+		stats.connect = m_connect.snapshot();
+		stats.tls = m_tls.snapshot();
+		stats.ttfb = m_ttfb.snapshot();
+		stats.total = m_total.snapshot();
+		stats.speed = m_speed.snapshot();
+		return stats;
+	}
+private:
+	std::atomic<uint64_t> m_transfers{0};
+	std::atomic<uint64_t> m_failed{0};
+	std::atomic<uint64_t> m_retries{0};
+	std::atomic<uint64_t> m_newConnections{0};
+	std::atomic<uint64_t> m_bytesDownloaded{0};
+	std::atomic<uint64_t> m_bytesUploaded{0};
+	Histogram m_queue, m_dns, m_connect, m_tls, m_ttfb, m_total, m_speed;
+	mutable std::mutex m_lock;
+	std::map<int, uint64_t> m_results;
+};
+
+/// 设置到 Request::cancelToken 后可用 MultiDownload::cancel 取消，多个请求可共用一个
+struct CancelToken {
+	std::atomic<bool> cancelled{false};
+};
+
+/// "scheme://user@host:port/path" 中的 host:port
+inline std::string urlAuthority(const std::string& url) {
+	size_t begin = url.find("://");
+	begin = (begin == std::string::npos) ? 0 : begin + 3;
+	size_t end = url.find_first_of("/?#", begin);
+	std::string authority = url.substr(begin, end == std::string::npos ? std::string::npos : end - begin);
+	size_t at = authority.rfind('@');
+	return at == std::string::npos ? authority : authority.substr(at + 1);
+}
+
+/// 匹配形如 "Name: value\r\n" 的响应头，名字不区分大小写，value 去掉首尾空白
+inline bool matchHeader(const char* line, size_t size, const char* name, std::string& value) {
+	size_t len = strlen(name);
+	if (size <= len || line[len] != ':') {
+		return false;
+	}
+	for (size_t i = 0; i < len; ++i) {
+		if (tolower((unsigned char)line[i]) != tolower((unsigned char)name[i])) {
+			return false;
+		}
+	}
+	size_t b = len + 1;
+	size_t e = size;
+	while (b < e && isspace((unsigned char)line[b])) {
+		b++;
+	}
+	while (e > b && isspace((unsigned char)line[e - 1])) {
+		e--;
+	}
+	value.assign(line + b, e - b);
+	return true;
+}
+/// 解析状态行 "HTTP/1.1 206 Partial Content"，不是状态行时返回 0
+inline int parseStatusLine(const char* line, size_t size) {
+	if (size < 12 || strncmp(line, "HTTP/", 5) != 0) {
+		return 0;
+	}
+	const char* sp = (const char*)memchr(line, ' ', size);
+	return sp ? atoi(sp + 1) : 0;
+}
+
+/// 对冲请求（Request::mirrors 非空或 Request::hedge 为 true）的参数
+struct HedgePolicy {
+	double percentile = 0.95;       // 首个尝试超过最近首字节耗时的这一分位仍没有数据时发出备用请求
+	int initialDelay_ms = 200;      // 样本不足时的等待时间
+	int minDelay_ms = 10;
+	int maxDelay_ms = 2000;
+	size_t maxParallel = 2;         // 同时进行的尝试数
+	int maxAttempts = 4;            // 包括备用请求与重试的总尝试数
+	int backoff_ms = 100;           // 所有尝试都失败后重试的基础间隔，每次翻倍并加 ±50% 的抖动
+	uint64_t sizeHint = 1 << 20;    // 按 首字节耗时 + sizeHint / 吞吐 估计各镜像的耗时并排序
+};
+
+/// 最近 capacity 个样本的分位数，样本较少时计算开销可忽略
+class LatencyWindow {
+public:
+	explicit LatencyWindow(size_t capacity = 256) : m_capacity(capacity), m_next(0) {}
+	void add(double value) {
+		std::lock_guard<std::mutex> _(m_lock);
+		if (m_samples.size() < m_capacity) {
+			m_samples.push_back(value);
+		} else {
+			m_samples[m_next] = value;
+			m_next = (m_next + 1) % m_capacity;
+		}
+	}
+	size_t size() const {
+		std::lock_guard<std::mutex> _(m_lock);
+		return m_samples.size();
+	}
+	double percentile(double p) const {
+		std::vector<double> samples;
+		{
+			std::lock_guard<std::mutex> _(m_lock);
+			samples = m_samples;
+		}
+		if (samples.empty()) {
+			return 0;
+		}
+		size_t index = std::min(samples.size() - 1, (size_t)(p * samples.size()));
+		std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+		return samples[index];
+	}
+private:
+	const size_t m_capacity;
+	mutable std::mutex m_lock;
+	std::vector<double> m_samples;
+	size_t m_next;
+};
+
+/// 各镜像（按 host:port）的首字节耗时与吞吐的指数滑动平均，对冲请求据此排列 URL
+class MirrorStats {
+public:
+	struct Estimate {
+		uint64_t samples = 0;       // 成功次数，0 时 ttfb_ms 没有测量值
+		double ttfb_ms = 0;
+		double throughput = 0;      // 字节/秒，只由较大的传输更新，0 表示未知
+		int failures = 0;           // 连续失败次数
+	};
+	void success(const std::string& host, double ttfb_ms, uint64_t bytes, double seconds) {
+		std::lock_guard<std::mutex> _(m_lock);
+		Estimate& e = m_hosts[host];
+		// 第一个样本直接作为估计值，之前只失败过的镜像不从 0 开始平均
+		e.ttfb_ms = e.samples ? e.ttfb_ms + kAlpha * (ttfb_ms - e.ttfb_ms) : ttfb_ms;
+		if (bytes >= kMinBytes && seconds > 0) {
+			e.throughput = e.throughput > 0 ? e.throughput + kAlpha * (bytes / seconds - e.throughput) : bytes / seconds;
+		}
+		e.samples++;
+		e.failures = 0;
+	}
+	void failure(const std::string& host) {
+		std::lock_guard<std::mutex> _(m_lock);
+		m_hosts[host].failures++;
+	}
+	bool estimate(const std::string& host, Estimate& e) const {
+		std::lock_guard<std::mutex> _(m_lock);
+		auto it = m_hosts.find(host);
+		if (it == m_hosts.end()) {
+			return false;
+		}
+		e = it->second;
+		return true;
+	}
+	// 有测量值的镜像按估计耗时从小到大排在前面，连续失败每次加 1 秒；
+	// 没有测量值的排在其后，按连续失败次数、再按原顺序，由对冲与失败切换去尝试
+	std::vector<std::string> rank(const std::vector<std::string>& urls, uint64_t sizeHint) const {
+		struct Order {
+			bool unmeasured;
+			double cost;
+			size_t index;
+		};
+		std::vector<Order> order;
+		{
+			std::lock_guard<std::mutex> _(m_lock);
+			for (size_t i = 0; i < urls.size(); ++i) {
+				Order o{true, 0, i};
+				auto it = m_hosts.find(urlAuthority(urls[i]));
+				if (it != m_hosts.end()) {
+					const Estimate& e = it->second;
+					o.unmeasured = e.samples == 0;
+					o.cost = e.failures * 1000.0;
+					if (e.samples) {
+						o.cost += e.ttfb_ms;
+						if (e.throughput > 0) {
+							o.cost += sizeHint / e.throughput * 1000;
+						}
+					}
+				}
+				order.push_back(o);
+			}
+		}
+		std::stable_sort(order.begin(), order.end(), [](const Order& a, const Order& b) {
+			return a.unmeasured != b.unmeasured ? b.unmeasured : a.cost < b.cost;
+		});
+		std::vector<std::string> ranked;
+		for (auto& o : order) {
+			ranked.push_back(urls[o.index]);
+		}
+		return ranked;
+	}
+private:
+	static constexpr double kAlpha = 0.3;
+	static const uint64_t kMinBytes = 256 << 10;
+
+	mutable std::mutex m_lock;
+	std::unordered_map<std::string, Estimate> m_hosts;
+};
+
+/// 令牌桶限速：全局、按主机（host:port）与按优先级各有一个桶，收到的数据从所有适用的桶中扣除，
+/// 任一桶欠账时暂停传输直到还清，一次最多超出一个写回调的数据量。
+/// PRIORITY_HIGH 的数据计入全局桶但不因全局桶暂停，批量传输因此只使用剩下的带宽
+class BandwidthLimiter {
+public:
+	BandwidthLimiter() : m_enabled(false) {}
+	// rate 为字节/秒，0 表示不限；burst 为桶容量，0 时取 rate 的 1/10（至少 64KB）
+	void setGlobal(uint64_t rate, uint64_t burst = 0) {
+		std::lock_guard<std::mutex> _(m_lock);
+		m_global.set(rate, burst, std::chrono::steady_clock::now());
+		update();
+	}
+	void setHost(const std::string& host, uint64_t rate, uint64_t burst = 0) {
+		std::lock_guard<std::mutex> _(m_lock);
+		if (rate == 0) {
+			m_hosts.erase(host);
+		} else {
+			m_hosts[host].set(rate, burst, std::chrono::steady_clock::now());
+		}
+		update();
+	}
+	void setPriority(DownloadPriority priority, uint64_t rate, uint64_t burst = 0) {
+		std::lock_guard<std::mutex> _(m_lock);
+		m_priorities[priority].set(rate, burst, std::chrono::steady_clock::now());
+		update();
+	}
+	bool enabled() const {
+		return m_enabled;
+	}
+	// 还需暂停的毫秒数，0 表示可以继续接收
+	int delay(const std::string& host, DownloadPriority priority) {
+		std::lock_guard<std::mutex> _(m_lock);
+		auto now = std::chrono::steady_clock::now();
+		double ms = m_priorities[priority].wait(now);
+		if (priority != PRIORITY_HIGH) {
+			ms = std::max(ms, m_global.wait(now));
+		}
+		auto it = m_hosts.find(host);
+		if (it != m_hosts.end()) {
+			ms = std::max(ms, it->second.wait(now));
+		}
+		return (int)std::ceil(ms);
+	}
+	void consume(const std::string& host, DownloadPriority priority, size_t bytes) {
+		std::lock_guard<std::mutex> _(m_lock);
+		m_global.take(bytes);
+		m_priorities[priority].take(bytes);
+		auto it = m_hosts.find(host);
+		if (it != m_hosts.end()) {
+			it->second.take(bytes);
+		}
+	}
+private:
+	struct Bucket {
+		double rate = 0;
+		double burst = 0;
+		double tokens = 0;
+		std::chrono::steady_clock::time_point last;
+
+		void set(uint64_t rate_, uint64_t burst_, std::chrono::steady_clock::time_point now) {
+			bool wasLimited = rate > 0;
+			refill(now);
+			rate = (double)rate_;
+			burst = burst_ ? (double)burst_ : std::max(rate / 10, 64.0 * 1024);
+			// 从不限速改为限速时桶是满的，调整限速时保留欠账
+			tokens = wasLimited ? std::min(tokens, burst) : burst;
+		}
+		void refill(std::chrono::steady_clock::time_point now) {
+			if (rate > 0) {
+				tokens = std::min(burst, tokens + rate * std::chrono::duration<double>(now - last).count());
+			}
+			last = now;
+		}
+		double wait(std::chrono::steady_clock::time_point now) {
+			refill(now);
+			return rate > 0 && tokens < 0 ? -tokens / rate * 1000 : 0;
+		}
+		void take(size_t bytes) {
+			if (rate > 0) {
+				tokens -= bytes;
+			}
+		}
+	};
+	void update() {
+		bool enabled = m_global.rate > 0 || !m_hosts.empty();
+		for (auto& bucket : m_priorities) {
+			enabled = enabled || bucket.rate > 0;
+		}
+		m_enabled = enabled;
+	}
+
+	std::mutex m_lock;
+	Bucket m_global;
+	Bucket m_priorities[PRIORITY_LOW + 1];
+	std::unordered_map<std::string, Bucket> m_hosts;
+	std::atomic<bool> m_enabled;
+};
+
+/// 下载数据的接收端，由下载线程（背压模式下为消费线程）依次调用 reserve/write/finish
+class DownloadSink {
+public:
+	virtual ~DownloadSink() {}
+	// 每行响应头（含状态行）都会调用，重定向时会收到多组
+	virtual void header(const char* data, size_t size) { (void)data; (void)size; }
+	// 收到 Content-Length 时调用，重定向时可能调用多次
+	virtual void reserve(size_t size) { (void)size; }
+	// 返回 false 时中止该下载，除非 complete() 为 true，结果为 E_WRITEFAIL
+	virtual bool write(const char* data, size_t size) = 0;
+	// write 返回 false 后调用：true 表示已收到所需的全部数据而主动结束连接，不算失败
+	virtual bool complete() const { return false; }
+	// 下载结束时调用一次，result 不为 E_OK 时应丢弃已写入的数据；返回 false 表示收尾失败
+	virtual bool finish(DownloadResult result) = 0;
+};
+
+/// POST 请求体的来源，由下载线程通过 CURLOPT_READFUNCTION 依次读取；
+/// data() 不为空时整块交给 CURLOPT_POSTFIELDS，不经过 read
+class UploadSource {
+public:
+	virtual ~UploadSource() {}
+	// 总长度，未知时返回 -1，以 chunked 编码发送
+	virtual int64_t size() const = 0;
+	// 读取最多 size 字节，返回读到的字节数，0 表示结束，小于 0 表示出错并中止请求
+	virtual int64_t read(char* buffer, size_t size) = 0;
+	// 重定向等需要重新发送时回到开头，不支持时返回 false
+	virtual bool rewind() { return false; }
+	// 在请求存续期间有效的连续内存
+	virtual const char* data() const { return NULL; }
+	// 非空时作为 Content-Encoding 请求头
+	virtual const char* contentEncoding() const { return NULL; }
+};
+
+/// 引用调用者内存的请求体，owner 保证请求结束前内存有效，不复制
+class BufferSource : public UploadSource {
+public:
+	BufferSource(std::shared_ptr<const void> owner, const char* data, size_t size)
+	:m_owner(owner)
+	,m_data(data)
+	,m_size(size)
+	,m_offset(0)
+	{}
+	explicit BufferSource(std::shared_ptr<const std::string> buffer)
+	:m_owner(buffer)
+	,m_data(buffer->data())
+	,m_size(buffer->size())
+	,m_offset(0)
+	{}
+	int64_t size() const override {
+		return (int64_t)m_size;
+	}
+	int64_t read(char* buffer, size_t size) override {
+		size_t n = std::min(size, m_size - m_offset);
+		memcpy(buffer, m_data + m_offset, n);
+		m_offset += n;
+		return (int64_t)n;
+	}
+	bool rewind() override {
+		m_offset = 0;
+		return true;
+	}
+	const char* data() const override {
+		return m_data;
+	}
+private:
+	std::shared_ptr<const void> m_owner;
+	const char* m_data;
+	size_t m_size;
+	size_t m_offset;
+};
+
+#ifndef _WIN32
+/// rename 之后同步 path 所在目录的目录项，保证掉电后文件名也已落盘
+inline void syncParentDir(const std::string& path) {
+	size_t pos = path.find_last_of('/');
+	std::string dir = pos == std::string::npos ? "." : (pos == 0 ? "/" : path.substr(0, pos));
+	int fd = ::open(dir.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+}
+
+/// 写文件的 sink：先写到 path.part，按 Content-Length 预分配空间，
+/// 小块数据合并到大缓冲区后一次 pwrite，大块数据直接 pwrite 不经拷贝；
+/// 成功时 fsync 后原子 rename 为 path，失败时删除临时文件。
+class FileSink : public DownloadSink {
+public:
+	FileSink(const std::string& path, size_t bufferSize = 4 << 20)
+	:m_path(path)
+	,m_tmpPath(path + ".part")
+	,m_fd(-1)
+	,m_offset(0)
+	,m_extent(0)
+	,m_length(0)
+	,m_bufferSize(bufferSize)
+	,m_used(0)
+	,m_keepPartial(false)
+	{}
+	~FileSink() {
+		if (m_fd >= 0) {
+			if (m_keepPartial) {
+				flush();
+				close(m_fd);
+				m_fd = -1;
+			} else {
+				discard();
+			}
+		}
+	}
+	bool open() {
+		if (m_fd >= 0) {
+			return true;
+		}
+		// 保留已下载的部分时不截断，由调用者决定是否 truncate()
+		int flags = O_RDWR | O_CREAT | O_CLOEXEC | (m_keepPartial ? 0 : O_TRUNC);
+		m_fd = ::open(m_tmpPath.c_str(), flags, 0644);
+		if (m_fd < 0) {
+			return false;
+		}
+		m_buffer.reset(new char[m_bufferSize]);
+		return true;
+	}
+	void reserve(size_t size) override {
+#ifdef __linux__
+		// 尽量得到连续的磁盘空间，文件系统不支持时忽略
+		if (size > 0 && open()) {
+			fallocate(m_fd, FALLOC_FL_KEEP_SIZE, 0, size);
+		}
+#else
+		(void)size;
+#endif
+	}
+	bool write(const char* data, size_t size) override {
+		if (!open()) {
+			return false;
+		}
+		if (m_used + size > m_bufferSize && !flush()) {
+			return false;
+		}
+		if (size >= m_bufferSize) {
+			if (!writeAll(data, size, m_offset)) {
+				return false;
+			}
+			m_offset += size;
+			return true;
+		}
+		memcpy(m_buffer.get() + m_used, data, size);
+		m_used += size;
+		return true;
+	}
+	// 分段下载时各段直接写到各自偏移，不经过合并缓冲区
+	bool writeAt(uint64_t offset, const char* data, size_t size) {
+		if (!open() || !writeAll(data, size, offset)) {
+			return false;
+		}
+		m_extent = std::max<uint64_t>(m_extent, offset + size);
+		return true;
+	}
+	bool finish(DownloadResult result) override {
+		if (result != E_OK) {
+			if (m_keepPartial) {
+				return sync();
+			}
+			discard();
+			return true;
+		}
+		if (!open() || !flush() || ftruncate(m_fd, m_length ? m_length : std::max<uint64_t>(m_offset, m_extent)) != 0 || fsync(m_fd) != 0) {
+			discard();
+			return false;
+		}
+		close(m_fd);
+		m_fd = -1;
+		m_buffer.reset();
+		if (rename(m_tmpPath.c_str(), m_path.c_str()) != 0) {
+			unlink(m_tmpPath.c_str());
+			return false;
+		}
+		syncDir();
+		return true;
+	}
+	const std::string& path() const {
+		return m_path;
+	}
+	/// 失败时保留 path.part 以便续传，需在 open() 之前设置才会不截断已有内容
+	void setKeepPartial(bool keep) {
+		m_keepPartial = keep;
+	}
+	/// 最终文件长度，用于续传时末尾数据来自上一次下载的情况
+	void setLength(uint64_t length) {
+		m_length = length;
+	}
+	/// 丢弃已有内容重新开始
+	bool truncate() {
+		m_offset = 0;
+		m_extent = 0;
+		m_used = 0;
+		return open() && ftruncate(m_fd, 0) == 0;
+	}
+	/// 已写入的数据落盘，写断点记录前调用
+	bool sync() {
+		return m_fd >= 0 && flush() && fdatasync(m_fd) == 0;
+	}
+	/// 读回已顺序写入的内容，合并请求中后加入的订阅者从这里补发
+	bool readAt(uint64_t offset, char* data, size_t size) {
+		if (m_fd < 0 || !flush()) {
+			return false;
+		}
+		size_t done = 0;
+		while (done < size) {
+			ssize_t n = pread(m_fd, data + done, size - done, offset + done);
+			if (n <= 0) {
+				if (n < 0 && errno == EINTR) {
+					continue;
+				}
+				return false;
+			}
+			done += n;
+		}
+		return true;
+	}
+private:
+	bool flush() {
+		if (m_used == 0) {
+			return true;
+		}
+		if (!writeAll(m_buffer.get(), m_used, m_offset)) {
+			return false;
+		}
+		m_offset += m_used;
+		m_used = 0;
+		return true;
+	}
+	bool writeAll(const char* data, size_t size, uint64_t offset) {
+		size_t done = 0;
+		while (done < size) {
+			ssize_t n = pwrite(m_fd, data + done, size - done, offset + done);
+			if (n < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				return false;
+			}
+			done += n;
+		}
+		return true;
+	}
+	void discard() {
+		if (m_fd >= 0) {
+			close(m_fd);
+			m_fd = -1;
+		}
+		m_buffer.reset();
+		m_used = 0;
+		unlink(m_tmpPath.c_str());
+	}
+	void syncDir() {
+		syncParentDir(m_path);
+	}
+
+	std::string m_path;
+	std::string m_tmpPath;
+	int m_fd;
+	off_t m_offset;
+	uint64_t m_extent;
+	uint64_t m_length;
+	size_t m_bufferSize;
+	size_t m_used;
+	std::unique_ptr<char[]> m_buffer;
+	bool m_keepPartial;
+};
+
+/// 分段下载的断点记录，保存在 path.journal：记录 URL、大小、ETag/Last-Modified
+/// 以及已写入 path.part 的区间。校验字段与服务器当前的一致时才允许续传。
+struct DownloadJournal {
+	typedef std::pair<uint64_t, uint64_t> Range;    // [first, second)
+
+	std::string url;
+	uint64_t size = 0;
+	std::string etag;
+	std::string lastModified;
+	std::vector<Range> done;
+
+	bool load(const std::string& file) {
+		std::ifstream in(file);
+		if (!in) {
+			return false;
+		}
+		std::string line;
+		while (std::getline(in, line)) {
+			size_t sp = line.find(' ');
+			std::string key = line.substr(0, sp);
+			std::string value = sp == std::string::npos ? std::string() : line.substr(sp + 1);
+			if (key == "url") {
+				url = value;
+			} else if (key == "size") {
+				size = strtoull(value.c_str(), NULL, 10);
+			} else if (key == "etag") {
+				etag = value;
+			} else if (key == "last-modified") {
+				lastModified = value;
+			} else if (key == "done") {
+				char* end = NULL;
+				uint64_t b = strtoull(value.c_str(), &end, 10);
+				uint64_t e = strtoull(end, NULL, 10);
+				if (b < e && e <= size) {
+					done.push_back(Range(b, e));
+				}
+			}
+		}
+		merge();
+		return !url.empty() && size > 0;
+	}
+	// 与 FileSink 相同：临时文件 fsync 后 rename，再同步目录。崩溃或掉电后旧记录或新记录总有一份完整，
+	// 且不会早于调用前已 sync 的数据文件
+	bool save(const std::string& file) {
+		merge();
+		std::string text = "url " + url + "\nsize " + std::to_string(size) + "\n";
+		if (!etag.empty()) {
+			text += "etag " + etag + "\n";
+		}
+		if (!lastModified.empty()) {
+			text += "last-modified " + lastModified + "\n";
+		}
+		for (auto& r : done) {
+			text += "done " + std::to_string(r.first) + " " + std::to_string(r.second) + "\n";
+		}
+		std::string tmp = file + ".tmp";
+		int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd < 0) {
+			return false;
+		}
+		bool ok = true;
+		for (size_t written = 0; ok && written < text.size();) {
+			ssize_t n = ::write(fd, text.data() + written, text.size() - written);
+			if (n > 0) {
+				written += n;
+			} else {
+				ok = n < 0 && errno == EINTR;
+			}
+		}
+		ok = ok && fsync(fd) == 0;
+		close(fd);
+		if (!ok || rename(tmp.c_str(), file.c_str()) != 0) {
+			unlink(tmp.c_str());
+			return false;
+		}
+		syncParentDir(file);
+		return true;
+	}
+	/// 只有强校验字段（非 W/ 的 ETag，或没有 ETag 时的 Last-Modified）一致才能续传
+	bool matches(const std::string& url_, uint64_t size_, const std::string& etag_, const std::string& lastModified_) const {
+		if (url != url_ || size != size_) {
+			return false;
+		}
+		if (!etag_.empty()) {
+			return etag_.compare(0, 2, "W/") != 0 && etag == etag_;
+		}
+		return !lastModified_.empty() && lastModified == lastModified_;
+	}
+	uint64_t doneBytes() const {
+		uint64_t n = 0;
+		for (auto& r : done) {
+			n += r.second - r.first;
+		}
+		return n;
+	}
+	// [0, size) 中尚未完成的区间
+	std::vector<Range> missing() const {
+		std::vector<Range> ret;
+		uint64_t pos = 0;
+		for (auto& r : done) {
+			if (r.first > pos) {
+				ret.push_back(Range(pos, r.first));
+			}
+			pos = std::max(pos, r.second);
+		}
+		if (pos < size) {
+			ret.push_back(Range(pos, size));
+		}
+		return ret;
+	}
+	void merge() {
+		std::sort(done.begin(), done.end());
+		std::vector<Range> merged;
+		for (auto& r : done) {
+			if (r.first >= r.second) {
+				continue;
+			}
+			if (!merged.empty() && r.first <= merged.back().second) {
+				merged.back().second = std::max(merged.back().second, r.second);
+			} else {
+				merged.push_back(r);
+			}
+		}
+		done.swap(merged);
+	}
+};
+
+/// 从文件读取的请求体，按需 pread，不把整个文件读入内存
+class FileSource : public UploadSource {
+public:
+	explicit FileSource(const std::string& path)
+	:m_fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC))
+	,m_size(-1)
+	,m_offset(0)
+	{
+		struct stat st;
+		if (m_fd >= 0 && fstat(m_fd, &st) == 0) {
+			m_size = st.st_size;
+#ifdef POSIX_FADV_SEQUENTIAL
+			posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+		}
+	}
+	~FileSource() {
+		if (m_fd >= 0) {
+			close(m_fd);
+		}
+	}
+	// 文件无法打开时为 false，不应提交
+	bool valid() const {
+		return m_size >= 0;
+	}
+	int64_t size() const override {
+		return m_size;
+	}
+	int64_t read(char* buffer, size_t size) override {
+		while (true) {
+			ssize_t n = pread(m_fd, buffer, size, m_offset);
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			if (n > 0) {
+				m_offset += n;
+			}
+			return n;
+		}
+	}
+	bool rewind() override {
+		m_offset = 0;
+		return true;
+	}
+private:
+	int m_fd;
+	int64_t m_size;
+	off_t m_offset;
+};
+
+/// 映射到内存的文件，整块交给 curl 发送，既不读入用户态缓冲区也不复制
+class MappedFileSource : public UploadSource {
+public:
+	explicit MappedFileSource(const std::string& path)
+	:m_data(NULL)
+	,m_size(0)
+	,m_valid(false)
+	{
+		int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		struct stat st;
+		if (fd >= 0 && fstat(fd, &st) == 0) {
+			m_size = (size_t)st.st_size;
+			if (m_size == 0) {
+				m_valid = true;
+			} else {
+				void* p = mmap(NULL, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+				if (p != MAP_FAILED) {
+					m_data = static_cast<const char*>(p);
+					madvise(p, m_size, MADV_SEQUENTIAL);
+					m_valid = true;
+				}
+			}
+		}
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+	~MappedFileSource() {
+		if (m_data) {
+			munmap(const_cast<char*>(m_data), m_size);
+		}
+	}
+	bool valid() const {
+		return m_valid;
+	}
+	int64_t size() const override {
+		return (int64_t)m_size;
+	}
+	int64_t read(char* buffer, size_t size) override {
+		size_t n = std::min(size, m_size - m_offset);
+		memcpy(buffer, m_data + m_offset, n);
+		m_offset += n;
+		return (int64_t)n;
+	}
+	bool rewind() override {
+		m_offset = 0;
+		return true;
+	}
+	const char* data() const override {
+		return m_size ? m_data : "";
+	}
+private:
+	const char* m_data;
+	size_t m_size;
+	size_t m_offset = 0;
+	bool m_valid;
+};
+
+/// 按 URL 保存下载结果及其 ETag/Last-Modified 的磁盘缓存，同一目录可由多个进程共享。
+/// 缓存过的 URL 再次下载时带 If-None-Match/If-Modified-Since，304 时把缓存的内容链接到目标路径，只花一个往返。
+/// index/<URL 的 SHA-256> 记录校验字段与对象名，objects/ 下为内容；byContent 时对象按内容的 SHA-256 命名，
+/// 相同内容的不同 URL 共用一个对象（存入时需要读一遍文件）。
+/// 记录的 mtime 为最近使用时间（不修改对象，硬链接出去的文件保持原样），总大小超过 maxBytes 时
+/// 从最久未用的对象开始删除，最近存入的对象总是保留。
+/// 查找与取出持有 dir/lock 的共享 flock，存入与淘汰持有独占 flock，文件都先写临时名再 rename。
+/// 查找时打开对象并保存在 Entry 中，之后即使被其他进程淘汰，仍可从打开的文件取出
+class DownloadCache {
+public:
+	// HARDLINK 时下载的文件与缓存共用 inode，不能原地修改；REFLINK 在文件系统不支持时退化为复制
+	enum LinkMode {
+		HARDLINK,
+		REFLINK
+	};
+	struct Entry {
+		std::string url;
+		std::string etag;
+		std::string lastModified;
+		uint64_t size = 0;
+		std::string object;         // objects/ 下的文件名
+		std::shared_ptr<int> pin;   // lookup 打开的对象文件描述符
+	};
+
+	DownloadCache(const std::string& dir, uint64_t maxBytes, bool byContent = false, LinkMode mode = HARDLINK)
+	:m_dir(dir)
+	,m_maxBytes(maxBytes)
+	,m_byContent(byContent)
+	,m_mode(mode)
+	{}
+	/// 创建缓存目录
+	bool open() {
+		for (const std::string& dir : {m_dir, m_dir + "/index", m_dir + "/objects"}) {
+			if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+				return false;
+			}
+		}
+		return true;
+	}
+	/// 查找 url 的记录并打开对象，对象已被淘汰时返回 false
+	bool lookup(const std::string& url, Entry& entry) {
+		FileLock lock(m_dir + "/lock", false);
+		if (!lock || !load(indexPath(url), entry) || entry.url != url) {
+			return false;
+		}
+		int fd = ::open(objectPath(entry.object).c_str(), O_RDONLY | O_CLOEXEC);
+		struct stat st;
+		if (fd < 0 || fstat(fd, &st) != 0 || (uint64_t)st.st_size != entry.size) {
+			if (fd >= 0) {
+				close(fd);
+			}
+			return false;
+		}
+		entry.pin = std::shared_ptr<int>(new int(fd), [](int* p) {
+			close(*p);
+			delete p;
+		});
+		return true;
+	}
+	/// 条件请求的请求头
+	static std::vector<std::string> conditionalHeaders(const Entry& entry) {
+		std::vector<std::string> headers;
+		if (!entry.etag.empty()) {
+			headers.push_back("If-None-Match: " + entry.etag);
+		}
+		if (!entry.lastModified.empty()) {
+			headers.push_back("If-Modified-Since: " + entry.lastModified);
+		}
+		return headers;
+	}
+	/// 把缓存的内容原子地放到 path，并记为最近使用
+	bool materialize(const Entry& entry, const std::string& path) {
+		FileLock lock(m_dir + "/lock", false);
+		if (!lock) {
+			return false;
+		}
+		std::string object = objectPath(entry.object);
+		std::string tmp = path + ".link";
+		unlink(tmp.c_str());
+		// 对象仍是查找时打开的那个时可以硬链接，已被淘汰或替换时从打开的文件复制
+		bool linked = false;
+		if (entry.pin) {
+			struct stat pinned, current;
+			if (m_mode == HARDLINK && fstat(*entry.pin, &pinned) == 0 && stat(object.c_str(), &current) == 0 &&
+				pinned.st_dev == current.st_dev && pinned.st_ino == current.st_ino) {
+				linked = link(object.c_str(), tmp.c_str()) == 0;
+			}
+			if (!linked && !copyFile(*entry.pin, tmp)) {
+				return false;
+			}
+		} else if (!linkOrCopy(object, tmp)) {
+			return false;
+		}
+		bool ok = rename(tmp.c_str(), path.c_str()) == 0;
+		// path 已是同一对象的硬链接时 rename 什么也不做，临时名仍然存在
+		unlink(tmp.c_str());
+		if (ok) {
+			utimensat(AT_FDCWD, indexPath(entry.url).c_str(), NULL, 0);
+		}
+		return ok;
+	}
+	/// 下载完成的 path 存入缓存，之后不能再修改它。没有校验字段时无法再验证，不存入
+	bool store(const std::string& url, const std::string& path, const std::string& etag, const std::string& lastModified) {
+		struct stat st;
+		if ((etag.empty() && lastModified.empty()) || stat(path.c_str(), &st) != 0) {
+			return false;
+		}
+		Entry entry;
+		entry.url = url;
+		entry.etag = etag;
+		entry.lastModified = lastModified;
+		entry.size = st.st_size;
+		if (!m_byContent) {
+			entry.object = "u-" + hexKey(url);
+		} else if (!hashFile(path, entry.object)) {
+			return false;
+		}
+		FileLock lock(m_dir + "/lock", true);
+		if (!lock) {
+			return false;
+		}
+		std::string object = objectPath(entry.object);
+		// 按内容命名时相同内容可能已经存在
+		if (!m_byContent || objectSize(entry.object) != (int64_t)entry.size) {
+			std::string tmp = object + ".tmp";
+			unlink(tmp.c_str());
+			if (!linkOrCopy(path, tmp) || rename(tmp.c_str(), object.c_str()) != 0) {
+				unlink(tmp.c_str());
+				return false;
+			}
+		}
+		// 新写的记录 mtime 即为最近使用时间
+		if (!save(indexPath(url), entry)) {
+			return false;
+		}
+		evict(entry.object);
+		return true;
+	}
+	/// 缓存中对象的总字节数
+	uint64_t usage() {
+		FileLock lock(m_dir + "/lock", false);
+		std::vector<Object> objects;
+		return lock ? listObjects(objects) : 0;
+	}
+private:
+	// flock 作用于打开的文件描述，每次操作单独打开，同一进程的多个线程之间也互斥
+	class FileLock {
+	public:
+		FileLock(const std::string& path, bool exclusive) : m_fd(::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644)) {
+			while (m_fd >= 0 && flock(m_fd, exclusive ? LOCK_EX : LOCK_SH) != 0) {
+				if (errno != EINTR) {
+					close(m_fd);
+					m_fd = -1;
+				}
+			}
+		}
+		~FileLock() {
+			if (m_fd >= 0) {
+				close(m_fd);
+			}
+		}
+		explicit operator bool() const {
+			return m_fd >= 0;
+		}
+	private:
+		int m_fd;
+	};
+	struct Object {
+		std::string name;
+		uint64_t size;
+		int64_t used;               // 指向它的记录中最新的 mtime，纳秒；没有记录时为 0
+	};
+
+	static std::string hexKey(const std::string& text) {
+		Sha256 sha;
+		sha.update(text.data(), text.size());
+		return sha.hexdigest();
+	}
+	static bool hashFile(const std::string& path, std::string& hex) {
+		int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			return false;
+		}
+		Sha256 sha;
+		std::unique_ptr<char[]> buffer(new char[1 << 20]);
+		ssize_t n;
+		while ((n = read(fd, buffer.get(), 1 << 20)) > 0 || (n < 0 && errno == EINTR)) {
+			if (n > 0) {
+				sha.update(buffer.get(), n);
+			}
+		}
+		close(fd);
+		hex = sha.hexdigest();
+		return n == 0;
+	}
+	std::string indexPath(const std::string& url) const {
+		return m_dir + "/index/" + hexKey(url);
+	}
+	std::string objectPath(const std::string& name) const {
+		return m_dir + "/objects/" + name;
+	}
+	int64_t objectSize(const std::string& name) const {
+		struct stat st;
+		return !name.empty() && stat(objectPath(name).c_str(), &st) == 0 ? (int64_t)st.st_size : -1;
+	}
+	static int64_t mtime(const struct stat& st) {
+#ifdef __APPLE__
+		return st.st_mtimespec.tv_sec * 1000000000ll + st.st_mtimespec.tv_nsec;
+#else
+		return st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec;
+#endif
+	}
+	static bool load(const std::string& file, Entry& entry) {
+		std::ifstream in(file);
+		if (!in) {
+			return false;
+		}
+		std::string line;
+		while (std::getline(in, line)) {
+			size_t sp = line.find(' ');
+			std::string key = line.substr(0, sp);
+			std::string value = sp == std::string::npos ? std::string() : line.substr(sp + 1);
+			if (key == "url") {
+				entry.url = value;
+			} else if (key == "size") {
+				entry.size = strtoull(value.c_str(), NULL, 10);
+			} else if (key == "etag") {
+				entry.etag = value;
+			} else if (key == "last-modified") {
+				entry.lastModified = value;
+			} else if (key == "object") {
+				entry.object = value;
+			}
+		}
+		return !entry.url.empty() && !entry.object.empty();
+	}
+	static bool save(const std::string& file, const Entry& entry) {
+		std::string tmp = file + ".tmp";
+		{
+			std::ofstream out(tmp, std::ios::trunc);
+			out << "url " << entry.url << "\n" << "size " << entry.size << "\n" << "object " << entry.object << "\n";
+			if (!entry.etag.empty()) {
+				out << "etag " << entry.etag << "\n";
+			}
+			if (!entry.lastModified.empty()) {
+				out << "last-modified " << entry.lastModified << "\n";
+			}
+			if (!out.flush()) {
+				return false;
+			}
+		}
+		return rename(tmp.c_str(), file.c_str()) == 0;
+	}
+	// 硬链接失败（如跨文件系统）时先尝试 reflink，再复制
+	bool linkOrCopy(const std::string& from, const std::string& to) const {
+		if (m_mode == HARDLINK && link(from.c_str(), to.c_str()) == 0) {
+			return true;
+		}
+		int in = ::open(from.c_str(), O_RDONLY | O_CLOEXEC);
+		if (in < 0) {
+			return false;
+		}
+		bool ok = copyFile(in, to);
+		close(in);
+		return ok;
+	}
+	// 用 pread 读取，同一个 pin 可被多个线程同时复制
+	static bool copyFile(int in, const std::string& to) {
+		int out = ::open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		bool ok = out >= 0;
+#ifdef FICLONE
+		bool cloned = ok && ioctl(out, FICLONE, in) == 0;
+#else
+		bool cloned = false;
+#endif
+		if (ok && !cloned) {
+			std::unique_ptr<char[]> buffer(new char[1 << 20]);
+			ssize_t n;
+			off_t offset = 0;
+			while (ok && ((n = pread(in, buffer.get(), 1 << 20, offset)) != 0)) {
+				if (n < 0) {
+					ok = errno == EINTR;
+					continue;
+				}
+				offset += n;
+				for (ssize_t done = 0; ok && done < n;) {
+					ssize_t w = write(out, buffer.get() + done, n - done);
+					if (w > 0) {
+						done += w;
+					} else {
+						ok = w < 0 && errno == EINTR;
+					}
+				}
+			}
+		}
+		if (out >= 0) {
+			close(out);
+		}
+		if (!ok) {
+			unlink(to.c_str());
+		}
+		return ok;
+	}
+	uint64_t listObjects(std::vector<Object>& objects) const {
+		uint64_t total = 0;
+		DIR* dir = opendir((m_dir + "/objects").c_str());
+		if (!dir) {
+			return 0;
+		}
+		while (dirent* ent = readdir(dir)) {
+			// 跳过 . .. 与临时文件
+			struct stat st;
+			if (strchr(ent->d_name, '.') || stat(objectPath(ent->d_name).c_str(), &st) != 0) {
+				continue;
+			}
+			objects.push_back(Object{ent->d_name, (uint64_t)st.st_size, 0});
+			total += st.st_size;
+		}
+		closedir(dir);
+		return total;
+	}
+	// 持有独占锁时调用
+	void evict(const std::string& keep) {
+		std::vector<Object> objects;
+		uint64_t total = listObjects(objects);
+		if (total <= m_maxBytes) {
+			return;
+		}
+		std::unordered_map<std::string, int64_t> used;
+		if (DIR* index = opendir((m_dir + "/index").c_str())) {
+			while (dirent* ent = readdir(index)) {
+				Entry entry;
+				struct stat st;
+				std::string file = m_dir + "/index/" + ent->d_name;
+				if (!strchr(ent->d_name, '.') && stat(file.c_str(), &st) == 0 && load(file, entry)) {
+					int64_t& t = used[entry.object];
+					t = std::max(t, mtime(st));
+				}
+			}
+			closedir(index);
+		}
+		for (auto& o : objects) {
+			auto it = used.find(o.name);
+			if (it != used.end()) {
+				o.used = it->second;
+			}
+		}
+		std::sort(objects.begin(), objects.end(), [](const Object& a, const Object& b) {
+			return a.used < b.used;
+		});
+		for (auto& o : objects) {
+			if (total <= m_maxBytes) {
+				break;
+			}
+			if (o.name != keep && unlink(objectPath(o.name).c_str()) == 0) {
+				total -= o.size;
+			}
+		}
+		// 删除指向已淘汰对象的记录
+		DIR* dir = opendir((m_dir + "/index").c_str());
+		if (!dir) {
+			return;
+		}
+		while (dirent* ent = readdir(dir)) {
+			Entry entry;
+			std::string file = m_dir + "/index/" + ent->d_name;
+			if (!strchr(ent->d_name, '.') && load(file, entry) && objectSize(entry.object) < 0) {
+				unlink(file.c_str());
+			}
+		}
+		closedir(dir);
+	}
+
+	const std::string m_dir;
+	const uint64_t m_maxBytes;
+	const bool m_byContent;
+	const LinkMode m_mode;
+};
+
+/// 启用缓存时的文件下载：响应 200 时照常写入文件，成功后存入缓存；条件请求得到 304 时丢弃临时文件，从缓存取出
+class CachedFileSink : public DownloadSink {
+public:
+	CachedFileSink(std::shared_ptr<FileSink> file, std::shared_ptr<DownloadCache> cache, const std::string& url,
+				   const DownloadCache::Entry* cached = NULL)
+	:m_file(file)
+	,m_cache(cache)
+	,m_url(url)
+	,m_hasEntry(cached != NULL)
+	,m_status(0)
+	{
+		if (cached) {
+			m_entry = *cached;
+		}
+	}
+	void header(const char* data, size_t size) override {
+		std::string value;
+		if (int status = parseStatusLine(data, size)) {
+			m_status = status;
+			m_etag.clear();
+			m_lastModified.clear();
+		} else if (matchHeader(data, size, "ETag", value)) {
+			m_etag = value;
+		} else if (matchHeader(data, size, "Last-Modified", value)) {
+			m_lastModified = value;
+		}
+		m_file->header(data, size);
+	}
+	void reserve(size_t size) override {
+		m_file->reserve(size);
+	}
+	bool write(const char* data, size_t size) override {
+		return m_file->write(data, size);
+	}
+	bool finish(DownloadResult result) override {
+		if (result == E_OK && m_status == 304 && m_hasEntry) {
+			m_file->finish(E_DOWNLOADFAIL);
+			return m_cache->materialize(m_entry, m_file->path());
+		}
+		if (!m_file->finish(result)) {
+			return false;
+		}
+		// 存入失败不影响下载结果
+		if (result == E_OK) {
+			m_cache->store(m_url, m_file->path(), m_etag, m_lastModified);
+		}
+		return true;
+	}
+private:
+	std::shared_ptr<FileSink> m_file;
+	std::shared_ptr<DownloadCache> m_cache;
+	std::string m_url;
+	bool m_hasEntry;
+	DownloadCache::Entry m_entry;
+	int m_status;
+	std::string m_etag;
+	std::string m_lastModified;
+};
+#endif
+
+/*
+下载任务的调度：先按优先级，同一优先级内按截止时间（入队时间 + timeout_ms）排序，最早的先执行（EDF）。
+未设置超时的任务截止时间按 kNoTimeoutMs 计算，只影响同一优先级内的先后，不会排到低优先级任务之后。
+低优先级任务等待 agingDelayMs 后提升为最高优先级、保留原截止时间参与排序，不会饿死。
+每个主机有并发上限，达到上限的主机上的任务不参与选择，不阻塞其他主机。
+不加锁，由调用者保护。
+*/
+template<typename Task>
+class DownloadScheduler {
+public:
+	typedef std::chrono::steady_clock Clock;
+	static const int kNoTimeoutMs = 60 * 1000;
+
+	DownloadScheduler() : m_hostLimit(0), m_size(0), m_seq(0) {}
+
+	/// 每个主机同时执行的任务数上限，0 表示不限制
+	void setHostLimit(size_t limit) {
+		m_hostLimit = limit;
+		for (auto& v : m_hosts) {
+			updateReady(v.first, v.second);
+		}
+	}
+	void push(Task task, const std::string& host, DownloadPriority priority, int timeout_ms, Clock::time_point now = Clock::now()) {
+		if (timeout_ms <= 0) {
+			timeout_ms = kNoTimeoutMs;
+		}
+		Key key;
+		key.band = (int)priority;
+		key.when = now + std::chrono::milliseconds(timeout_ms);
+		key.seq = m_seq++;
+		Entry entry;
+		entry.task = std::move(task);
+		entry.agedAt = now + std::chrono::milliseconds(agingDelayMs(priority));
+		if (key.band != 0) {
+			m_aging.emplace(std::make_pair(entry.agedAt, key.seq), std::make_pair(host, key));
+		}
+		Host& h = m_hosts[host];
+		removeReady(host, h);
+		h.pending.emplace(key, std::move(entry));
+		m_size++;
+		updateReady(host, h);
+	}
+	/// 取出下一个可执行的任务，计入所属主机的并发数；所有待执行任务的主机都已满时返回 false
+	bool pop(Task& task, std::string& host, Clock::time_point now = Clock::now()) {
+		promote(now);
+		if (m_ready.empty()) {
+			return false;
+		}
+		host = m_ready.begin()->second;
+		Host& h = m_hosts[host];
+		removeReady(host, h);
+		auto it = h.pending.begin();
+		if (it->first.band != 0) {
+			m_aging.erase(std::make_pair(it->second.agedAt, it->first.seq));
+		}
+		task = std::move(it->second.task);
+		h.pending.erase(it);
+		h.active++;
+		m_size--;
+		updateReady(host, h);
+		return true;
+	}
+	/// pop 出的任务结束后调用
+	void release(const std::string& host) {
+		auto it = m_hosts.find(host);
+		if (it == m_hosts.end()) {
+			return;
+		}
+		Host& h = it->second;
+		removeReady(host, h);
+		if (h.active) {
+			h.active--;
+		}
+		if (h.active == 0 && h.pending.empty()) {
+			m_hosts.erase(it);
+			return;
+		}
+		updateReady(host, h);
+	}
+	size_t size() const {
+		return m_size;
+	}
+	bool empty() const {
+		return m_size == 0;
+	}
+	size_t active(const std::string& host) const {
+		auto it = m_hosts.find(host);
+		return it == m_hosts.end() ? 0 : it->second.active;
+	}
+
+	/// 等待多久后提升为最高优先级
+	static int agingDelayMs(DownloadPriority priority) {
+		switch (priority) {
+		case PRIORITY_HIGH:
+			return 0;
+		case PRIORITY_NORMAL:
+			return 2 * 1000;
+		default:
+			return 30 * 1000;
+		}
+	}
+private:
+	struct Key {
+		int band;                   // 优先级，提升后为 0
+		Clock::time_point when;     // 截止时间
+		uint64_t seq;
+		bool operator<(const Key& rhs) const {
+			if (band != rhs.band) {
+				return band < rhs.band;
+			}
+			return when != rhs.when ? when < rhs.when : seq < rhs.seq;
+		}
+	};
+	struct Entry {
+		Task task;
+		Clock::time_point agedAt;
+	};
+	struct Host {
+		std::map<Key, Entry> pending;
+		size_t active = 0;
+		bool ready = false;
+	};
+	// 把等待已久的低优先级任务提升到最高优先级
+	void promote(Clock::time_point now) {
+		while (!m_aging.empty() && m_aging.begin()->first.first <= now) {
+			auto a = m_aging.begin();
+			std::string host = a->second.first;
+			Key key = a->second.second;
+			m_aging.erase(a);
+			Host& h = m_hosts[host];
+			removeReady(host, h);
+			auto it = h.pending.find(key);
+			Entry entry = std::move(it->second);
+			h.pending.erase(it);
+			key.band = 0;
+			h.pending.emplace(key, std::move(entry));
+			updateReady(host, h);
+		}
+	}
+	// m_ready 中每个未满且有待执行任务的主机一项，键为该主机最早的任务
+	void removeReady(const std::string& host, Host& h) {
+		if (h.ready) {
+			m_ready.erase(std::make_pair(h.pending.begin()->first, host));
+			h.ready = false;
+		}
+	}
+	void updateReady(const std::string& host, Host& h) {
+		bool ready = !h.pending.empty() && (m_hostLimit == 0 || h.active < m_hostLimit);
+		if (ready && !h.ready) {
+			m_ready.insert(std::make_pair(h.pending.begin()->first, host));
+		} else if (!ready && h.ready) {
+			m_ready.erase(std::make_pair(h.pending.begin()->first, host));
+		}
+		h.ready = ready;
+	}
+
+	std::unordered_map<std::string, Host> m_hosts;
+	std::set<std::pair<Key, std::string>> m_ready;
+	// 尚未提升的低优先级任务，按提升时间排序
+	std::map<std::pair<Clock::time_point, uint64_t>, std::pair<std::string, Key>> m_aging;
+	size_t m_hostLimit;
+	size_t m_size;
+	uint64_t m_seq;
+};
+
+template<typename LockType = std::mutex>
+class MultiDownload {
+public:
+	typedef std::function<void(const char* fileId, const char* url, const CallbackData& callbackData)> DownloadCallback;
+	typedef std::function<curl_slist*(curl_slist* header)> HeaderCallback;
+	typedef std::function<void(const char* fileId, const char* url, const TransferMetrics& metrics)> MetricsCallback;
+	/// submit/submitBatch 的请求，提交时内容被移走。context 或 body 为 POST 的内容
+	struct Request {
+		std::string fileId;
+		std::string url;
+		DownloadCallback cb;
+		HeaderCallback hcb;
+
+		int timeout_ms = 0;
+		bool isPost = false;
+		std::string context;
+		std::shared_ptr<UploadSource> body;     // 设置后代替 context 作为 POST 的内容
+		std::shared_ptr<DownloadSink> sink;   // 设置后数据交给 sink，cb 只收到 FILESIZE 与 RESULT
+		std::vector<std::string> headers;   // 附加的请求头
+		DownloadPriority priority = PRIORITY_NORMAL;
+		// 期望的摘要，在收到数据时增量计算，不一致时结果为 E_CHECKSUM，sink 收到 finish(E_CHECKSUM)。
+		// 分段下载的数据不按顺序到达，不支持
+		std::string sha256;         // 64 个十六进制字符，空表示不校验
+		bool checkCrc32c = false;
+		uint32_t crc32c = 0;
+		std::shared_ptr<CancelToken> cancelToken;   // 见 cancel
+		uint64_t maxRecvSpeed = 0;  // 单个传输的接收速度上限，字节/秒，由 curl 控制，0 表示不限
+		// 内容相同的其他 URL。非空或 hedge 为 true 时按 HedgePolicy 对冲与重试，
+		// 数据总在下载线程上处理，不经过背压缓冲区
+		std::vector<std::string> mirrors;
+		bool hedge = false;
+	};
+	/// maxHostConnections 限制到同一主机的连接数，0 表示不限制；
+	/// 支持 HTTP/2 的主机上多个请求复用同一连接，不受该限制影响并发数。
+	/// loops 大于 1 时启动多个事件循环线程，每个拥有独立的 CURLM 与连接缓存，
+	/// maxConcurrency 平均分到各循环，maxHostConnections 按循环分别计算。
+	MultiDownload(size_t maxConcurrency, size_t maxHostConnections = 0, size_t loops = 1, LoopAssignment assignment = LEAST_LOADED)
+	:m_stop(false)
+	,m_joinStop(false)
+	,m_assignment(assignment)
+	{
+		loops = std::max<size_t>(loops, 1);
+		size_t perLoop = std::max<size_t>((maxConcurrency + loops - 1) / loops, 1);
+		for (size_t i = 0; i < loops; ++i) {
+			m_loops.emplace_back(new EventLoop(this, perLoop, maxHostConnections));
+		}
+		// 所有循环初始化完成后再启动下载线程
+		for (auto& loop : m_loops) {
+			loop->start();
+		}
+	}
+	~MultiDownload() {
+		m_stop = true;
+		// 先停止所有线程再释放，析构中的任务不会再访问其他循环
+		for (auto& loop : m_loops) {
+			loop->stop();
+		}
+		if (m_consumers) {
+			m_consumers->stop();
+		}
+		m_loops.clear();
+	}
+	/// priority 与 timeout_ms 决定排队顺序，见 DownloadScheduler
+	bool addPost(const char* fileId, const char* url, const char* data, size_t length, int timeout_ms, DownloadCallback cb, HeaderCallback hcb = nullptr, DownloadPriority priority = PRIORITY_NORMAL) {
+		// ֹͣ�����в��ٽ����µ���������
+		if (m_joinStop || m_stop) {
+			return false;
+		}
+		Request request;
+		request.fileId = fileId;
+		request.url = url;
+		request.cb = std::move(cb);
+		request.hcb = std::move(hcb);
+		request.timeout_ms = timeout_ms;
+		request.isPost = true;
+		request.priority = priority;
+		request.context.assign(data, length);
+		return submit(std::move(request));
+	}
+	/// 请求体来自 body，不复制调用者的内存；大文件用 FileSource/MappedFileSource 流式发送
+	bool addPost(const char* fileId, const char* url, std::shared_ptr<UploadSource> body, int timeout_ms, DownloadCallback cb, HeaderCallback hcb = nullptr, DownloadPriority priority = PRIORITY_NORMAL) {
+		if (m_joinStop || m_stop || !body) {
+			return false;
+		}
+		Request request;
+		request.fileId = fileId;
+		request.url = url;
+		request.cb = std::move(cb);
+		request.hcb = std::move(hcb);
+		request.timeout_ms = timeout_ms;
+		request.isPost = true;
+		request.priority = priority;
+		request.body = std::move(body);
+		return submit(std::move(request));
+	}
+	size_t QueueSize()
+	{
+		size_t size = 0;
+		for (auto& loop : m_loops) {
+			size += loop->queueSize();
+		}
+		return size;
+	}
+	bool addDownload(const char* fileId, const char* url, int timeout_ms, DownloadCallback cb, DownloadPriority priority = PRIORITY_NORMAL) {
+		// ֹͣ�����в��ٽ����µ���������
+		if (m_joinStop || m_stop) {
+			return false;
+		}
+		Request request;
+		request.fileId = fileId;
+		request.url = url;
+		request.cb = std::move(cb);
+		request.timeout_ms = timeout_ms;
+		request.priority = priority;
+		return submit(std::move(request));
+	}
+	// 数据交给 sink 处理，cb 只收到 FILESIZE 与 RESULT
+	bool addDownload(const char* fileId, const char* url, int timeout_ms, std::shared_ptr<DownloadSink> sink, DownloadCallback cb, DownloadPriority priority = PRIORITY_NORMAL) {
+		if (m_joinStop || m_stop || !sink) {
+			return false;
+		}
+		Request request;
+		request.fileId = fileId;
+		request.url = url;
+		request.cb = std::move(cb);
+		request.timeout_ms = timeout_ms;
+		request.sink = std::move(sink);
+		request.priority = priority;
+		return submit(std::move(request));
+	}
+	bool submit(Request&& request) {
+		if (m_joinStop || m_stop) {
+			return false;
+		}
+		if (request.hedge || !request.mirrors.empty()) {
+			std::make_shared<HedgedJob>(this, DownloadContext(std::move(request)))->start();
+			return true;
+		}
+		if (m_coalesce && coalescable(request)) {
+			coalesce(std::move(request));
+			return true;
+		}
+		enqueue(DownloadContext(std::move(request)));
+		return true;
+	}
+	/// 一次提交多个请求：请求被移入各事件循环的无锁队列，每个循环只做一次 CAS 与一次唤醒。
+	/// 停止后返回 false，不提交任何请求
+	bool submitBatch(std::vector<Request>&& requests) {
+		if (m_joinStop || m_stop) {
+			return false;
+		}
+		std::vector<size_t> loads = loadSnapshot();
+		std::vector<std::pair<Submission*, Submission*>> chains(m_loops.size(), std::make_pair((Submission*)NULL, (Submission*)NULL));
+		std::vector<size_t> counts(m_loops.size(), 0);
+		auto now = std::chrono::steady_clock::now();
+		for (auto& request : requests) {
+			if (request.hedge || !request.mirrors.empty()) {
+				std::make_shared<HedgedJob>(this, DownloadContext(std::move(request)))->start();
+				continue;
+			}
+			if (m_coalesce && coalescable(request)) {
+				coalesce(std::move(request));
+				continue;
+			}
+			Submission* node = new Submission(DownloadContext(std::move(request)));
+			node->ctx.enqueueTime = now;
+			size_t index = pickLoop(node->ctx.url, loads);
+			loads[index]++;
+			// 倒序串起来，队列取出后翻转时恢复提交顺序
+			node->next = chains[index].first;
+			chains[index].first = node;
+			if (!chains[index].second) {
+				chains[index].second = node;
+			}
+			counts[index]++;
+		}
+		requests.clear();
+		for (size_t i = 0; i < m_loops.size(); ++i) {
+			if (counts[i]) {
+				m_loops[i]->push(chains[i].first, chains[i].second, counts[i]);
+			}
+		}
+		return true;
+	}
+#ifndef _WIN32
+	// 下载到文件，成功后 savePath 才出现；临时文件无法创建时返回 false
+	bool addDownloadToFile(const char* fileId, const char* url, const char* savePath, int timeout_ms, DownloadCallback cb, DownloadPriority priority = PRIORITY_NORMAL) {
+		std::shared_ptr<FileSink> sink = std::make_shared<FileSink>(savePath);
+		if (!sink->open()) {
+			return false;
+		}
+		if (!m_cache) {
+			return addDownload(fileId, url, timeout_ms, sink, cb, priority);
+		}
+		if (m_joinStop || m_stop) {
+			return false;
+		}
+		DownloadContext ctx;
+		ctx.fileId = fileId;
+		ctx.url = url;
+		ctx.cb = std::move(cb);
+		ctx.timeout_ms = timeout_ms;
+		ctx.priority = priority;
+		DownloadCache::Entry entry;
+		ctx.conditional = m_cache->lookup(url, entry);
+		if (ctx.conditional) {
+			ctx.headers = DownloadCache::conditionalHeaders(entry);
+		}
+		ctx.sink = std::make_shared<CachedFileSink>(sink, m_cache, url, ctx.conditional ? &entry : NULL);
+		enqueue(std::move(ctx));
+		return true;
+	}
+	/// 启用磁盘缓存，之后的 addDownloadToFile 与 addSegmentedDownload 先发条件请求，未变化时从缓存取出。
+	/// 须在提交任务之前调用
+	void setCache(std::shared_ptr<DownloadCache> cache) {
+		m_cache = std::move(cache);
+	}
+	/// 分段下载到文件：先用 HEAD 探测大小与 Accept-Ranges，再切成 segments 段并发下载，
+	/// 各段直接写到文件中的对应偏移。某段完成后会从剩余最多的段尾部切走一半另起连接，
+	/// 慢连接上的数据因此由其他连接分担。服务器不支持 Range 时退化为单连接下载。
+	/// 各段与普通任务一样受 maxConcurrency 限制。
+	/// resumable 为 true 时在 savePath.journal 中记录进度，失败或进程重启后再次调用会
+	/// 只下载缺少的区间；服务器返回的 ETag/Last-Modified 与记录不一致时从头下载。
+	bool addSegmentedDownload(const char* fileId, const char* url, const char* savePath, int timeout_ms, size_t segments, DownloadCallback cb, bool resumable = true, DownloadPriority priority = PRIORITY_LOW) {
+		if (m_joinStop || m_stop) {
+			return false;
+		}
+		std::shared_ptr<FileSink> file = std::make_shared<FileSink>(savePath);
+		file->setKeepPartial(resumable);
+		if (!file->open()) {
+			return false;
+		}
+		DownloadContext ctx;
+		ctx.fileId = fileId;
+		ctx.url = url;
+		ctx.cb = std::move(cb);
+		ctx.timeout_ms = timeout_ms;
+		ctx.sink = file;
+		ctx.priority = priority;
+		std::make_shared<SegmentedJob>(this, std::move(ctx), file, segments, resumable)->start();
+		return true;
+	}
+#endif
+
+	/// 背压模式：响应头、数据与 RESULT 回调（或 sink 的各调用）不在下载线程上执行，而是按任务放入
+	/// 最多 ringChunks 块、每块 chunkSize 字节的缓冲区，由 consumers 个消费线程按顺序处理。
+	/// 某个任务的缓冲区满时用 CURL_WRITEFUNC_PAUSE 暂停它，消费后再恢复，下载线程继续服务其他任务；
+	/// 缓冲区在结果回调之后才释放并发名额，缓冲内存不超过 maxConcurrency * ringChunks * chunkSize。
+	/// 分段下载的内部任务不经过缓冲区。须在提交任务之前调用，只能调用一次
+	void setBackpressure(size_t consumers, size_t ringChunks = 8, size_t chunkSize = 64 << 10) {
+		if (consumers == 0 || m_consumers) {
+			return;
+		}
+		chunkSize = std::min<size_t>(std::max<size_t>(chunkSize, 16 << 10), CURL_MAX_READ_SIZE);
+		m_consumers.reset(new ConsumerPool(consumers, std::max<size_t>(ringChunks, 1), chunkSize));
+	}
+	/// 背压模式下各任务缓冲区当前占用的字节数
+	size_t bufferedBytes() const {
+		return m_consumers ? m_consumers->bufferedBytes() : 0;
+	}
+
+	/// 每隔 interval_ms 最多回调一次 PROGRESS，0（默认）表示不回调。
+	/// 分段下载汇总各段的进度；背压模式下与数据一样在消费线程上按顺序回调
+	void setProgressInterval(int interval_ms) {
+		m_progressInterval = std::max(interval_ms, 0);
+	}
+	/// 每次传输结束时在下载线程上回调，早于或同时于 RESULT 回调。须在提交任务之前调用
+	void setMetricsCallback(MetricsCallback cb) {
+		m_metricsCallback = std::move(cb);
+	}
+	/// 所有已结束传输的汇总指标
+	DownloadStats stats() const {
+		return m_metrics.snapshot();
+	}
+
+	/// 取消所有带有 token 的请求，结果为 E_CANCELLED：进行中的立即中止，排队中的轮到时直接结束，
+	/// 对冲请求不再发出新的尝试
+	void cancel(const std::shared_ptr<CancelToken>& token) {
+		if (!token) {
+			return;
+		}
+		token->cancelled = true;
+		for (auto& loop : m_loops) {
+			loop->requestCancel();
+		}
+	}
+	/// 全局接收限速，字节/秒，0 表示不限。PRIORITY_HIGH 的数据计入但不受其限制。
+	/// 以下限速都可在运行中修改，进行中的传输在下一次收到数据或暂停到期时按新的限速执行
+	void setBandwidthLimit(uint64_t bytesPerSec, uint64_t burst = 0) {
+		m_limiter.setGlobal(bytesPerSec, burst);
+	}
+	/// 按主机限速，host 为 url 中的 host:port（见 urlAuthority）
+	void setHostBandwidthLimit(const std::string& host, uint64_t bytesPerSec, uint64_t burst = 0) {
+		m_limiter.setHost(host, bytesPerSec, burst);
+	}
+	void setPriorityBandwidthLimit(DownloadPriority priority, uint64_t bytesPerSec, uint64_t burst = 0) {
+		m_limiter.setPriority(priority, bytesPerSec, burst);
+	}
+	/// 合并进行中的相同请求：URL、请求头、优先级与超时都相同的 GET 共用一个传输，各自的回调或 sink 收到同样的响应头、
+	/// 数据与结果。传输开始后加入的请求先补发已收到的数据：不超过 replayBytes 时来自内存，
+	/// 超过后来自第一个请求的 FileSink（addDownloadToFile），都没有时另起一个传输。
+	/// POST、对冲、带取消标记、摘要校验、单独限速或设置了 hcb 的请求，以及启用缓存后的 addDownloadToFile 不合并。须在提交任务之前调用
+	void setCoalescing(bool enable, size_t replayBytes = 8 << 20) {
+		m_replayBytes = replayBytes;
+		m_coalesce = enable;
+	}
+	/// 对冲请求的参数，须在提交任务之前调用
+	void setHedgePolicy(const HedgePolicy& policy) {
+		m_hedgePolicy = policy;
+	}
+	/// 对冲请求积累的各镜像耗时与吞吐估计
+	const MirrorStats& mirrorStats() const {
+		return m_mirrors;
+	}
+
+	/// 每个主机同时进行的任务数上限（按事件循环分别计算），0 表示不限制。
+	/// 与 maxHostConnections 不同，HTTP/2 复用同一连接的请求也计入
+	void setHostLimit(size_t limit) {
+		for (auto& loop : m_loops) {
+			loop->setHostLimit(limit);
+		}
+	}
+
+	void join() {
+		m_joinStop = true;
+		m_stop = true;
+		for (auto& loop : m_loops) {
+			loop->stop();
+		}
+		// 下载线程都已退出，处理完缓冲区中剩余的数据与结果
+		if (m_consumers) {
+			m_consumers->stop();
+		}
+	}
+private:
+	class EventLoop;
+	class TransferRing;
+	// 只能移动，从提交到 DownloadInstance 的各环节都不复制 POST 内容与回调
+	struct DownloadContext : Request {
+		std::string range;          // CURLOPT_RANGE，如 "0-1023"
+		bool headOnly = false;      // 只请求响应头
+		std::string host;           // url 中的 host:port，用于按主机限制并发
+		bool direct = false;        // 内部任务，数据总在下载线程上处理，不经过背压缓冲区
+		int retries = 0;            // 分段下载中该段的重试次数或对冲请求的尝试序号，只用于指标
+		bool conditional = false;   // 带缓存校验字段的请求，304 视为成功，由 sink 从缓存取出内容
+		std::shared_ptr<CancelToken> attemptToken;  // 对冲请求中单个尝试的取消标记
+		std::chrono::steady_clock::time_point enqueueTime;
+
+		DownloadContext() {}
+		explicit DownloadContext(Request&& request) : Request(std::move(request)) {}
+		DownloadContext(DownloadContext&&) = default;
+		DownloadContext& operator=(DownloadContext&&) = default;
+		DownloadContext(const DownloadContext&) = delete;
+		DownloadContext& operator=(const DownloadContext&) = delete;
+
+		bool cancelled() const {
+			return (this->cancelToken && this->cancelToken->cancelled) || (attemptToken && attemptToken->cancelled);
+		}
+	};
+	// 提交队列的节点
+	struct Submission {
+		DownloadContext ctx;
+		Submission* next;
+		explicit Submission(DownloadContext&& c) : ctx(std::move(c)), next(NULL) {}
+	};
+	class DownloadInstance {
+	public:
+		DownloadContext ctx;
+		CURL* curl;
+		MultiDownload<LockType>* self;
+		EventLoop* loop;            // 所属的事件循环，句柄从它的池中取
+		curl_slist * headerList;
+		bool sinkFailed;
+		bool sinkComplete;          // sink 已收到所需数据，主动中止了传输
+		bool throttled;             // 限速暂停中，throttleTimer 到期后恢复
+		uint64_t throttleSeq;       // 每次限速暂停加一，过期的恢复请求据此忽略
+		std::pair<std::chrono::steady_clock::time_point, uint64_t> throttleTimer;
+		std::unique_ptr<Sha256> sha256;
+		std::unique_ptr<Crc32c> crc32c;
+		std::shared_ptr<TransferRing> ring;     // 背压模式下与消费线程共享的缓冲区
+		std::chrono::steady_clock::time_point startTime;
+		std::chrono::steady_clock::time_point nextProgress;
+		bool init() {
+			bool ret = false;
+			startTime = std::chrono::steady_clock::now();
+			curl = loop->acquireHandle();
+			if (!ctx.sha256.empty()) {
+				sha256.reset(new Sha256);
+			}
+			if (ctx.checkCrc32c) {
+				crc32c.reset(new Crc32c);
+			}
+			if (self->m_consumers && !ctx.direct) {
+				ring = std::make_shared<TransferRing>(this);
+			}
+			if (curl) {
+				// 明文 http 不会协商 HTTP/2，等待复用只会让同一主机的新请求排在进行中的请求之后
+				loop->applyConnectionOptions(curl, ctx.range.empty() && ctx.url.compare(0, 8, "https://") == 0);
+				curl_easy_setopt(curl, CURLOPT_URL, ctx.url.c_str());
+				curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, ctx.timeout_ms);
+				curl_easy_setopt(curl, CURLOPT_WRITEDATA, this);
+				curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1);
+				curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, DownloadInstance::writeFunction);
+				curl_easy_setopt(curl, CURLOPT_HEADERDATA, this);
+				curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, DownloadInstance::headerFunction);
+				if (ring) {
+					// 每次写回调的数据不超过一块，缓冲区满时整块暂停
+					ring->curl = curl;
+					curl_easy_setopt(curl, CURLOPT_BUFFERSIZE, (long)self->m_consumers->chunkSize());
+				} else if (ctx.sink) {
+					// 减少写回调次数，让 sink 收到更大的块
+					curl_easy_setopt(curl, CURLOPT_BUFFERSIZE, CURL_MAX_READ_SIZE);
+				}
+				if (!ctx.range.empty()) {
+					curl_easy_setopt(curl, CURLOPT_RANGE, ctx.range.c_str());
+				}
+				if (ctx.maxRecvSpeed) {
+					curl_easy_setopt(curl, CURLOPT_MAX_RECV_SPEED_LARGE, (curl_off_t)ctx.maxRecvSpeed);
+				}
+				// 分段下载的内部任务由 SegmentedJob 汇总进度
+				int interval = self->m_progressInterval;
+				if (interval > 0 && !ctx.direct) {
+					nextProgress = startTime + std::chrono::milliseconds(interval);
+					curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, DownloadInstance::progressFunction);
+					curl_easy_setopt(curl, CURLOPT_XFERINFODATA, this);
+					curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+				}
+				if (ctx.headOnly) {
+					curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+				}
+				if (!ctx.isPost && !ctx.headers.empty()) {
+					for (auto& h : ctx.headers) {
+						headerList = curl_slist_append(headerList, h.c_str());
+					}
+					curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headerList);
+				}
+				if (ctx.isPost) {
+					headerList = curl_slist_append(NULL, "Expect:");
+					for (auto& h : ctx.headers) {
+						headerList = curl_slist_append(headerList, h.c_str());
+					}
+					if (ctx.body && ctx.body->contentEncoding()) {
+						headerList = curl_slist_append(headerList, (std::string("Content-Encoding: ") + ctx.body->contentEncoding()).c_str());
+					}
+					if (ctx.hcb)
+					{
+						headerList = ctx.hcb(headerList);
+					}
+					curl_easy_setopt(curl, CURLOPT_POST, 1);
+					if (!ctx.body) {
+						curl_easy_setopt(curl, CURLOPT_POSTFIELDS, ctx.context.c_str());
+						curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, ctx.context.length());
+					} else if (ctx.body->data()) {
+						// 内存在请求结束前有效，curl 直接从中发送
+						curl_easy_setopt(curl, CURLOPT_POSTFIELDS, ctx.body->data());
+						curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)ctx.body->size());
+					} else {
+						curl_easy_setopt(curl, CURLOPT_READFUNCTION, DownloadInstance::readFunction);
+						curl_easy_setopt(curl, CURLOPT_READDATA, this);
+						curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, DownloadInstance::seekFunction);
+						curl_easy_setopt(curl, CURLOPT_SEEKDATA, this);
+						// 长度未知时不设置，curl 使用 chunked 编码
+						if (ctx.body->size() >= 0) {
+							curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)ctx.body->size());
+						}
+					}
+					curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headerList);
+					
+				}
+				ret = true;
+			}
+			if (!ret && curl) {
+				loop->releaseHandle(curl);
+				curl = NULL;
+			}
+			return ret;
+		}
+		void cleanup() {
+			if (curl) {
+				// 句柄放回池中，下一次请求复用其中的 DNS、TLS 会话等状态
+				loop->releaseHandle(curl);
+				curl = NULL;
+			}
+			if (headerList)
+			{
+				curl_slist_free_all(headerList);
+				headerList = 0;
+			}
+		}
+		DownloadInstance()
+		:curl(NULL), self(NULL), loop(NULL), headerList(NULL), sinkFailed(false), sinkComplete(false)
+		,throttled(false), throttleSeq(0) {}
+		DownloadInstance(DownloadInstance& rhs)
+		:curl(NULL), self(NULL), loop(NULL), headerList(NULL), sinkFailed(false), sinkComplete(false)
+		,throttled(false), throttleSeq(0) {
+			swap(rhs);
+		}
+		~DownloadInstance() {
+			cleanup();
+		}
+		void swap(DownloadInstance& rhs) noexcept {
+			ctx = std::move(rhs.ctx);
+			curl = rhs.curl;
+			self = rhs.self;
+			loop = rhs.loop;
+			sha256 = std::move(rhs.sha256);
+			crc32c = std::move(rhs.crc32c);
+			ring = std::move(rhs.ring);
+			startTime = rhs.startTime;
+			nextProgress = rhs.nextProgress;
+			rhs.curl = NULL;
+		}
+		// 没有要求校验或内容一致时返回 true
+		bool verify() {
+			if (crc32c && crc32c->value() != ctx.crc32c) {
+				return false;
+			}
+			if (sha256) {
+				std::string expect = ctx.sha256;
+				std::transform(expect.begin(), expect.end(), expect.begin(), ::tolower);
+				return sha256->hexdigest() == expect;
+			}
+			return true;
+		}
+	private:
+		const DownloadInstance& operator=(const DownloadInstance&);
+		static size_t writeFunction(char *ptr, size_t size, size_t nmemb, void *userdata) {
+			DownloadInstance*inst = static_cast<DownloadInstance*>(userdata);
+			BandwidthLimiter& limiter = inst->self->m_limiter;
+			bool limited = limiter.enabled();
+			if (limited) {
+				// 欠账时整块暂停，到期后由循环恢复，curl 重新交付这段数据
+				int wait = limiter.delay(inst->ctx.host, inst->ctx.priority);
+				if (wait > 0) {
+					inst->loop->throttle(inst, wait);
+					return CURL_WRITEFUNC_PAUSE;
+				}
+			}
+			if (inst->ring) {
+				// 暂停时 curl 会在恢复后重新交付同一段数据，放入缓冲区之后才计入摘要
+				size_t ret = inst->self->m_consumers->write(inst->ring, ptr, size*nmemb);
+				if (ret == 0) {
+					inst->sinkFailed = true;
+				}
+				if (ret != size*nmemb) {
+					return ret;
+				}
+			}
+			if (limited) {
+				limiter.consume(inst->ctx.host, inst->ctx.priority, size*nmemb);
+			}
+			if (inst->sha256) {
+				inst->sha256->update(ptr, size*nmemb);
+			}
+			if (inst->crc32c) {
+				inst->crc32c->update(ptr, size*nmemb);
+			}
+			if (inst->ring) {
+				return size*nmemb;
+			}
+			if (inst->ctx.sink) {
+				if (!inst->ctx.sink->write(ptr, size*nmemb)) {
+					if (inst->ctx.sink->complete()) {
+						inst->sinkComplete = true;
+					} else {
+						inst->sinkFailed = true;
+					}
+					return 0;
+				}
+				return size*nmemb;
+			}
+			CallbackData callbackData;
+			callbackData.type = CONTENT;
+			callbackData.data = ptr;
+			callbackData.size = size*nmemb;
+			inst->self->safeCallback(*inst, callbackData);
+			return size*nmemb;
+		}
+		static size_t readFunction(char *buffer, size_t size, size_t nitems, void *userdata) {
+			DownloadInstance*inst = static_cast<DownloadInstance*>(userdata);
+			int64_t n = inst->ctx.body->read(buffer, size*nitems);
+			return n < 0 ? CURL_READFUNC_ABORT : (size_t)n;
+		}
+		// curl 在每次收到数据和空闲时每秒调用，按间隔合并成一次 PROGRESS
+		static int progressFunction(void *clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t, curl_off_t) {
+			DownloadInstance*inst = static_cast<DownloadInstance*>(clientp);
+			auto now = std::chrono::steady_clock::now();
+			if (now < inst->nextProgress) {
+				return 0;
+			}
+			inst->nextProgress = now + std::chrono::milliseconds(inst->self->m_progressInterval);
+			if (inst->ring) {
+				inst->self->m_consumers->progress(inst->ring, dlnow, dltotal);
+				return 0;
+			}
+			CallbackData callbackData;
+			callbackData.type = PROGRESS;
+			callbackData.downloaded = dlnow;
+			callbackData.total = dltotal;
+			inst->self->safeCallback(*inst, callbackData);
+			return 0;
+		}
+		// 重定向或认证后重发请求体时 curl 要求回到开头
+		static int seekFunction(void *userdata, curl_off_t offset, int origin) {
+			DownloadInstance*inst = static_cast<DownloadInstance*>(userdata);
+			if (offset == 0 && origin == SEEK_SET && inst->ctx.body->rewind()) {
+				return CURL_SEEKFUNC_OK;
+			}
+			return CURL_SEEKFUNC_CANTSEEK;
+		}
+#ifdef _WIN32
+#define strncasecmp _strnicmp
+#endif
+
+		static size_t headerFunction(char *ptr, size_t size, size_t nmemb, void *userdata) {
+			DownloadInstance*inst = static_cast<DownloadInstance*>(userdata);
+			if (inst->ring) {
+				inst->self->m_consumers->header(inst->ring, ptr, size*nmemb);
+				return size*nmemb;
+			}
+			if (inst->ctx.sink) {
+				inst->ctx.sink->header(ptr, size*nmemb);
+			}
+			CallbackData callbackData;
+			callbackData.type = FILESIZE;
+			static size_t length = strlen("Content-Length");
+			if (strncasecmp(ptr, "Content-Length", length) == 0) {
+				size_t idx = length;
+				while (idx < size*nmemb && ptr[idx] != ':') {
+					idx++;
+				}
+				// 模型文件可能超过 2GB，不能用 atoi
+				callbackData.fileSize = strtoull(ptr + idx + 1, NULL, 10);
+				if (inst->ctx.sink) {
+					inst->ctx.sink->reserve(callbackData.fileSize);
+				}
+				inst->self->safeCallback(*inst, callbackData);
+			}
+			return size*nmemb;
+		}
+
+#undef strncasecmp
+	};
+
+	// 内部任务（分段、重试）在 join 之后仍需入队，不检查停止标志。
+	// loop 为空时按分配方式选择循环
+	void enqueue(DownloadContext&& ctx, EventLoop* loop = NULL) {
+		if (!loop) {
+			loop = pickLoop(ctx.url);
+		}
+		Submission* node = new Submission(std::move(ctx));
+		node->ctx.enqueueTime = std::chrono::steady_clock::now();
+		loop->push(node, node, 1);
+	}
+	EventLoop* pickLoop(const std::string& url) {
+		std::vector<size_t> loads = loadSnapshot();
+		return m_loops[pickLoop(url, loads)].get();
+	}
+	// loads 为各循环的负载，批量提交时由调用者累加已分配的任务
+	size_t pickLoop(const std::string& url, const std::vector<size_t>& loads) const {
+		if (m_loops.size() == 1) {
+			return 0;
+		}
+		if (m_assignment == HOST_AFFINITY) {
+			return std::hash<std::string>()(urlAuthority(url)) % m_loops.size();
+		}
+		return std::min_element(loads.begin(), loads.end()) - loads.begin();
+	}
+	std::vector<size_t> loadSnapshot() const {
+		std::vector<size_t> loads;
+		loads.reserve(m_loops.size());
+		for (auto& loop : m_loops) {
+			loads.push_back(loop->load());
+		}
+		return loads;
+	}
+
+#ifndef _WIN32
+	/// 一次分段下载的状态，除 start() 与析构外只在所属循环的线程上访问
+	class SegmentedJob : public std::enable_shared_from_this<SegmentedJob> {
+	public:
+		SegmentedJob(MultiDownload* self, DownloadContext&& ctx, std::shared_ptr<FileSink> file, size_t segments, bool resumable)
+		:m_self(self)
+		,m_loop(self->pickLoop(ctx.url))
+		,m_ctx(std::move(ctx))
+		,m_file(file)
+		,m_segmentCount(std::max<size_t>(segments, 1))
+		,m_resumable(resumable)
+		,m_journalPath(file->path() + ".journal")
+		,m_running(0)
+		,m_sinceCheckpoint(0)
+		,m_received(0)
+		,m_length(0)
+		,m_failed(false)
+		,m_result(E_OK)
+		,m_finished(false)
+		{}
+		~SegmentedJob() {
+			// 强制停止时任务没有走到 finalize，保存已完成的区间供下次续传
+			if (!m_finished && m_journaling) {
+				checkpoint();
+			}
+		}
+		void start() {
+			DownloadContext probe = internalContext();
+			probe.headOnly = true;
+			// 缓存中有记录时探测请求带上校验字段，304 时直接从缓存取出
+			if (m_self->m_cache && m_self->m_cache->lookup(m_ctx.url, m_cached)) {
+				probe.conditional = true;
+				probe.headers = DownloadCache::conditionalHeaders(m_cached);
+			}
+			probe.sink = std::make_shared<ProbeSink>(this->shared_from_this());
+			m_self->enqueue(std::move(probe), m_loop);
+		}
+	private:
+		static const uint64_t kMinSegment = 1 << 20;
+		static const uint64_t kCheckpointBytes = 16 << 20;
+		static const int kMaxRetries = 3;
+
+		struct Segment {
+			uint64_t begin;
+			uint64_t pos;
+			uint64_t end;
+			int retries;
+		};
+
+		class ProbeSink : public DownloadSink {
+		public:
+			ProbeSink(std::shared_ptr<SegmentedJob> job) : m_job(job), m_status(0), m_acceptRanges(false), m_length(0) {}
+			void header(const char* data, size_t size) override {
+				std::string value;
+				if (int status = parseStatusLine(data, size)) {
+					m_status = status;
+					m_acceptRanges = false;
+					m_length = 0;
+					m_etag.clear();
+					m_lastModified.clear();
+				} else if (matchHeader(data, size, "Accept-Ranges", value)) {
+					m_acceptRanges = (value == "bytes");
+				} else if (matchHeader(data, size, "Content-Length", value)) {
+					m_length = strtoull(value.c_str(), NULL, 10);
+				} else if (matchHeader(data, size, "ETag", value)) {
+					m_etag = value;
+				} else if (matchHeader(data, size, "Last-Modified", value)) {
+					m_lastModified = value;
+				}
+			}
+			bool write(const char*, size_t) override {
+				return true;
+			}
+			bool finish(DownloadResult result) override {
+				if (result == E_OK && m_status == 304) {
+					m_job->onNotModified();
+				} else {
+					m_job->onProbe(result, m_acceptRanges, m_length, m_etag, m_lastModified);
+				}
+				return true;
+			}
+		private:
+			std::shared_ptr<SegmentedJob> m_job;
+			int m_status;
+			bool m_acceptRanges;
+			uint64_t m_length;
+			std::string m_etag;
+			std::string m_lastModified;
+		};
+
+		/// 把一段数据写到文件对应偏移，写满 end 后中止该连接
+		class SegmentSink : public DownloadSink {
+		public:
+			SegmentSink(std::shared_ptr<SegmentedJob> job, size_t index)
+			:m_job(job), m_index(index), m_status(0), m_reachedEnd(false), m_failed(false) {}
+			void header(const char* data, size_t size) override {
+				int status = parseStatusLine(data, size);
+				if (status) {
+					m_status = status;
+				}
+			}
+			bool write(const char* data, size_t size) override {
+				// 服务器忽略 Range，或 If-Range 不匹配（文件已变化）时返回 200，不能按偏移写入
+				if (m_status != 206) {
+					m_failed = true;
+					return false;
+				}
+				Segment& seg = m_job->m_segments[m_index];
+				size_t n = (size_t)std::min<uint64_t>(size, seg.end > seg.pos ? seg.end - seg.pos : 0);
+				if (n && !m_job->m_file->writeAt(seg.pos, data, n)) {
+					m_failed = true;
+					return false;
+				}
+				seg.pos += n;
+				if (seg.pos >= seg.end) {
+					m_reachedEnd = true;
+				}
+				m_job->progress(n);
+				return n == size;
+			}
+			// 被窃取后范围缩短，写满时返回 false 结束连接，不是写入失败
+			bool complete() const override {
+				return m_reachedEnd && !m_failed;
+			}
+			bool finish(DownloadResult result) override {
+				if (m_reachedEnd) {
+					result = E_OK;
+				} else if (m_failed) {
+					result = E_WRITEFAIL;
+				}
+				m_job->onSegment(m_index, result);
+				return true;
+			}
+		private:
+			std::shared_ptr<SegmentedJob> m_job;
+			size_t m_index;
+			int m_status;
+			bool m_reachedEnd;
+			bool m_failed;
+		};
+
+		DownloadContext internalContext() const {
+			DownloadContext ctx;
+			ctx.fileId = m_ctx.fileId;
+			ctx.url = m_ctx.url;
+			ctx.timeout_ms = m_ctx.timeout_ms;
+			ctx.isPost = false;
+			ctx.priority = m_ctx.priority;
+			ctx.direct = true;
+			ctx.cancelToken = m_ctx.cancelToken;
+			return ctx;
+		}
+		// 缓存的内容没有变化，丢弃临时文件与断点记录
+		void onNotModified() {
+			m_finished = true;
+			unlink(m_journalPath.c_str());
+			m_file->setKeepPartial(false);
+			m_file->finish(E_DOWNLOADFAIL);
+			CallbackData callbackData;
+			callbackData.type = FILESIZE;
+			callbackData.fileSize = m_cached.size;
+			notify(callbackData);
+			callbackData.type = RESULT;
+			callbackData.result = m_self->m_cache->materialize(m_cached, m_file->path()) ? E_OK : E_WRITEFAIL;
+			notify(callbackData);
+		}
+		void onProbe(DownloadResult result, bool acceptRanges, uint64_t length,
+					 const std::string& etag, const std::string& lastModified) {
+			if (result != E_OK) {
+				finalize(result);
+				return;
+			}
+			if (!acceptRanges || length == 0) {
+				// 退化为普通下载，由用户回调直接收到结果；无法续传，丢弃旧的记录
+				m_finished = true;
+				unlink(m_journalPath.c_str());
+				m_file->setKeepPartial(false);
+				m_file->truncate();
+				if (m_self->m_cache) {
+					m_ctx.sink = std::make_shared<CachedFileSink>(m_file, m_self->m_cache, m_ctx.url);
+				}
+				m_self->enqueue(std::move(m_ctx), m_loop);
+				return;
+			}
+			m_etag = etag;
+			m_lastModified = lastModified;
+			CallbackData callbackData;
+			callbackData.type = FILESIZE;
+			callbackData.fileSize = length;
+			notify(callbackData);
+
+			std::vector<DownloadJournal::Range> missing(1, DownloadJournal::Range(0, length));
+			if (m_resumable) {
+				DownloadJournal old;
+				if (old.load(m_journalPath) && old.matches(m_ctx.url, length, etag, lastModified)) {
+					m_journal.done = old.done;
+					missing = old.missing();
+				} else {
+					m_file->truncate();
+				}
+				// 没有强校验字段时无法判断文件是否变化，不记录进度
+				m_journal.url = m_ctx.url;
+				m_journal.size = length;
+				m_journal.etag = etag;
+				m_journal.lastModified = lastModified;
+				m_journaling = m_journal.matches(m_ctx.url, length, etag, lastModified);
+				if (!m_journaling) {
+					unlink(m_journalPath.c_str());
+				}
+				// 各段请求带上 If-Range，文件在探测之后发生变化时服务器返回 200，该段失败
+				const std::string& validator = !etag.empty() ? etag : lastModified;
+				if (m_journaling) {
+					m_ifRange = "If-Range: " + validator;
+				}
+			}
+			m_file->setLength(length);
+			m_file->reserve(length);
+			m_length = length;
+			m_received = length;
+			for (auto& r : missing) {
+				m_received -= r.second - r.first;
+			}
+			m_nextProgress = std::chrono::steady_clock::now() + std::chrono::milliseconds(m_self->m_progressInterval);
+			split(missing);
+			if (m_segments.empty()) {
+				finalize(E_OK);
+				return;
+			}
+			for (size_t i = 0; i < m_segments.size(); ++i) {
+				launch(i);
+			}
+		}
+		// 按各缺失区间的长度比例分配连接数，每段不小于 kMinSegment
+		void split(const std::vector<DownloadJournal::Range>& missing) {
+			uint64_t total = 0;
+			for (auto& r : missing) {
+				total += r.second - r.first;
+			}
+			for (auto& r : missing) {
+				uint64_t len = r.second - r.first;
+				uint64_t count = std::max<uint64_t>(1, (m_segmentCount * len + total / 2) / total);
+				count = std::max<uint64_t>(1, std::min(count, len / kMinSegment));
+				uint64_t step = len / count;
+				for (uint64_t i = 0; i < count; ++i) {
+					Segment seg;
+					seg.begin = seg.pos = r.first + step * i;
+					seg.end = (i + 1 == count) ? r.second : r.first + step * (i + 1);
+					seg.retries = 0;
+					m_segments.push_back(seg);
+				}
+			}
+		}
+		void launch(size_t index) {
+			const Segment& seg = m_segments[index];
+			DownloadContext ctx = internalContext();
+			ctx.range = std::to_string(seg.pos) + "-" + std::to_string(seg.end - 1);
+			ctx.retries = seg.retries;
+			if (!m_ifRange.empty()) {
+				ctx.headers.push_back(m_ifRange);
+			}
+			ctx.sink = std::make_shared<SegmentSink>(this->shared_from_this(), index);
+			m_running++;
+			m_self->enqueue(std::move(ctx), m_loop);
+		}
+		void progress(uint64_t n) {
+			m_sinceCheckpoint += n;
+			m_received += n;
+			if (m_journaling && m_sinceCheckpoint >= kCheckpointBytes) {
+				checkpoint();
+			}
+			int interval = m_self->m_progressInterval;
+			if (interval > 0) {
+				auto now = std::chrono::steady_clock::now();
+				if (now >= m_nextProgress) {
+					m_nextProgress = now + std::chrono::milliseconds(interval);
+					CallbackData callbackData;
+					callbackData.type = PROGRESS;
+					callbackData.downloaded = m_received;
+					callbackData.total = m_length;
+					notify(callbackData);
+				}
+			}
+		}
+		void onSegment(size_t index, DownloadResult result) {
+			m_running--;
+			Segment& seg = m_segments[index];
+			if (m_self->m_stop && !m_self->m_joinStop) {
+				// 强制停止，不再重试，由析构保存进度
+				return;
+			}
+			if (!m_failed && result == E_CANCELLED) {
+				fail(E_CANCELLED);
+			}
+			if (!m_failed && seg.pos < seg.end) {
+				// 连接中断时从已写到的位置续传
+				if (++seg.retries <= kMaxRetries) {
+					launch(index);
+					return;
+				}
+				fail(result == E_OK ? E_DOWNLOADFAIL : result);
+			}
+			if (!m_failed) {
+				steal();
+			}
+			if (m_running == 0) {
+				finalize(m_failed ? m_result : E_OK);
+			}
+		}
+		// 空出的连接接手剩余最多的段的后一半
+		void steal() {
+			size_t victim = m_segments.size();
+			uint64_t most = 0;
+			for (size_t i = 0; i < m_segments.size(); ++i) {
+				uint64_t left = m_segments[i].end - std::min(m_segments[i].pos, m_segments[i].end);
+				if (left > most) {
+					most = left;
+					victim = i;
+				}
+			}
+			if (victim == m_segments.size() || most < 2 * kMinSegment) {
+				return;
+			}
+			Segment seg;
+			seg.begin = seg.pos = m_segments[victim].pos + most / 2;
+			seg.end = m_segments[victim].end;
+			seg.retries = 0;
+			m_segments[victim].end = seg.pos;
+			m_segments.push_back(seg);
+			launch(m_segments.size() - 1);
+		}
+		// 让仍在传输的段在下一次写入时中止
+		void fail(DownloadResult result) {
+			m_failed = true;
+			m_result = result;
+			for (auto& seg : m_segments) {
+				seg.end = std::min(seg.pos, seg.end);
+			}
+		}
+		// 数据先落盘再写记录，记录中的区间总是已经写入 path.part
+		void checkpoint() {
+			m_sinceCheckpoint = 0;
+			if (!m_file->sync()) {
+				return;
+			}
+			DownloadJournal journal = m_journal;
+			for (auto& seg : m_segments) {
+				journal.done.push_back(DownloadJournal::Range(seg.begin, seg.pos));
+			}
+			journal.save(m_journalPath);
+		}
+		void finalize(DownloadResult result) {
+			if (m_finished) {
+				return;
+			}
+			m_finished = true;
+			if (result == E_OK) {
+				if (!m_file->finish(result)) {
+					result = E_WRITEFAIL;
+				} else if (m_self->m_cache) {
+					m_self->m_cache->store(m_ctx.url, m_file->path(), m_etag, m_lastModified);
+				}
+				unlink(m_journalPath.c_str());
+			} else {
+				if (m_journaling) {
+					checkpoint();
+				}
+				// 没有可续传的进度时不保留临时文件
+				bool progressed = false;
+				for (auto& seg : m_segments) {
+					progressed = progressed || seg.pos > seg.begin;
+				}
+				m_file->setKeepPartial(m_journaling && (progressed || !m_journal.done.empty()));
+				m_file->finish(result);
+			}
+			CallbackData callbackData;
+			callbackData.type = RESULT;
+			callbackData.result = result;
+			notify(callbackData);
+		}
+		void notify(const CallbackData& callbackData) {
+			if (m_ctx.cb) {
+				m_ctx.cb(m_ctx.fileId.c_str(), m_ctx.url.c_str(), callbackData);
+			}
+		}
+
+		MultiDownload* m_self;
+		EventLoop* m_loop;              // 各段都在同一循环上执行，状态不需要加锁
+		DownloadContext m_ctx;
+		std::shared_ptr<FileSink> m_file;
+		size_t m_segmentCount;
+		bool m_resumable;
+		bool m_journaling = false;
+		std::string m_journalPath;
+		DownloadCache::Entry m_cached;
+		std::string m_etag;
+		std::string m_lastModified;
+		DownloadJournal m_journal;      // 本次开始前已完成的区间与校验字段
+		std::string m_ifRange;
+		std::vector<Segment> m_segments;
+		size_t m_running;
+		uint64_t m_sinceCheckpoint;
+		uint64_t m_received;            // 包括续传前已完成的部分
+		uint64_t m_length;
+		std::chrono::steady_clock::time_point m_nextProgress;
+		bool m_failed;
+		DownloadResult m_result;
+		bool m_finished;
+	};
+#endif
+
+	/// 合并的一组相同请求，作为共用传输的 sink。订阅者的回调只在传输的回调线程上执行：
+	/// 其他线程加入时只放入 m_pending，下一次收到响应头、数据或结果时补发之前的内容后转为 m_active
+	class Flight : public DownloadSink {
+	public:
+		struct Subscriber {
+			std::string fileId;
+			std::string url;
+			DownloadCallback cb;
+			std::shared_ptr<DownloadSink> sink;
+			bool failed = false;
+		};
+
+		Flight(MultiDownload* self, const std::string& key, Subscriber&& first)
+		:m_self(self)
+		,m_key(key)
+		,m_closed(false)
+		,m_overflow(false)
+		,m_hasSize(false)
+		,m_size(0)
+		,m_received(0)
+		{
+			m_file = std::dynamic_pointer_cast<FileSink>(first.sink);
+			m_active.push_back(std::move(first));
+		}
+		~Flight() {
+			// 强制停止时传输没有结束
+			if (!m_closed) {
+				for (auto& sub : m_active) {
+					if (sub.sink) {
+						sub.sink->finish(E_DOWNLOADFAIL);
+					}
+				}
+			}
+		}
+		// 在提交线程上调用。已收到的数据都还能补发时加入，否则由调用者另起传输
+		bool join(Subscriber& sub) {
+			std::lock_guard<std::mutex> _(m_lock);
+			if (m_closed || (m_overflow && !m_file)) {
+				return false;
+			}
+			m_pending.push_back(std::move(sub));
+			return true;
+		}
+		void progress(const CallbackData& callbackData) {
+			for (auto& sub : m_active) {
+				notify(sub, callbackData);
+			}
+		}
+		void header(const char* data, size_t size) override {
+			adopt();
+			// 重定向后只保留最后一个响应的头
+			if (parseStatusLine(data, size)) {
+				m_headers.clear();
+			}
+			m_headers.emplace_back(data, size);
+			for (auto& sub : m_active) {
+				if (sub.sink) {
+					sub.sink->header(data, size);
+				}
+			}
+		}
+		void reserve(size_t size) override {
+			adopt();
+			m_hasSize = true;
+			m_size = size;
+			for (auto& sub : m_active) {
+				announceSize(sub);
+			}
+		}
+		bool write(const char* data, size_t size) override {
+			adopt();
+			m_received += size;
+			if (!m_overflow) {
+				if (m_replay.size() + size <= m_self->m_replayBytes) {
+					m_replay.append(data, size);
+				} else {
+					std::lock_guard<std::mutex> _(m_lock);
+					m_overflow = true;
+					std::string().swap(m_replay);
+				}
+			}
+			bool alive = false;
+			for (auto& sub : m_active) {
+				deliver(sub, data, size);
+				alive = alive || !sub.failed;
+			}
+			// 所有订阅者都失败时中止传输
+			return alive;
+		}
+		bool finish(DownloadResult result) override {
+			{
+				std::lock_guard<std::mutex> _(m_lock);
+				m_closed = true;
+			}
+			m_self->endFlight(m_key, this);
+			// 强制停止时只让 sink 收尾，不再回调
+			bool aborted = m_self->m_stop && !m_self->m_joinStop;
+			if (!aborted) {
+				adopt();
+			}
+			for (auto& sub : m_active) {
+				DownloadResult r = sub.failed ? E_WRITEFAIL : result;
+				if (sub.sink && !sub.sink->finish(aborted ? E_DOWNLOADFAIL : r) && r == E_OK) {
+					r = E_WRITEFAIL;
+				}
+				if (aborted) {
+					continue;
+				}
+				CallbackData callbackData;
+				callbackData.type = RESULT;
+				callbackData.result = r;
+				notify(sub, callbackData);
+			}
+			return true;
+		}
+	private:
+		// 新加入的订阅者补发响应头、大小与已收到的数据
+		void adopt() {
+			std::vector<Subscriber> joined;
+			{
+				std::lock_guard<std::mutex> _(m_lock);
+				if (m_pending.empty()) {
+					return;
+				}
+				joined.swap(m_pending);
+			}
+			for (auto& sub : joined) {
+				for (auto& h : m_headers) {
+					if (sub.sink) {
+						sub.sink->header(h.data(), h.size());
+					}
+				}
+				if (m_hasSize) {
+					announceSize(sub);
+				}
+				if (!m_overflow) {
+					deliver(sub, m_replay.data(), m_replay.size());
+				} else {
+					replayFile(sub);
+				}
+				m_active.push_back(std::move(sub));
+			}
+		}
+		void replayFile(Subscriber& sub) {
+			const size_t chunk = 1 << 20;
+			std::unique_ptr<char[]> buffer(new char[chunk]);
+			for (uint64_t pos = 0; pos < m_received && !sub.failed; pos += chunk) {
+				size_t n = (size_t)std::min<uint64_t>(chunk, m_received - pos);
+				if (!m_file || !m_file->readAt(pos, buffer.get(), n)) {
+					sub.failed = true;
+					break;
+				}
+				deliver(sub, buffer.get(), n);
+			}
+		}
+		void announceSize(Subscriber& sub) {
+			if (sub.sink) {
+				sub.sink->reserve(m_size);
+			}
+			CallbackData callbackData;
+			callbackData.type = FILESIZE;
+			callbackData.fileSize = m_size;
+			notify(sub, callbackData);
+		}
+		void deliver(Subscriber& sub, const char* data, size_t size) {
+			if (sub.failed || size == 0) {
+				return;
+			}
+			if (sub.sink) {
+				if (!sub.sink->write(data, size)) {
+					sub.failed = true;
+					// 文件不完整，之后加入的请求不能再从中补发
+					if (sub.sink == m_file) {
+						std::lock_guard<std::mutex> _(m_lock);
+						m_file.reset();
+					}
+				}
+				return;
+			}
+			CallbackData callbackData;
+			callbackData.type = CONTENT;
+			callbackData.data = const_cast<char*>(data);
+			callbackData.size = size;
+			notify(sub, callbackData);
+		}
+		static void notify(const Subscriber& sub, const CallbackData& callbackData) {
+			if (sub.cb) {
+				sub.cb(sub.fileId.c_str(), sub.url.c_str(), callbackData);
+			}
+		}
+
+		MultiDownload* m_self;
+		const std::string m_key;
+		std::mutex m_lock;              // 保护 m_pending、m_closed、m_overflow 与 m_file
+		std::vector<Subscriber> m_pending;
+		bool m_closed;
+		bool m_overflow;                // 补发缓冲区超过上限后已释放
+		std::shared_ptr<FileSink> m_file;
+		// 以下只在回调线程上访问
+		std::vector<Subscriber> m_active;
+		std::vector<std::string> m_headers;
+		bool m_hasSize;
+		uint64_t m_size;
+		uint64_t m_received;
+		std::string m_replay;
+	};
+
+	static bool coalescable(const Request& request) {
+		return !request.isPost && !request.body && !request.hcb && !request.cancelToken && request.sha256.empty() &&
+			   !request.checkCrc32c && request.maxRecvSpeed == 0;
+	}
+	void coalesce(Request&& request) {
+		// 优先级与超时不同的请求不合并，加入者不会排在低优先级请求之后或换成别人的超时
+		std::string key = "GET " + request.url + "\n" + std::to_string(request.priority) + " " + std::to_string(request.timeout_ms);
+		for (auto& h : request.headers) {
+			key += "\n" + h;
+		}
+		typename Flight::Subscriber sub;
+		sub.fileId = request.fileId;
+		sub.url = request.url;
+		sub.cb = std::move(request.cb);
+		sub.sink = std::move(request.sink);
+		std::shared_ptr<Flight> flight;
+		{
+			std::lock_guard<std::mutex> _(m_flightLock);
+			auto it = m_flights.find(key);
+			if (it != m_flights.end() && it->second->join(sub)) {
+				return;
+			}
+			// 没有进行中的传输，或已无法补发，替换旧的记录
+			flight = std::make_shared<Flight>(this, key, std::move(sub));
+			m_flights[key] = flight;
+		}
+		DownloadContext ctx(std::move(request));
+		ctx.sink = flight;
+		// 数据与结果经由 sink，回调只转发进度
+		ctx.cb = [flight](const char*, const char*, const CallbackData& callbackData) {
+			if (callbackData.type == PROGRESS) {
+				flight->progress(callbackData);
+			}
+		};
+		enqueue(std::move(ctx));
+	}
+	void endFlight(const std::string& key, const Flight* flight) {
+		std::lock_guard<std::mutex> _(m_flightLock);
+		auto it = m_flights.find(key);
+		if (it != m_flights.end() && it->second.get() == flight) {
+			m_flights.erase(it);
+		}
+	}
+
+	/// 一次对冲请求：按 MirrorStats 排列 URL 后发出第一个尝试，超过按最近首字节耗时得出的等待时间
+	/// 仍没有数据时向下一个镜像发出备用请求。第一个收到 2xx 数据（或成功结束）的尝试胜出，
+	/// 其响应头与数据交给用户，其余尝试被取消。胜出之前全部失败时先换到未尝试过的镜像，
+	/// 都尝试过后按指数退避加抖动重试；胜出之后的失败不再重试，数据已经交给了用户。
+	/// 除构造、start() 与析构外只在所属循环的线程上访问
+	class HedgedJob : public std::enable_shared_from_this<HedgedJob> {
+	public:
+		HedgedJob(MultiDownload* self, DownloadContext&& ctx)
+		:m_self(self)
+		,m_loop(self->pickLoop(ctx.url))
+		,m_ctx(std::move(ctx))
+		,m_policy(self->m_hedgePolicy)
+		,m_next(0)
+		,m_running(0)
+		,m_failures(0)
+		,m_winner(kNone)
+		,m_result(E_DOWNLOADFAIL)
+		,m_hedgeArmed(false)
+		,m_done(false)
+		{
+			std::vector<std::string> urls(1, m_ctx.url);
+			urls.insert(urls.end(), m_ctx.mirrors.begin(), m_ctx.mirrors.end());
+			m_urls = self->m_mirrors.rank(urls, m_policy.sizeHint);
+			m_excluded.assign(m_urls.size(), false);
+			// 流式请求体不能同时被两个尝试读取
+			if (m_ctx.body && !m_ctx.body->data()) {
+				m_policy.maxParallel = 1;
+			}
+			m_policy.maxParallel = std::max<size_t>(m_policy.maxParallel, 1);
+			m_policy.maxAttempts = std::max(m_policy.maxAttempts, 1);
+		}
+		~HedgedJob() {
+			// 强制停止时没有走到 finalize
+			if (!m_done && m_ctx.sink) {
+				m_ctx.sink->finish(E_DOWNLOADFAIL);
+			}
+		}
+		void start() {
+			std::shared_ptr<HedgedJob> job = this->shared_from_this();
+			m_loop->schedule(0, [job] { job->launch(); });
+		}
+	private:
+		static const size_t kNone = (size_t)-1;
+
+		struct Attempt {
+			size_t url;                 // m_urls 中的序号
+			std::shared_ptr<CancelToken> token;
+			std::chrono::steady_clock::time_point start;
+		};
+
+		/// 一个尝试的响应先经过这里，只有胜出的尝试的响应头与数据交给用户
+		class AttemptSink : public DownloadSink {
+		public:
+			AttemptSink(std::shared_ptr<HedgedJob> job, size_t index) : status(0), bytes(0), m_job(job), m_index(index) {}
+			void header(const char* data, size_t size) override {
+				int code = parseStatusLine(data, size);
+				if (code) {
+					// 重定向后只保留最后一个响应的头
+					status = code;
+					headers.clear();
+				}
+				headers.emplace_back(data, size);
+			}
+			bool write(const char* data, size_t size) override {
+				return m_job->onData(m_index, *this, data, size);
+			}
+			bool finish(DownloadResult result) override {
+				m_job->onFinish(m_index, *this, result);
+				return true;
+			}
+
+			int status;
+			std::vector<std::string> headers;
+			uint64_t bytes;
+			std::chrono::steady_clock::time_point firstByte;
+		private:
+			std::shared_ptr<HedgedJob> m_job;
+			size_t m_index;
+		};
+
+		void launch() {
+			if (m_done) {
+				return;
+			}
+			if (m_ctx.cancelled()) {
+				if (m_running == 0) {
+					finalize(E_CANCELLED);
+				}
+				return;
+			}
+			if ((int)m_tries.size() >= m_policy.maxAttempts || m_running >= m_policy.maxParallel) {
+				return;
+			}
+			size_t url = pickUrl();
+			if (url == kNone || (!m_tries.empty() && m_ctx.body && !m_ctx.body->data() && !m_ctx.body->rewind())) {
+				if (m_running == 0) {
+					finalize(m_result);
+				}
+				return;
+			}
+			Attempt attempt;
+			attempt.url = url;
+			attempt.token = std::make_shared<CancelToken>();
+			attempt.start = std::chrono::steady_clock::now();
+
+			DownloadContext ctx;
+			ctx.fileId = m_ctx.fileId;
+			ctx.url = m_urls[url];
+			ctx.hcb = m_ctx.hcb;
+			ctx.timeout_ms = m_ctx.timeout_ms;
+			ctx.isPost = m_ctx.isPost;
+			ctx.context = m_ctx.context;
+			ctx.body = m_ctx.body;
+			ctx.headers = m_ctx.headers;
+			ctx.priority = m_ctx.priority;
+			ctx.sha256 = m_ctx.sha256;
+			ctx.checkCrc32c = m_ctx.checkCrc32c;
+			ctx.crc32c = m_ctx.crc32c;
+			ctx.cancelToken = m_ctx.cancelToken;
+			ctx.attemptToken = attempt.token;
+			ctx.direct = true;
+			ctx.retries = (int)m_tries.size();
+			ctx.sink = std::make_shared<AttemptSink>(this->shared_from_this(), m_tries.size());
+			m_tries.push_back(attempt);
+			m_running++;
+			m_self->enqueue(std::move(ctx), m_loop);
+			armHedge();
+		}
+		// 轮流选择没有被排除的镜像
+		size_t pickUrl() {
+			for (size_t n = 0; n < m_urls.size(); ++n) {
+				size_t i = m_next++ % m_urls.size();
+				if (!m_excluded[i]) {
+					return i;
+				}
+			}
+			return kNone;
+		}
+		void armHedge() {
+			if (m_hedgeArmed || (int)m_tries.size() >= m_policy.maxAttempts || m_running >= m_policy.maxParallel) {
+				return;
+			}
+			std::shared_ptr<HedgedJob> job = this->shared_from_this();
+			m_hedgeArmed = true;
+			m_hedgeTimer = m_loop->schedule(hedgeDelay(), [job] {
+				job->m_hedgeArmed = false;
+				if (job->m_winner == kNone) {
+					job->launch();
+				}
+			});
+		}
+		void disarmHedge() {
+			if (m_hedgeArmed) {
+				m_loop->cancelTimer(m_hedgeTimer);
+				m_hedgeArmed = false;
+			}
+		}
+		int hedgeDelay() const {
+			const LatencyWindow& window = m_self->m_firstByte;
+			double ms = window.size() < 20 ? m_policy.initialDelay_ms : window.percentile(m_policy.percentile);
+			return std::min(std::max((int)ms, m_policy.minDelay_ms), m_policy.maxDelay_ms);
+		}
+		int backoff() const {
+			static thread_local std::mt19937 rng(std::random_device{}());
+			std::uniform_real_distribution<double> jitter(0.5, 1.5);
+			double ms = m_policy.backoff_ms * double(1 << std::min(m_failures - 1, 16)) * jitter(rng);
+			return (int)std::min(ms, 30000.0);
+		}
+
+		bool onData(size_t index, AttemptSink& sink, const char* data, size_t size) {
+			if (m_done) {
+				return false;
+			}
+			// 错误响应的内容丢弃，该尝试以响应码结束
+			if (sink.status >= 300) {
+				return true;
+			}
+			if (sink.bytes == 0) {
+				sink.firstByte = std::chrono::steady_clock::now();
+				m_self->m_firstByte.add(std::chrono::duration<double, std::milli>(sink.firstByte - m_tries[index].start).count());
+			}
+			sink.bytes += size;
+			if (m_winner == kNone) {
+				win(index, sink);
+			}
+			if (m_winner != index) {
+				return false;
+			}
+			if (m_ctx.sink) {
+				return m_ctx.sink->write(data, size);
+			}
+			CallbackData callbackData;
+			callbackData.type = CONTENT;
+			callbackData.data = const_cast<char*>(data);
+			callbackData.size = size;
+			notify(callbackData);
+			return true;
+		}
+		void onFinish(size_t index, AttemptSink& sink, DownloadResult result) {
+			m_running--;
+			const Attempt& attempt = m_tries[index];
+			const std::string host = urlAuthority(m_urls[attempt.url]);
+			auto now = std::chrono::steady_clock::now();
+			if (result == E_OK) {
+				auto first = sink.bytes ? sink.firstByte : now;
+				m_self->m_mirrors.success(host, std::chrono::duration<double, std::milli>(first - attempt.start).count(),
+										  sink.bytes, std::chrono::duration<double>(now - first).count());
+			} else if (result != E_CANCELLED && !attempt.token->cancelled) {
+				// 落败的尝试写入被拒绝时不算镜像失败
+				m_self->m_mirrors.failure(host);
+			}
+			if (m_done || (m_self->m_stop && !m_self->m_joinStop)) {
+				return;
+			}
+			if (index == m_winner) {
+				finalize(result);
+				return;
+			}
+			if (m_winner != kNone) {
+				return;
+			}
+			if (result == E_OK) {
+				// 没有响应体的成功响应
+				win(index, sink);
+				finalize(E_OK);
+				return;
+			}
+			if (m_ctx.cancelled()) {
+				if (m_running == 0) {
+					finalize(E_CANCELLED);
+				}
+				return;
+			}
+			m_result = result;
+			// 4xx 不会因为重试而改变，不再请求这个 URL
+			if (sink.status >= 400 && sink.status < 500 && sink.status != 429) {
+				m_excluded[attempt.url] = true;
+			}
+			if (m_running > 0) {
+				return;
+			}
+			disarmHedge();
+			if (m_next < m_urls.size()) {
+				// 还有没尝试过的镜像，立即换过去
+				launch();
+				return;
+			}
+			if ((int)m_tries.size() >= m_policy.maxAttempts) {
+				finalize(m_result);
+				return;
+			}
+			m_failures++;
+			std::shared_ptr<HedgedJob> job = this->shared_from_this();
+			m_loop->schedule(backoff(), [job] { job->launch(); });
+		}
+		void win(size_t index, AttemptSink& sink) {
+			m_winner = index;
+			disarmHedge();
+			cancelOthers();
+			// 补发胜出尝试的响应头
+			for (auto& h : sink.headers) {
+				if (m_ctx.sink) {
+					m_ctx.sink->header(h.data(), h.size());
+				}
+				std::string value;
+				if (matchHeader(h.data(), h.size(), "Content-Length", value)) {
+					CallbackData callbackData;
+					callbackData.type = FILESIZE;
+					callbackData.fileSize = strtoull(value.c_str(), NULL, 10);
+					if (m_ctx.sink) {
+						m_ctx.sink->reserve(callbackData.fileSize);
+					}
+					notify(callbackData);
+				}
+			}
+		}
+		void cancelOthers() {
+			bool any = false;
+			for (size_t i = 0; i < m_tries.size(); ++i) {
+				if (i != m_winner && !m_tries[i].token->cancelled) {
+					m_tries[i].token->cancelled = true;
+					any = true;
+				}
+			}
+			if (any) {
+				m_loop->requestCancel();
+			}
+		}
+		void finalize(DownloadResult result) {
+			if (m_done) {
+				return;
+			}
+			m_done = true;
+			disarmHedge();
+			cancelOthers();
+			if (m_ctx.sink && !m_ctx.sink->finish(result) && result == E_OK) {
+				result = E_WRITEFAIL;
+			}
+			CallbackData callbackData;
+			callbackData.type = RESULT;
+			callbackData.result = result;
+			notify(callbackData);
+		}
+		void notify(const CallbackData& callbackData) {
+			if (m_ctx.cb) {
+				m_ctx.cb(m_ctx.fileId.c_str(), m_ctx.url.c_str(), callbackData);
+			}
+		}
+
+		MultiDownload* m_self;
+		EventLoop* m_loop;              // 各尝试与定时器都在同一循环上，状态不需要加锁
+		DownloadContext m_ctx;
+		HedgePolicy m_policy;
+		std::vector<std::string> m_urls;
+		std::vector<bool> m_excluded;
+		size_t m_next;
+		std::vector<Attempt> m_tries;
+		size_t m_running;
+		int m_failures;                 // 退避重试的次数
+		size_t m_winner;
+		DownloadResult m_result;        // 最近一次失败的结果
+		bool m_hedgeArmed;
+		typename EventLoop::TimerKey m_hedgeTimer;
+		bool m_done;
+	};
+
+	/// 背压模式下一个任务的缓冲区。entries 按到达顺序保存响应头、数据块与结果，
+	/// 同一时刻最多由一个消费线程处理（scheduled），回调因此保持顺序
+	class TransferRing {
+	public:
+		enum Kind {
+			HEADER,
+			CONTENT,
+			PROGRESS,
+			RESULT
+		};
+		struct Entry {
+			Kind kind;
+			std::unique_ptr<char[]> data;
+			size_t size = 0;
+			DownloadResult result = E_OK;
+			uint64_t downloaded = 0;
+			uint64_t total = 0;
+		};
+		explicit TransferRing(DownloadInstance* inst_)
+		:inst(inst_)
+		,curl(NULL)
+		,chunks(0)
+		,scheduled(false)
+		,paused(false)
+		,resumePosted(false)
+		,failed(false)
+		{}
+
+		DownloadInstance* inst;     // RESULT 处理完后由消费线程释放
+		CURL* curl;                 // 只在下载线程上访问，任务结束后为 NULL
+		std::mutex lock;
+		std::deque<Entry> entries;
+		size_t chunks;              // entries 中的数据块数
+		bool scheduled;             // 已在消费队列中或正被处理
+		bool paused;                // 写回调返回了 CURL_WRITEFUNC_PAUSE
+		bool resumePosted;          // 已请求下载线程恢复
+		std::atomic<bool> failed;   // sink 写失败，之后的写回调返回 0 中止下载
+	};
+
+	/// 消费线程与数据块池。下载线程调用 header/write/finish 放入数据，
+	/// 消费线程取出后执行 sink 或回调，取走数据块后请求所属循环恢复暂停的任务
+	class ConsumerPool {
+	public:
+		ConsumerPool(size_t threads, size_t ringChunks, size_t chunkSize)
+		:m_ringChunks(ringChunks)
+		,m_chunkSize(chunkSize)
+		,m_buffered(0)
+		,m_stopping(false)
+		{
+			for (size_t i = 0; i < threads; ++i) {
+				m_threads.emplace_back(&ConsumerPool::consumerRoutine, this);
+			}
+		}
+		~ConsumerPool() {
+			stop();
+		}
+		// 处理完已放入的所有数据后退出
+		void stop() {
+			{
+				std::lock_guard<std::mutex> _(m_lock);
+				m_stopping = true;
+			}
+			m_cv.notify_all();
+			for (auto& t : m_threads) {
+				if (t.joinable()) {
+					t.join();
+				}
+			}
+		}
+		size_t chunkSize() const {
+			return m_chunkSize;
+		}
+		size_t bufferedBytes() const {
+			return m_buffered;
+		}
+
+		// 以下在下载线程上调用
+		void header(const std::shared_ptr<TransferRing>& ring, const char* data, size_t size) {
+			typename TransferRing::Entry entry;
+			entry.kind = TransferRing::HEADER;
+			entry.data.reset(new char[size]);
+			memcpy(entry.data.get(), data, size);
+			entry.size = size;
+			post(ring, std::move(entry));
+		}
+		// 返回 size 表示已放入；缓冲区满时返回 CURL_WRITEFUNC_PAUSE；sink 已失败时返回 0
+		size_t write(const std::shared_ptr<TransferRing>& ring, const char* data, size_t size) {
+			if (ring->failed) {
+				return 0;
+			}
+			const size_t total = size;
+			bool schedule = false;
+			{
+				std::lock_guard<std::mutex> _(ring->lock);
+				// 先填满最后一块，再按需取新块；缓冲区为空时总是放入，不会因单次数据过大而一直暂停
+				size_t room = 0;
+				if (!ring->entries.empty() && ring->entries.back().kind == TransferRing::CONTENT) {
+					room = m_chunkSize - ring->entries.back().size;
+				}
+				size_t need = size <= room ? 0 : (size - room + m_chunkSize - 1) / m_chunkSize;
+				if (ring->chunks > 0 && ring->chunks + need > m_ringChunks) {
+					ring->paused = true;
+					return CURL_WRITEFUNC_PAUSE;
+				}
+				while (size) {
+					if (room == 0) {
+						typename TransferRing::Entry entry;
+						entry.kind = TransferRing::CONTENT;
+						entry.data = allocChunk();
+						entry.size = 0;
+						ring->entries.push_back(std::move(entry));
+						ring->chunks++;
+						room = m_chunkSize;
+					}
+					typename TransferRing::Entry& tail = ring->entries.back();
+					size_t n = std::min(size, room);
+					memcpy(tail.data.get() + tail.size, data, n);
+					tail.size += n;
+					data += n;
+					size -= n;
+					room -= n;
+				}
+				if (!ring->scheduled) {
+					ring->scheduled = true;
+					schedule = true;
+				}
+			}
+			if (schedule) {
+				enqueue(ring);
+			}
+			return total;
+		}
+		// 进度排在已收到的数据之后，不占用数据块
+		void progress(const std::shared_ptr<TransferRing>& ring, uint64_t downloaded, uint64_t total) {
+			typename TransferRing::Entry entry;
+			entry.kind = TransferRing::PROGRESS;
+			entry.size = 0;
+			entry.downloaded = downloaded;
+			entry.total = total;
+			post(ring, std::move(entry));
+		}
+		// 任务已从 CURLM 移除、句柄已归还，结果排在所有数据之后
+		void finish(const std::shared_ptr<TransferRing>& ring, DownloadResult result) {
+			typename TransferRing::Entry entry;
+			entry.kind = TransferRing::RESULT;
+			entry.size = 0;
+			entry.result = result;
+			post(ring, std::move(entry));
+		}
+	private:
+		void post(const std::shared_ptr<TransferRing>& ring, typename TransferRing::Entry&& entry) {
+			bool schedule = false;
+			{
+				std::lock_guard<std::mutex> _(ring->lock);
+				ring->entries.push_back(std::move(entry));
+				if (!ring->scheduled) {
+					ring->scheduled = true;
+					schedule = true;
+				}
+			}
+			if (schedule) {
+				enqueue(ring);
+			}
+		}
+		void enqueue(const std::shared_ptr<TransferRing>& ring) {
+			{
+				std::lock_guard<std::mutex> _(m_lock);
+				m_ready.push_back(ring);
+			}
+			m_cv.notify_one();
+		}
+		std::unique_ptr<char[]> allocChunk() {
+			m_buffered += m_chunkSize;
+			std::lock_guard<std::mutex> _(m_poolLock);
+			if (m_free.empty()) {
+				return std::unique_ptr<char[]>(new char[m_chunkSize]);
+			}
+			std::unique_ptr<char[]> chunk = std::move(m_free.back());
+			m_free.pop_back();
+			return chunk;
+		}
+		void freeChunk(std::unique_ptr<char[]>&& chunk) {
+			{
+				std::lock_guard<std::mutex> _(m_poolLock);
+				m_free.push_back(std::move(chunk));
+			}
+			m_buffered -= m_chunkSize;
+		}
+
+		void consumerRoutine() {
+			while (true) {
+				std::shared_ptr<TransferRing> ring;
+				{
+					std::unique_lock<std::mutex> lk(m_lock);
+					m_cv.wait(lk, [this] { return m_stopping || !m_ready.empty(); });
+					if (m_ready.empty()) {
+						return;
+					}
+					ring = std::move(m_ready.front());
+					m_ready.pop_front();
+				}
+				drain(ring);
+			}
+		}
+		// 一次最多处理 ringChunks 个条目，还有剩余时排到队尾，一个快速的任务不会占住消费线程
+		void drain(const std::shared_ptr<TransferRing>& ring) {
+			for (size_t i = 0; i < m_ringChunks; ++i) {
+				typename TransferRing::Entry entry;
+				{
+					std::lock_guard<std::mutex> _(ring->lock);
+					if (ring->entries.empty()) {
+						ring->scheduled = false;
+						return;
+					}
+					entry = std::move(ring->entries.front());
+					ring->entries.pop_front();
+				}
+				if (entry.kind == TransferRing::RESULT) {
+					complete(ring, entry.result);
+					return;
+				}
+				if (entry.kind == TransferRing::HEADER) {
+					deliverHeader(*ring->inst, entry.data.get(), entry.size);
+					continue;
+				}
+				if (entry.kind == TransferRing::PROGRESS) {
+					CallbackData callbackData;
+					callbackData.type = PROGRESS;
+					callbackData.downloaded = entry.downloaded;
+					callbackData.total = entry.total;
+					ring->inst->self->safeCallback(*ring->inst, callbackData);
+					continue;
+				}
+				DownloadInstance& inst = *ring->inst;
+				// 强制停止时丢弃剩余数据
+				if (!ring->failed && !(inst.self->m_stop && !inst.self->m_joinStop)) {
+					if (inst.ctx.sink) {
+						if (!inst.ctx.sink->write(entry.data.get(), entry.size)) {
+							ring->failed = true;
+						}
+					} else {
+						CallbackData callbackData;
+						callbackData.type = CONTENT;
+						callbackData.data = entry.data.get();
+						callbackData.size = entry.size;
+						inst.self->safeCallback(inst, callbackData);
+					}
+				}
+				freeChunk(std::move(entry.data));
+				bool resume = false;
+				{
+					std::lock_guard<std::mutex> _(ring->lock);
+					ring->chunks--;
+					// sink 失败时也要恢复，让写回调返回 0 中止下载
+					if (ring->paused && !ring->resumePosted) {
+						ring->resumePosted = true;
+						resume = true;
+					}
+				}
+				if (resume) {
+					ring->inst->loop->requestResume(ring);
+				}
+			}
+			enqueue(ring);
+		}
+		void deliverHeader(DownloadInstance& inst, const char* data, size_t size) {
+			if (inst.ctx.sink) {
+				inst.ctx.sink->header(data, size);
+			}
+			std::string value;
+			if (matchHeader(data, size, "Content-Length", value)) {
+				CallbackData callbackData;
+				callbackData.type = FILESIZE;
+				callbackData.fileSize = strtoull(value.c_str(), NULL, 10);
+				if (inst.ctx.sink) {
+					inst.ctx.sink->reserve(callbackData.fileSize);
+				}
+				inst.self->safeCallback(inst, callbackData);
+			}
+		}
+		void complete(const std::shared_ptr<TransferRing>& ring, DownloadResult result) {
+			DownloadInstance* inst = ring->inst;
+			MultiDownload* owner = inst->self;
+			// 强制停止时与直接模式一样只让 sink 收尾，不再回调
+			bool aborted = owner->m_stop && !owner->m_joinStop;
+			if (ring->failed && result == E_OK) {
+				result = E_WRITEFAIL;
+			}
+			if (inst->ctx.sink && !inst->ctx.sink->finish(aborted ? E_DOWNLOADFAIL : result) && result == E_OK) {
+				result = E_WRITEFAIL;
+			}
+			if (!aborted) {
+				CallbackData callbackData;
+				callbackData.type = RESULT;
+				callbackData.result = result;
+				owner->safeCallback(*inst, callbackData);
+			}
+			EventLoop* loop = inst->loop;
+			std::string host = inst->ctx.host;
+			ring->inst = NULL;
+			delete inst;
+			loop->drained(host);
+		}
+
+		const size_t m_ringChunks;
+		const size_t m_chunkSize;
+		std::atomic<size_t> m_buffered;
+		std::mutex m_lock;
+		std::condition_variable m_cv;
+		std::deque<std::shared_ptr<TransferRing>> m_ready;
+		bool m_stopping;
+		std::vector<std::thread> m_threads;
+		std::mutex m_poolLock;
+		std::vector<std::unique_ptr<char[]>> m_free;
+	};
+
+	/// 一个事件循环线程及其拥有的 CURLM、句柄池与任务队列，任务的回调都在所属循环的线程上执行（背压模式除外）
+	class EventLoop {
+	public:
+		EventLoop(MultiDownload* owner, size_t maxConcurrency, size_t maxHostConnections)
+		:m_owner(owner)
+		,m_curlm(NULL)
+		,m_share(NULL)
+		,m_load(0)
+		,m_maxConcurrency(maxConcurrency)
+		{
+			m_curlm = curl_multi_init();
+			initConnectionCache(maxHostConnections);
+			initEventLoop();
+		}
+		~EventLoop() {
+			stop();
+			// 空闲句柄引用着 share，要先于 share 释放
+			for (CURL* curl : m_idleHandles) {
+				curl_easy_cleanup(curl);
+			}
+			m_idleHandles.clear();
+			Submission* node = m_inbox.exchange(NULL);
+			while (node) {
+				Submission* next = node->next;
+				delete node;
+				node = next;
+			}
+			if (m_curlm) {
+				curl_multi_cleanup(m_curlm);
+			}
+			if (m_share) {
+				curl_share_cleanup(m_share);
+			}
+			cleanupEventLoop();
+		}
+		void start() {
+			m_routine = std::thread(std::bind(&EventLoop::downloadRoutine, this));
+		}
+		// 停止标志由 MultiDownload 设置，这里只唤醒并等待线程退出
+		void stop() {
+			wakeup();
+			if (m_routine.joinable()) {
+				m_routine.join();
+			}
+		}
+		// 提交线程把 first..last 串成的链表用一次 CAS 压到 m_inbox 头部，不加锁；
+		// 下载线程一次取走整条链表。链表中后提交的在前
+		void push(Submission* first, Submission* last, size_t count) {
+			m_load += count;
+			m_inboxSize += count;
+			Submission* head = m_inbox.load(std::memory_order_relaxed);
+			do {
+				last->next = head;
+			} while (!m_inbox.compare_exchange_weak(head, first, std::memory_order_release, std::memory_order_relaxed));
+			wakeup();
+		}
+		size_t queueSize() {
+			std::lock_guard<LockType> _(m_downloadQueueLock);
+			return m_downloadQueue.size() + m_inboxSize;
+		}
+		void setHostLimit(size_t limit) {
+			m_downloadQueueLock.lock();
+			m_downloadQueue.setHostLimit(limit);
+			m_downloadQueueLock.unlock();
+			// 放宽限制后可能有任务可以开始
+			wakeup();
+		}
+		// 排队与进行中的任务数
+		size_t load() const {
+			return m_load;
+		}
+		// 消费线程取走数据块后调用，暂停的任务在下载线程上恢复
+		void requestResume(const std::shared_ptr<TransferRing>& ring) {
+			{
+				std::lock_guard<std::mutex> _(m_resumeLock);
+				m_resume.push_back(ring);
+			}
+			wakeup();
+		}
+		// 背压模式下任务的结果已由消费线程处理，释放并发名额
+		void drained(const std::string& host) {
+			finished(host);
+			m_draining--;
+			wakeup();
+		}
+		typedef std::pair<std::chrono::steady_clock::time_point, uint64_t> TimerKey;
+		// delay_ms 之后在本循环线程上执行 fn，可在任意线程调用。join 会等待未执行的定时任务
+		TimerKey schedule(int delay_ms, std::function<void()> fn) {
+			TimerKey key(std::chrono::steady_clock::now() + std::chrono::milliseconds(delay_ms), m_timerSeq++);
+			{
+				std::lock_guard<std::mutex> _(m_timerLock);
+				m_timers.emplace(key, std::move(fn));
+			}
+			wakeup();
+			return key;
+		}
+		// 已执行或已取消时没有效果
+		void cancelTimer(const TimerKey& key) {
+			std::lock_guard<std::mutex> _(m_timerLock);
+			m_timers.erase(key);
+		}
+		// 限速暂停的传输 delay_ms 后恢复，只在本循环线程上调用。
+		// 等待时间不超过 kMaxThrottle，限速放宽时暂停的传输能及时恢复。
+		// 定时器按任务与序号记录，任务结束时由 unthrottle 撤销，句柄被新任务复用也不会恢复错对象
+		void throttle(DownloadInstance* inst, int delay_ms) {
+			uint64_t seq = ++inst->throttleSeq;
+			inst->throttled = true;
+			inst->throttleTimer = schedule(std::min(delay_ms, (int)kMaxThrottle), [this, inst, seq] {
+				m_unthrottle.emplace_back(inst, seq);
+			});
+		}
+		// 检查进行中的任务是否被取消
+		void requestCancel() {
+			m_cancelPending = true;
+			wakeup();
+		}
+	private:
+		friend class DownloadInstance;
+
+		void downloadRoutine() {
+			std::map<CURL*, DownloadInstance*> downloading;
+			while(true) {
+				// ǿ�ƹر�
+				if (!m_owner->m_joinStop && m_owner->m_stop) {
+					break;
+				}
+				//������ɷ�����
+				if (m_owner->m_joinStop && m_owner->m_stop && downloading.empty() && queueEmpty() && timersEmpty()) {
+					break;
+				}
+				startQueued(downloading);
+				// 没有事件时阻塞在 epoll 上直到被唤醒或 curl 定时器到期，不再空转
+				waitEvents();
+				resumePaused(downloading);
+				runTimers();
+				resumeThrottled(downloading);
+				cancelRequested(downloading);
+				readCompleted(downloading);
+			}
+			// 强制停止时释放尚未完成的下载
+			for (auto& v : downloading) {
+				unthrottle(v.second);
+				curl_multi_remove_handle(m_curlm, v.first);
+				if (v.second->ring) {
+					handOff(v.second, E_DOWNLOADFAIL);
+					continue;
+				}
+				if (v.second->ctx.sink) {
+					v.second->ctx.sink->finish(E_DOWNLOADFAIL);
+				}
+				delete v.second;
+			}
+		}
+
+		bool queueEmpty() {
+			if (m_inbox.load(std::memory_order_acquire)) {
+				return false;
+			}
+			std::lock_guard<LockType> _(m_downloadQueueLock);
+			return m_downloadQueue.empty();
+		}
+		// 把新提交的任务按提交顺序移入调度器
+		void drainInbox() {
+			Submission* node = m_inbox.exchange(NULL, std::memory_order_acquire);
+			Submission* ordered = NULL;
+			while (node) {
+				Submission* next = node->next;
+				node->next = ordered;
+				ordered = node;
+				node = next;
+			}
+			size_t count = 0;
+			m_downloadQueueLock.lock();
+			while (ordered) {
+				Submission* next = ordered->next;
+				DownloadContext& ctx = ordered->ctx;
+				std::string host = urlAuthority(ctx.url);
+				DownloadPriority priority = ctx.priority;
+				int timeout_ms = ctx.timeout_ms;
+				auto enqueueTime = ctx.enqueueTime;
+				m_downloadQueue.push(std::move(ctx), host, priority, timeout_ms, enqueueTime);
+				delete ordered;
+				ordered = next;
+				count++;
+			}
+			m_downloadQueueLock.unlock();
+			m_inboxSize -= count;
+		}
+		// 任务结束，释放所属主机的并发名额
+		void finished(const std::string& host) {
+			m_downloadQueueLock.lock();
+			m_downloadQueue.release(host);
+			m_downloadQueueLock.unlock();
+			m_load--;
+		}
+
+		void resumePaused(std::map<CURL*, DownloadInstance*>& downloading) {
+			std::vector<std::shared_ptr<TransferRing>> resume;
+			{
+				std::lock_guard<std::mutex> _(m_resumeLock);
+				resume.swap(m_resume);
+			}
+			for (auto& ring : resume) {
+				{
+					std::lock_guard<std::mutex> _(ring->lock);
+					ring->paused = false;
+					ring->resumePosted = false;
+				}
+				if (ring->curl) {
+					unpause(ring->curl, downloading);
+				}
+			}
+		}
+		void resumeThrottled(std::map<CURL*, DownloadInstance*>& downloading) {
+			std::vector<std::pair<DownloadInstance*, uint64_t>> resume;
+			resume.swap(m_unthrottle);
+			for (auto& v : resume) {
+				// 恢复时可能再次暂停并登记新的定时器，序号不同的旧请求不再处理
+				DownloadInstance* inst = v.first;
+				if (inst->throttled && inst->throttleSeq == v.second) {
+					inst->throttled = false;
+					unpause(inst->curl, downloading);
+				}
+			}
+		}
+		// 任务结束时撤销限速恢复，已到期未处理的请求一并丢弃
+		void unthrottle(DownloadInstance* inst) {
+			if (!inst->throttled) {
+				return;
+			}
+			inst->throttled = false;
+			cancelTimer(inst->throttleTimer);
+			m_unthrottle.erase(std::remove_if(m_unthrottle.begin(), m_unthrottle.end(),
+				[inst](const std::pair<DownloadInstance*, uint64_t>& v) { return v.first == inst; }), m_unthrottle.end());
+		}
+		// 恢复时 curl 会同步调用写回调交付暂停前的数据，可能再次暂停。
+		// sink 已失败时写回调返回 0，错误只由 curl_easy_pause 返回，不会再出现在 multi 的消息中
+		void unpause(CURL* curl, std::map<CURL*, DownloadInstance*>& downloading) {
+			if (curl_easy_pause(curl, CURLPAUSE_CONT) != CURLE_OK) {
+				curl_multi_remove_handle(m_curlm, curl);
+				auto it = downloading.find(curl);
+				if (it != downloading.end()) {
+					DownloadInstance* inst = it->second;
+					downloading.erase(it);
+					complete(inst, E_WRITEFAIL);
+				}
+			}
+		}
+		// 背压模式的任务结束：句柄在本线程归还，结果排到缓冲区末尾，由消费线程回调并释放任务
+		void handOff(DownloadInstance* inst, DownloadResult result) {
+			std::shared_ptr<TransferRing> ring = inst->ring;
+			inst->cleanup();
+			ring->curl = NULL;
+			m_draining++;
+			m_owner->m_consumers->finish(ring, result);
+		}
+
+		void startQueued(std::map<CURL*, DownloadInstance*>& downloading) {
+			CallbackData callbackData;
+			drainInbox();
+			// 背压模式下结束但缓冲区未处理完的任务仍占用名额，缓冲内存因此有上限
+			while (downloading.size() + m_draining < m_maxConcurrency) {
+				DownloadInstance* newDownload = NULL;
+				DownloadContext ctx;
+				std::string host;
+				m_downloadQueueLock.lock();
+				bool popped = m_downloadQueue.pop(ctx, host);
+				m_downloadQueueLock.unlock();
+				if (popped) {
+					newDownload = new DownloadInstance;
+					newDownload->self = m_owner;
+					newDownload->loop = this;
+					newDownload->ctx = std::move(ctx);
+					newDownload->ctx.host = host;
+				}
+				if (!newDownload) {
+					break;
+				}
+				// 排队期间被取消的任务不再开始
+				DownloadResult result = E_CANCELLED;
+				if (!newDownload->ctx.cancelled()) {
+					if (newDownload->init() && curl_multi_add_handle(m_curlm, newDownload->curl) == CURLM_OK) {
+						downloading[newDownload->curl] = newDownload;
+						continue;
+					}
+					result = E_MEMORY;
+				}
+				if (newDownload->ctx.sink) {
+					newDownload->ctx.sink->finish(result);
+				}
+				callbackData.type = RESULT;
+				callbackData.result = result;
+				m_owner->safeCallback(*newDownload, callbackData);
+				finished(newDownload->ctx.host);
+				delete newDownload;
+			}
+		}
+
+		void readCompleted(std::map<CURL*, DownloadInstance*>& downloading) {
+			int msgsLeft;
+			CURLMsg *msg;
+			while((msg = curl_multi_info_read(m_curlm, &msgsLeft))) {
+				if (CURLMSG_DONE == msg->msg) {
+					curl_multi_remove_handle(m_curlm, msg->easy_handle);
+					auto it = downloading.find(msg->easy_handle);
+					if (it == downloading.end()) {
+						//TODO�����������־
+						std::cout << __FILE__ << ":" << __LINE__ << std::endl;
+					} else {
+						DownloadInstance* inst = it->second;
+						downloading.erase(it);
+						DownloadResult result = E_OK;
+						if (inst->sinkFailed) {
+							result = E_WRITEFAIL;
+						} else if (inst->sinkComplete) {
+							// curl 报告的写错误是 sink 主动中止造成的
+							result = E_OK;
+						} else if (CURLE_OK != msg->data.result) {
+							result = translateCURLCode(msg->data.result);
+						} else {
+							long responseCode = 0;
+							curl_easy_getinfo(inst->curl, CURLINFO_RESPONSE_CODE, &responseCode);
+							bool notModified = responseCode == 304 && inst->ctx.conditional;
+							if (responseCode > 300 && !notModified) {
+								result = translateResponseCode(responseCode);
+							} else if (!notModified && !inst->verify()) {
+								result = E_CHECKSUM;
+							}
+						}
+						complete(inst, result);
+					}
+				}
+			}
+		}
+		// 任务已从 CURLM 移除，句柄还没有归还
+		void complete(DownloadInstance* inst, DownloadResult result) {
+			unthrottle(inst);
+			m_owner->recordMetrics(*inst, result);
+			if (inst->ring) {
+				handOff(inst, result);
+				return;
+			}
+			if (inst->ctx.sink && !inst->ctx.sink->finish(result) && result == E_OK) {
+				result = E_WRITEFAIL;
+			}
+			CallbackData callbackData;
+			callbackData.type = RESULT;
+			callbackData.result = result;
+			m_owner->safeCallback(*inst, callbackData);
+			finished(inst->ctx.host);
+			delete inst;
+		}
+		void cancelRequested(std::map<CURL*, DownloadInstance*>& downloading) {
+			if (!m_cancelPending.exchange(false)) {
+				return;
+			}
+			for (auto it = downloading.begin(); it != downloading.end();) {
+				DownloadInstance* inst = it->second;
+				if (!inst->ctx.cancelled()) {
+					++it;
+					continue;
+				}
+				curl_multi_remove_handle(m_curlm, it->first);
+				it = downloading.erase(it);
+				complete(inst, E_CANCELLED);
+			}
+		}
+		void runTimers() {
+			std::vector<std::function<void()>> due;
+			{
+				auto now = std::chrono::steady_clock::now();
+				std::lock_guard<std::mutex> _(m_timerLock);
+				while (!m_timers.empty() && m_timers.begin()->first.first <= now) {
+					due.push_back(std::move(m_timers.begin()->second));
+					m_timers.erase(m_timers.begin());
+				}
+			}
+			for (auto& fn : due) {
+				fn();
+			}
+		}
+		bool timersEmpty() {
+			std::lock_guard<std::mutex> _(m_timerLock);
+			return m_timers.empty();
+		}
+		// 等待时间不超过下一个定时任务到期的时间，timeout 为 -1 表示不限
+		int timerTimeout(int timeout) {
+			std::lock_guard<std::mutex> _(m_timerLock);
+			if (m_timers.empty()) {
+				return timeout;
+			}
+			auto left = std::chrono::duration_cast<std::chrono::milliseconds>(m_timers.begin()->first.first - std::chrono::steady_clock::now() + std::chrono::microseconds(999)).count();
+			int ms = left > 0 ? (int)left : 0;
+			return timeout < 0 ? ms : std::min(timeout, ms);
+		}
+
+	#ifdef __linux__
+		// curl 通过 socket/timer 回调告知需要关注的 fd 与超时，事件循环据此在 epoll 上等待
+		void initEventLoop() {
+			m_epollFd = epoll_create1(EPOLL_CLOEXEC);
+			m_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			epoll_event ev;
+			ev.events = EPOLLIN;
+			ev.data.fd = m_wakeFd;
+			epoll_ctl(m_epollFd, EPOLL_CTL_ADD, m_wakeFd, &ev);
+			curl_multi_setopt(m_curlm, CURLMOPT_SOCKETFUNCTION, EventLoop::socketCallback);
+			curl_multi_setopt(m_curlm, CURLMOPT_SOCKETDATA, this);
+			curl_multi_setopt(m_curlm, CURLMOPT_TIMERFUNCTION, EventLoop::timerCallback);
+			curl_multi_setopt(m_curlm, CURLMOPT_TIMERDATA, this);
+		}
+		void cleanupEventLoop() {
+			if (m_wakeFd >= 0) {
+				close(m_wakeFd);
+				m_wakeFd = -1;
+			}
+			if (m_epollFd >= 0) {
+				close(m_epollFd);
+				m_epollFd = -1;
+			}
+		}
+		void wakeup() {
+			// 下载线程被唤醒前的多次 add 只写一次 eventfd
+			if (!m_wakePending.exchange(true)) {
+				uint64_t one = 1;
+				ssize_t ret = write(m_wakeFd, &one, sizeof(one));
+				(void)ret;
+			}
+		}
+		void waitEvents() {
+			const int maxEvents = 64;
+			epoll_event events[maxEvents];
+			int timeout = -1;
+			if (m_timerArmed) {
+				auto left = std::chrono::duration_cast<std::chrono::milliseconds>(m_timerDeadline - std::chrono::steady_clock::now()).count();
+				timeout = left > 0 ? (int)left : 0;
+			}
+			int n = epoll_wait(m_epollFd, events, maxEvents, timerTimeout(timeout));
+			if (n < 0 && errno != EINTR) {
+				//TODO: 输出错误日志
+				std::cout << __FILE__ << ":" << __LINE__ << std::endl;
+			}
+			int runningHandle = 0;
+			for (int i = 0; i < n; ++i) {
+				if (events[i].data.fd == m_wakeFd) {
+					uint64_t count;
+					ssize_t ret = read(m_wakeFd, &count, sizeof(count));
+					(void)ret;
+					m_wakePending = false;
+					continue;
+				}
+				int flags = 0;
+				if (events[i].events & EPOLLIN) {
+					flags |= CURL_CSELECT_IN;
+				}
+				if (events[i].events & EPOLLOUT) {
+					flags |= CURL_CSELECT_OUT;
+				}
+				if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+					flags |= CURL_CSELECT_ERR;
+				}
+				curl_multi_socket_action(m_curlm, events[i].data.fd, flags, &runningHandle);
+			}
+			if (m_timerArmed && std::chrono::steady_clock::now() >= m_timerDeadline) {
+				m_timerArmed = false;
+				curl_multi_socket_action(m_curlm, CURL_SOCKET_TIMEOUT, 0, &runningHandle);
+			}
+		}
+		static int socketCallback(CURL* easy, curl_socket_t s, int what, void* userp, void* socketp) {
+			EventLoop* self = static_cast<EventLoop*>(userp);
+			(void)easy;
+			if (what == CURL_POLL_REMOVE) {
+				epoll_ctl(self->m_epollFd, EPOLL_CTL_DEL, s, NULL);
+				curl_multi_assign(self->m_curlm, s, NULL);
+				return 0;
+			}
+			epoll_event ev;
+			ev.events = 0;
+			ev.data.fd = s;
+			if (what & CURL_POLL_IN) {
+				ev.events |= EPOLLIN;
+			}
+			if (what & CURL_POLL_OUT) {
+				ev.events |= EPOLLOUT;
+			}
+			if (socketp) {
+				epoll_ctl(self->m_epollFd, EPOLL_CTL_MOD, s, &ev);
+			} else {
+				epoll_ctl(self->m_epollFd, EPOLL_CTL_ADD, s, &ev);
+				curl_multi_assign(self->m_curlm, s, self);
+			}
+			return 0;
+		}
+		static int timerCallback(CURLM* multi, long timeout_ms, void* userp) {
+			EventLoop* self = static_cast<EventLoop*>(userp);
+			(void)multi;
+			if (timeout_ms < 0) {
+				self->m_timerArmed = false;
+			} else {
+				self->m_timerArmed = true;
+				self->m_timerDeadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+			}
+			return 0;
+		}
+	#else
+		void initEventLoop() {}
+		void cleanupEventLoop() {}
+		void wakeup() {
+			if (m_curlm) {
+				curl_multi_wakeup(m_curlm);
+			}
+		}
+		void waitEvents() {
+			int runningHandle = 0;
+			int numfds = 0;
+			curl_multi_perform(m_curlm, &runningHandle);
+			if (curl_multi_poll(m_curlm, NULL, 0, timerTimeout(1000), &numfds) != CURLM_OK) {
+				//TODO: 输出错误日志
+				std::cout << __FILE__ << ":" << __LINE__ << std::endl;
+			}
+			curl_multi_perform(m_curlm, &runningHandle);
+		}
+	#endif
+
+		// 多个请求共享 DNS 缓存、TLS 会话与连接，都在下载线程上访问，不需要加锁
+		void initConnectionCache(size_t maxHostConnections) {
+			m_share = curl_share_init();
+			if (m_share) {
+				curl_share_setopt(m_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+				curl_share_setopt(m_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+	#if LIBCURL_VERSION_NUM >= 0x073900
+				curl_share_setopt(m_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+	#endif
+			}
+	#ifdef CURLPIPE_MULTIPLEX
+			curl_multi_setopt(m_curlm, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+	#endif
+			if (maxHostConnections) {
+				curl_multi_setopt(m_curlm, CURLMOPT_MAX_HOST_CONNECTIONS, (long)maxHostConnections);
+			}
+		}
+		CURL* acquireHandle() {
+			if (m_idleHandles.empty()) {
+				return curl_easy_init();
+			}
+			CURL* curl = m_idleHandles.back();
+			m_idleHandles.pop_back();
+			// reset 清除选项，保留连接、DNS 与 TLS 会话缓存
+			curl_easy_reset(curl);
+			return curl;
+		}
+		void releaseHandle(CURL* curl) {
+			if (m_idleHandles.size() < m_maxConcurrency) {
+				m_idleHandles.push_back(curl);
+			} else {
+				curl_easy_cleanup(curl);
+			}
+		}
+		void applyConnectionOptions(CURL* curl, bool multiplex) {
+			if (m_share) {
+				curl_easy_setopt(curl, CURLOPT_SHARE, m_share);
+			}
+	#ifdef CURLPIPE_MULTIPLEX
+			// https 上协商 HTTP/2；同一主机的新请求等待已有连接确认能否复用，而不是另建连接。
+			// 分段下载需要多个连接分担带宽，不等待复用
+			curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+			if (multiplex) {
+				curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+			}
+	#else
+			(void)multiplex;
+	#endif
+		}
+
+		MultiDownload* m_owner;
+		CURLM* m_curlm;
+		CURLSH* m_share;
+		std::vector<CURL*> m_idleHandles;   // 只在本循环线程上访问
+		std::atomic<Submission*> m_inbox{NULL};
+		std::atomic<size_t> m_inboxSize{0};
+		DownloadScheduler<DownloadContext> m_downloadQueue;
+		LockType m_downloadQueueLock;
+		std::atomic<size_t> m_load;
+		std::atomic<size_t> m_draining{0};
+		std::mutex m_resumeLock;
+		std::vector<std::shared_ptr<TransferRing>> m_resume;
+		std::atomic<bool> m_cancelPending{false};
+		static const int kMaxThrottle = 100;
+		std::vector<std::pair<DownloadInstance*, uint64_t>> m_unthrottle;
+		std::mutex m_timerLock;
+		std::map<TimerKey, std::function<void()>> m_timers;
+		std::atomic<uint64_t> m_timerSeq{0};
+		std::thread m_routine;
+		const size_t m_maxConcurrency;
+#ifdef __linux__
+		int m_epollFd = -1;
+		int m_wakeFd = -1;
+		std::atomic<bool> m_wakePending{false};
+		bool m_timerArmed = false;
+		std::chrono::steady_clock::time_point m_timerDeadline;
+#endif
+	};
+
+	friend class DownloadInstance;
+	// 在句柄归还之前调用
+	void recordMetrics(const DownloadInstance& inst, DownloadResult result) {
+		TransferMetrics m;
+		m.result = result;
+		CURL* curl = inst.curl;
+		curl_off_t dns = 0, connect = 0, tls = 0, ttfb = 0, total = 0;
+		curl_off_t downloaded = 0, uploaded = 0, speed = 0;
+		long connects = 0;
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &m.responseCode);
+		curl_easy_getinfo(curl, CURLINFO_HTTP_VERSION, &m.httpVersion);
+		curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &dns);
+		curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+		curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &tls);
+		curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &ttfb);
+		curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+		curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &downloaded);
+		curl_easy_getinfo(curl, CURLINFO_SIZE_UPLOAD_T, &uploaded);
+		curl_easy_getinfo(curl, CURLINFO_SPEED_DOWNLOAD_T, &speed);
+		curl_easy_getinfo(curl, CURLINFO_REDIRECT_COUNT, &m.redirects);
+		curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+		// curl 给出的是从开始到各阶段结束的累计时间
+		m.newConnection = connects > 0;
+		if (m.newConnection) {
+			m.dns_us = dns;
+			m.connect_us = connect > dns ? connect - dns : 0;
+			m.tls_us = tls > connect ? tls - connect : 0;
+		}
+		m.ttfb_us = ttfb;
+		m.total_us = total;
+		m.bytesDownloaded = downloaded;
+		m.bytesUploaded = uploaded;
+		m.speed = speed;
+		m.retries = inst.ctx.retries;
+		m.queue_us = std::chrono::duration_cast<std::chrono::microseconds>(inst.startTime - inst.ctx.enqueueTime).count();
+		m_metrics.record(m);
+		if (m_metricsCallback) {
+			m_metricsCallback(inst.ctx.fileId.c_str(), inst.ctx.url.c_str(), m);
+		}
+	}
+	void safeCallback(const DownloadInstance& inst, const CallbackData& callbackData) const {
+		if (inst.ctx.cb) {
+			inst.ctx.cb(inst.ctx.fileId.c_str(), inst.ctx.url.c_str(), callbackData);
+		}
+	}
+
+	static DownloadResult translateCURLCode(CURLcode code) {
+		switch(code) {
+		case CURLE_OK:
+			return E_OK;
+		case CURLE_OPERATION_TIMEDOUT:
+			return E_TIMEOUT;
+		default:
+			return E_DOWNLOADFAIL;
+		}
+	}
+	static DownloadResult translateResponseCode(int code) {
+		switch(code) {
+		case 200:
+			return E_OK;
+		case 403:
+			return E_FORBIDDEN;
+		case 404:
+			return E_NOTFOUND;
+		case 502:
+			return E_GATEWAYTIMEOUT;
+		default:
+			return E_RESPONSE_CODE;
+		}
+	}
+
+	std::atomic<bool> m_stop;
+	std::atomic<bool> m_joinStop;
+	std::vector<std::unique_ptr<EventLoop>> m_loops;
+	const LoopAssignment m_assignment;
+	std::atomic<int> m_progressInterval{0};
+	HedgePolicy m_hedgePolicy;
+	MirrorStats m_mirrors;
+	LatencyWindow m_firstByte;      // 对冲请求各尝试的首字节耗时，毫秒
+	BandwidthLimiter m_limiter;
+	std::atomic<bool> m_coalesce{false};
+	size_t m_replayBytes = 8 << 20;
+	std::mutex m_flightLock;
+	std::unordered_map<std::string, std::shared_ptr<Flight>> m_flights;
+	MetricsCallback m_metricsCallback;
+	DownloadMetrics m_metrics;
+	std::unique_ptr<ConsumerPool> m_consumers;
+#ifndef _WIN32
+	std::shared_ptr<DownloadCache> m_cache;
+#endif
+};
+
+#endif
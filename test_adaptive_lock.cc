@@ -0,0 +1,134 @@
+#include <cassert>
+#include <chrono>
+#include <iostream>
+#include <type_traits>
+#include <vector>
+#include "design_pattern.h"
+
+// 锁对象要能紧凑地嵌入其他结构，不能带虚表指针
+static_assert(!std::is_polymorphic<AdaptiveLock<>>::value, "AdaptiveLock must not carry a vptr");
+static_assert(!std::is_copy_constructible<AdaptiveLock<>>::value && !std::is_copy_assignable<AdaptiveLock<>>::value,
+			  "AdaptiveLock must not be copyable");
+// 不记录争用计数时只有状态字与自旋预算
+static_assert(sizeof(AdaptiveLock<>) == 8, "AdaptiveLock<false> must not carry counters");
+
+struct Buffer
+{
+	char data[256];
+	void reset() {}
+};
+
+/// 多线程反复进入一个很短的临界区
+template<typename LockType>
+static double Run(LockType& lock, int thread_num, int loops, uint64_t& counter)
+{
+	auto t0 = std::chrono::steady_clock::now();
+	std::vector<std::thread> threads;
+	for (int i = 0; i < thread_num; ++i) {
+		threads.emplace_back([&] {
+			for (int n = 0; n < loops; ++n) {
+				std::lock_guard<LockType> _(lock);
+				++counter;
+			}
+		});
+	}
+	for (auto& t : threads) {
+		t.join();
+	}
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+}
+
+/// 临界区很短、锁外还有其他工作时，等待者应在自旋阶段拿到锁，自旋预算随之缩到实际所需附近
+static void TestSpinTuning()
+{
+	const int initial = AdaptiveLock<true>().spin_budget();
+	AdaptiveLock<true> lock;
+	uint64_t counter = 0;
+	std::vector<std::thread> threads;
+	for (int i = 0; i < 2; ++i) {
+		threads.emplace_back([&] {
+			for (int n = 0; n < 50000; ++n) {
+				{
+					std::lock_guard<AdaptiveLock<true>> _(lock);
+					for (int k = 0; k < 20; ++k) {
+						detail::cpu_relax();
+					}
+					++counter;
+				}
+				for (int k = 0; k < 20; ++k) {
+					detail::cpu_relax();
+				}
+			}
+		});
+	}
+	for (auto& t : threads) {
+		t.join();
+	}
+	assert(counter == 100000);
+	auto c = lock.counters();
+	assert(c.acquisitions == 100000);
+	// 自旋从未成功时，每次进入慢路径都只会缩减预算
+	assert(c.spin_acquired > 0 || c.contended == 0 || lock.spin_budget() < initial);
+	// 单核上持锁线程被抢占时自旋无从成功，只能休眠
+	if (std::thread::hardware_concurrency() >= 2) {
+		assert(c.spin_acquired > 0);
+		assert(lock.spin_budget() < initial);
+	}
+	std::cout << "spin tuning: ok, contended " << c.contended << ", spin acquired " << c.spin_acquired << ", parked "
+			  << c.parked << ", spin budget " << initial << " -> " << lock.spin_budget() << std::endl;
+}
+
+int main()
+{
+	const int thread_num = 8;
+	const int loops = 500000;
+
+	{
+		std::mutex lock;
+		uint64_t counter = 0;
+		double ms = Run(lock, thread_num, loops, counter);
+		assert(counter == uint64_t(thread_num) * loops);
+		std::cout << "std::mutex:       " << ms << " ms" << std::endl;
+	}
+	{
+		AdaptiveLock<true> lock;
+		uint64_t counter = 0;
+		double ms = Run(lock, thread_num, loops, counter);
+		assert(counter == uint64_t(thread_num) * loops);
+		auto c = lock.counters();
+		std::cout << "AdaptiveLock:     " << ms << " ms, acquisitions " << c.acquisitions << ", contended "
+				  << c.contended << ", spin acquired " << c.spin_acquired << ", parked " << c.parked
+				  << ", spin budget " << lock.spin_budget() << std::endl;
+	}
+
+	TestSpinTuning();
+
+	// 直接作为 ObjectPool 的 LockType
+	ObjectPool<Buffer, AdaptiveLock<>> pool(64);
+	std::vector<std::thread> threads;
+	for (int i = 0; i < thread_num; ++i) {
+		threads.emplace_back([&] {
+			for (int n = 0; n < 100000; ++n) {
+				if (Buffer* b = pool.alloc()) {
+					b->reset();
+					pool.free(b);
+				}
+			}
+		});
+	}
+	for (auto& t : threads) {
+		t.join();
+	}
+	size_t left = 0;
+	std::vector<Buffer*> all;
+	while (Buffer* b = pool.alloc()) {
+		all.push_back(b);
+		++left;
+	}
+	assert(left == 64);
+	for (auto b : all) {
+		pool.free(b);
+	}
+	std::cout << "ObjectPool<Buffer, AdaptiveLock<>>: ok" << std::endl;
+	return 0;
+}
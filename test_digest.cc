@@ -0,0 +1,92 @@
+#include <cassert>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <vector>
+#include "digest.h"
+
+static std::string Sha256Hex(const std::string& data, bool hardware) {
+	Sha256 sha(hardware);
+	sha.update(data.data(), data.size());
+	return sha.hexdigest();
+}
+
+static void TestVectors() {
+	for (bool hardware : {false, true}) {
+		assert(Sha256Hex("", hardware) == "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+		assert(Sha256Hex("abc", hardware) == "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+		assert(Sha256Hex("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", hardware) ==
+			   "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+		Crc32c crc(hardware);
+		crc.update("123456789", 9);
+		assert(crc.value() == 0xe3069283);
+	}
+	std::cout << "vectors: ok" << std::endl;
+}
+
+// 任意切分、任意长度下硬件实现与可移植实现结果一致
+static void TestSplitUpdates() {
+	std::mt19937_64 rng(42);
+	std::string data(1 << 20, '\0');
+	for (auto& c : data) {
+		c = (char)rng();
+	}
+	for (int round = 0; round < 200; ++round) {
+		size_t size = rng() % (round < 100 ? 300 : data.size());
+		size_t begin = rng() % (data.size() - size + 1);
+		Sha256 sha;
+		Crc32c crc;
+		Sha256 shaPortable(false);
+		Crc32c crcPortable(false);
+		shaPortable.update(data.data() + begin, size);
+		crcPortable.update(data.data() + begin, size);
+		for (size_t pos = 0; pos < size;) {
+			size_t n = std::min<size_t>(size - pos, rng() % 20000 + 1);
+			sha.update(data.data() + begin + pos, n);
+			crc.update(data.data() + begin + pos, n);
+			pos += n;
+		}
+		assert(sha.digest() == shaPortable.digest());
+		assert(crc.value() == crcPortable.value());
+	}
+	std::cout << "split updates: ok" << std::endl;
+}
+
+template<typename F>
+static double Throughput(const std::vector<char>& data, F f) {
+	auto start = std::chrono::steady_clock::now();
+	const int rounds = 8;
+	for (int i = 0; i < rounds; ++i) {
+		f(data);
+	}
+	double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return data.size() * double(rounds) / sec / (1 << 30);
+}
+
+static void TestThroughput() {
+	std::vector<char> data(64 << 20, 'x');
+	uint32_t sink = 0;
+	for (bool hardware : {false, true}) {
+		double sha = Throughput(data, [&](const std::vector<char>& d) {
+			Sha256 s(hardware);
+			s.update(d.data(), d.size());
+			sink += (uint8_t)s.digest()[0];
+		});
+		double crc = Throughput(data, [&](const std::vector<char>& d) {
+			Crc32c c(hardware);
+			c.update(d.data(), d.size());
+			sink += c.value();
+		});
+		std::cout << (hardware ? "hardware" : "portable") << ": sha256 " << sha << " GB/s, crc32c " << crc
+				  << " GB/s" << std::endl;
+	}
+	(void)sink;
+}
+
+int main()
+{
+	TestVectors();
+	TestSplitUpdates();
+	TestThroughput();
+	return 0;
+}
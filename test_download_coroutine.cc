@@ -0,0 +1,142 @@
+#include <cassert>
+#include <stdexcept>
+#include "download_coroutine.h"
+#include "download_pipeline.h"
+#include "loopback_http_server.h"
+
+static double Seconds(std::chrono::steady_clock::time_point since) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - since).count();
+}
+
+static bool Matches(const std::string& body, uint64_t size) {
+	if (body.size() != size) {
+		return false;
+	}
+	for (uint64_t i = 0; i < size; ++i) {
+		if (body[i] != LoopbackHttpServer::byteAt(i)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static Task<size_t> BodySize(MultiDownload<>& download, std::string url) {
+	FetchResult r = co_await fetch(download, url);
+	co_return r.ok() ? r.body.size() : 0;
+}
+
+static void TestFetch() {
+	LoopbackHttpServer server;
+	server.addFile("/model.bin", 3 << 20);
+	MultiDownload<> download(4);
+	auto main = std::this_thread::get_id();
+	auto task = [&]() -> Task<void> {
+		FetchResult r = co_await fetch(download, server.url("/model.bin"));
+		// 由下载线程恢复
+		assert(std::this_thread::get_id() != main);
+		assert(r.ok() && r.fileSize == (3 << 20) && Matches(r.body, 3 << 20));
+		FetchResult missing = co_await fetch(download, server.url("/missing.bin"));
+		assert(missing.result == E_NOTFOUND);
+		// 嵌套的任务
+		size_t size = co_await BodySize(download, server.url("/model.bin"));
+		assert(size == (3 << 20));
+	};
+	syncWait(task());
+	download.join();
+	// 停止后不挂起
+	FetchResult r = syncWait([&]() -> Task<FetchResult> {
+		co_return co_await fetch(download, server.url("/model.bin"));
+	}());
+	assert(r.result == E_MEMORY);
+	std::cout << "fetch: ok" << std::endl;
+}
+
+static void TestSinkRequest() {
+	LoopbackHttpServer server;
+	server.addFile("/model.bin", 1 << 20);
+	MultiDownload<> download(4);
+	auto memory = std::make_shared<MemorySink>();
+	MultiDownload<>::Request request;
+	request.fileId = "sink";
+	request.url = server.url("/model.bin");
+	request.sink = memory;
+	FetchResult r = syncWait([&]() -> Task<FetchResult> {
+		co_return co_await fetch(download, std::move(request));
+	}());
+	// 数据交给了 sink，body 不预留空间
+	assert(r.ok() && r.body.empty() && r.body.capacity() < 4096 && Matches(memory->data(), 1 << 20));
+	std::cout << "sink request: ok" << std::endl;
+}
+
+static void TestWhenAll() {
+	LoopbackHttpServer server;
+	for (int i = 0; i < 10; ++i) {
+		server.addFile("/file" + std::to_string(i), 1000 * (i + 1));
+	}
+	MultiDownload<> download(16);
+	const size_t count = 1000;
+	auto start = std::chrono::steady_clock::now();
+	std::vector<Task<size_t>> tasks;
+	for (size_t i = 0; i < count; ++i) {
+		tasks.push_back(BodySize(download, server.url("/file" + std::to_string(i % 10))));
+	}
+	std::vector<size_t> sizes = syncWait(whenAll(std::move(tasks)));
+	double sec = Seconds(start);
+	assert(sizes.size() == count);
+	for (size_t i = 0; i < count; ++i) {
+		assert(sizes[i] == 1000 * (i % 10 + 1));
+	}
+	// 任务抛出的异常在全部结束后传给等待者
+	// 协程 lambda 的闭包要比协程活得久，不能是临时对象
+	auto fail = [&](int index) -> Task<void> {
+		FetchResult r = co_await fetch(download, server.url("/file0"));
+		if (index == 1 || !r.ok()) {
+			throw std::runtime_error("task " + std::to_string(index));
+		}
+	};
+	std::vector<Task<void>> failing;
+	for (int i = 0; i < 3; ++i) {
+		failing.push_back(fail(i));
+	}
+	bool thrown = false;
+	try {
+		syncWait(whenAll(std::move(failing)));
+	} catch (const std::runtime_error& e) {
+		thrown = std::string(e.what()) == "task 1";
+	}
+	assert(thrown);
+	std::cout << "when all: ok, " << count << " requests in " << sec << " s" << std::endl;
+}
+
+static void TestWhenAny() {
+	LoopbackHttpServer::Options options;
+	options.bandwidth = [](const LoopbackHttpServer::Request& request) {
+		return request.path == "/slow.bin" ? size_t(1 << 20) : size_t(0);
+	};
+	LoopbackHttpServer server(options);
+	server.addFile("/slow.bin", 1 << 20);
+	server.addFile("/fast.bin", 1 << 20);
+	MultiDownload<> download(4);
+	auto start = std::chrono::steady_clock::now();
+	std::vector<Task<size_t>> tasks;
+	tasks.push_back(BodySize(download, server.url("/slow.bin")));
+	tasks.push_back(BodySize(download, server.url("/fast.bin")));
+	auto first = syncWait(whenAny(std::move(tasks)));
+	double sec = Seconds(start);
+	assert(first.first == 1 && first.second == (1 << 20));
+	assert(sec < 0.5);
+	// 慢的请求在后台完成，join 后其协程已释放
+	download.join();
+	std::cout << "when any: ok, " << sec << " s" << std::endl;
+}
+
+int main()
+{
+	curl_global_init(CURL_GLOBAL_ALL);
+	TestFetch();
+	TestSinkRequest();
+	TestWhenAll();
+	TestWhenAny();
+	curl_global_cleanup();
+	return 0;
+}
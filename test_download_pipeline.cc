@@ -0,0 +1,302 @@
+#include <cassert>
+#include <condition_variable>
+#include <sys/mman.h>
+#include "download_pipeline.h"
+#include "loopback_http_server.h"
+
+static std::string Compress(const std::string& data, int windowBits) {
+	z_stream strm;
+	memset(&strm, 0, sizeof(strm));
+	int ret = deflateInit2(&strm, 6, Z_DEFLATED, windowBits, 8, Z_DEFAULT_STRATEGY);
+	assert(ret == Z_OK);
+	std::string out(deflateBound(&strm, data.size()), '\0');
+	strm.next_in = (Bytef*)data.data();
+	strm.avail_in = (uInt)data.size();
+	strm.next_out = (Bytef*)&out[0];
+	strm.avail_out = (uInt)out.size();
+	ret = deflate(&strm, Z_FINISH);
+	assert(ret == Z_STREAM_END);
+	out.resize(strm.total_out);
+	deflateEnd(&strm);
+	return out;
+}
+
+// 可压缩但不是全同的内容
+static std::string MakeText(size_t size) {
+	std::string text;
+	text.reserve(size);
+	for (size_t i = 0; text.size() < size; ++i) {
+		text += "line " + std::to_string(i * 2654435761u % 100000) + " of the model archive\n";
+	}
+	text.resize(size);
+	return text;
+}
+
+static bool Feed(DownloadSink& sink, const std::string& data, size_t chunk) {
+	for (size_t pos = 0; pos < data.size(); pos += chunk) {
+		if (!sink.write(data.data() + pos, std::min(chunk, data.size() - pos))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void TestInflateFormats() {
+	const std::string text = MakeText(1 << 20);
+	struct {
+		InflateFormat format;
+		int windowBits;
+	} cases[] = {
+		{INFLATE_RAW, -MAX_WBITS},
+		{INFLATE_ZLIB, MAX_WBITS},
+		{INFLATE_GZIP, MAX_WBITS + 16},
+		{INFLATE_AUTO, MAX_WBITS + 16},
+		{INFLATE_AUTO, MAX_WBITS},
+	};
+	for (auto& c : cases) {
+		std::string packed = Compress(text, c.windowBits);
+		auto memory = std::make_shared<MemorySink>();
+		InflateSink inflate(c.format, memory, 4096);
+		assert(Feed(inflate, packed, 1000));
+		assert(inflate.finish(E_OK));
+		assert(memory->data() == text);
+	}
+	std::cout << "inflate formats: ok" << std::endl;
+}
+
+static void TestInflateErrors() {
+	const std::string text = MakeText(256 << 10);
+	std::string packed = Compress(text, MAX_WBITS + 16);
+	{
+		// 压缩流不完整
+		auto memory = std::make_shared<MemorySink>();
+		InflateSink inflate(INFLATE_GZIP, memory);
+		assert(Feed(inflate, packed.substr(0, packed.size() / 2), 1000));
+		assert(!inflate.finish(E_OK));
+	}
+	{
+		// 数据损坏
+		std::string broken = packed;
+		for (size_t i = 100; i < 200; ++i) {
+			broken[i] ^= 0x5a;
+		}
+		auto memory = std::make_shared<MemorySink>();
+		InflateSink inflate(INFLATE_GZIP, memory);
+		assert(!Feed(inflate, broken, 1000));
+	}
+	{
+		// 多个 gzip 成员首尾相连
+		auto memory = std::make_shared<MemorySink>();
+		InflateSink inflate(INFLATE_GZIP, memory);
+		assert(Feed(inflate, packed + packed, 777));
+		assert(inflate.finish(E_OK));
+		assert(memory->data() == text + text);
+	}
+	std::cout << "inflate errors: ok" << std::endl;
+}
+
+/// 每次写入都慢一点的 sink，记录调用所在的线程
+class SlowSink : public DownloadSink {
+public:
+	std::string data;
+	std::thread::id thread;
+	size_t failAfter = (size_t)-1;
+	bool write(const char* p, size_t size) override {
+		thread = std::this_thread::get_id();
+		std::this_thread::sleep_for(std::chrono::microseconds(200));
+		if (data.size() >= failAfter) {
+			return false;
+		}
+		data.append(p, size);
+		return true;
+	}
+	bool finish(DownloadResult result) override {
+		return result == E_OK;
+	}
+};
+
+static void TestAsyncSink() {
+	const std::string text = MakeText(4 << 20);
+	{
+		auto slow = std::make_shared<SlowSink>();
+		AsyncSink async(slow, 8);
+		assert(Feed(async, text, 16 << 10));
+		assert(async.finish(E_OK));
+		assert(slow->data == text);
+		assert(slow->thread != std::this_thread::get_id());
+	}
+	{
+		// 下游失败后 write 返回 false，finish 返回 false
+		auto slow = std::make_shared<SlowSink>();
+		slow->failAfter = 1 << 20;
+		AsyncSink async(slow, 8);
+		bool ok = Feed(async, text, 16 << 10);
+		assert(!async.finish(E_OK));
+		assert(!ok || slow->data.size() < text.size());
+	}
+	{
+		// 未 finish 就释放
+		auto slow = std::make_shared<SlowSink>();
+		AsyncSink async(slow, 8);
+		Feed(async, text.substr(0, 1 << 20), 16 << 10);
+	}
+	std::cout << "async sink: ok" << std::endl;
+}
+
+// 从本地服务器下载 gzip 数据，边下载边解压写到文件
+static void TestDownloadInflate() {
+	const std::string text = MakeText(32 << 20);
+	std::string packed = Compress(text, MAX_WBITS + 16);
+	LoopbackHttpServer::Options options;
+	options.bandwidth = [](const LoopbackHttpServer::Request&) {
+		return size_t(16 << 20);
+	};
+	LoopbackHttpServer server(options);
+	server.addContent("/model.gz", packed);
+
+	auto file = std::make_shared<FileSink>("inflated.data");
+	assert(file->open());
+	auto sink = std::make_shared<AsyncSink>(std::make_shared<InflateSink>(INFLATE_GZIP, file));
+	MultiDownload<> download(4);
+	std::mutex lock;
+	std::condition_variable cv;
+	bool done = false;
+	DownloadResult result = E_DOWNLOADFAIL;
+	auto start = std::chrono::steady_clock::now();
+	assert(download.addDownload("model", server.url("/model.gz").c_str(), 0, sink,
+		[&](const char*, const char*, const CallbackData& data) {
+			if (data.type == RESULT) {
+				std::lock_guard<std::mutex> _(lock);
+				result = data.result;
+				done = true;
+				cv.notify_all();
+			}
+		}));
+	{
+		std::unique_lock<std::mutex> lk(lock);
+		cv.wait(lk, [&] { return done; });
+	}
+	double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	assert(result == E_OK);
+	std::ifstream in("inflated.data", std::ios::binary);
+	std::string got((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+	assert(got == text);
+	unlink("inflated.data");
+	std::cout << "download inflate: ok, " << packed.size() << " -> " << text.size() << " bytes in " << sec << " s" << std::endl;
+}
+
+static std::string Decompress(const std::string& packed) {
+	auto memory = std::make_shared<MemorySink>();
+	InflateSink inflate(INFLATE_GZIP, memory);
+	if (!inflate.write(packed.data(), packed.size()) || !inflate.finish(E_OK)) {
+		return std::string();
+	}
+	return memory->take();
+}
+
+// 请求体发送时压缩，服务器按 chunked 收到 gzip 数据
+static void TestGzipUpload() {
+	const std::string text = MakeText(8 << 20);
+	std::mutex lock;
+	std::vector<std::pair<std::string, std::string>> bodies;
+	LoopbackHttpServer::Options options;
+	options.onBody = [&](const std::string& head, const std::string& body) {
+		std::lock_guard<std::mutex> _(lock);
+		bodies.emplace_back(head, body);
+	};
+	LoopbackHttpServer server(options);
+	server.addFile("/upload", 0);
+	{
+		std::ofstream out("upload.txt", std::ios::binary);
+		out << text;
+	}
+	auto buffer = std::make_shared<BufferSource>(std::make_shared<const std::string>(text));
+	std::shared_ptr<UploadSource> sources[] = {
+		std::make_shared<GzipSource>(buffer),
+		std::make_shared<GzipSource>(std::make_shared<FileSource>("upload.txt"), 1, 10000),
+	};
+	MultiDownload<> download(2);
+	for (auto& source : sources) {
+		std::mutex waitLock;
+		std::condition_variable cv;
+		bool done = false;
+		DownloadResult result = E_DOWNLOADFAIL;
+		assert(download.addPost("gzip", server.url("/upload").c_str(), source, 0,
+			[&](const char*, const char*, const CallbackData& data) {
+				if (data.type == RESULT) {
+					std::lock_guard<std::mutex> _(waitLock);
+					result = data.result;
+					done = true;
+					cv.notify_all();
+				}
+			}));
+		std::unique_lock<std::mutex> lk(waitLock);
+		cv.wait(lk, [&] { return done; });
+		assert(result == E_OK);
+	}
+	unlink("upload.txt");
+	assert(bodies.size() == 2);
+	for (auto& body : bodies) {
+		assert(body.first.find("Content-Encoding: gzip") != std::string::npos);
+		assert(body.first.find("Transfer-Encoding: chunked") != std::string::npos);
+		assert(body.second.size() < text.size() / 2);
+		assert(Decompress(body.second) == text);
+	}
+	// 重新读取得到同样的压缩结果
+	GzipSource again(buffer);
+	std::string first(1 << 20, '\0');
+	first.resize(again.read(&first[0], first.size()));
+	assert(again.rewind());
+	std::string second(1 << 20, '\0');
+	second.resize(again.read(&second[0], second.size()));
+	assert(!first.empty() && first == second);
+	std::cout << "gzip upload: ok, " << text.size() << " -> " << bodies[0].second.size() << " bytes" << std::endl;
+}
+
+// 4GB 以上的内存请求体分块交给 deflate，不会被截断
+static void TestGzipLargeBuffer() {
+	const size_t size = (4ull << 30) + 12345;
+	// 不占物理内存的全零映射
+	void* p = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED) {
+		std::cout << "gzip large buffer: skipped, mmap failed" << std::endl;
+		return;
+	}
+	std::shared_ptr<const void> owner(p, [size](const void* q) { munmap(const_cast<void*>(q), size); });
+	GzipSource source(std::make_shared<BufferSource>(owner, (const char*)p, size), 1);
+	z_stream strm;
+	memset(&strm, 0, sizeof(strm));
+	assert(inflateInit2(&strm, MAX_WBITS + 16) == Z_OK);
+	std::unique_ptr<char[]> packed(new char[1 << 20]);
+	std::unique_ptr<char[]> plain(new char[16 << 20]);
+	uint64_t total = 0;
+	int ret = Z_OK;
+	int64_t n;
+	while (ret != Z_STREAM_END && (n = source.read(packed.get(), 1 << 20)) > 0) {
+		strm.next_in = (Bytef*)packed.get();
+		strm.avail_in = (uInt)n;
+		while (strm.avail_in > 0 && ret != Z_STREAM_END) {
+			strm.next_out = (Bytef*)plain.get();
+			strm.avail_out = 16 << 20;
+			ret = inflate(&strm, Z_NO_FLUSH);
+			assert(ret == Z_OK || ret == Z_STREAM_END);
+			total += (16 << 20) - strm.avail_out;
+		}
+	}
+	inflateEnd(&strm);
+	assert(ret == Z_STREAM_END && total == size);
+	std::cout << "gzip large buffer: ok, " << total << " bytes" << std::endl;
+}
+
+int main()
+{
+	curl_global_init(CURL_GLOBAL_ALL);
+	TestInflateFormats();
+	TestInflateErrors();
+	TestAsyncSink();
+	TestDownloadInflate();
+	TestGzipUpload();
+	TestGzipLargeBuffer();
+	curl_global_cleanup();
+	return 0;
+}
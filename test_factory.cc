@@ -1,5 +1,6 @@
 ﻿#include "design_pattern.h"
 
+#include <cassert>
 #include <iostream>
 
 class Car
@@ -129,8 +130,48 @@ class Diesel : public Oil
     bool is_weight_;
 };
 
+static bool StartsWith(std::string_view s, std::string_view prefix)
+{
+    return s.substr(0, prefix.size()) == prefix;
+}
+
+static void TestTypeName()
+{
+    // 编译期类型名
+    static_assert(TypeName_v<int> == "int");
+    assert(TypeName_v<Car> == "Car");
+    assert(TypeName<TESLA>() == "TESLA");
+    assert(StartsWith(TypeName_v<std::vector<int>>, "std::vector<int"));
+    assert(StartsWith(TypeName<std::map<std::string, int>>(), "std::map<std::"));
+
+    // 运行时缓存：反修饰结果与编译期一致，同一类型返回同一个缓存
+    assert(GetClearName(typeid(int)) == "int");
+    assert(GetClearName(typeid(Car)) == "Car");
+    assert(StartsWith(GetClearName(typeid(std::vector<int>)), "std::vector<int"));
+    const std::string *cached = &GetClearName(typeid(Gasoline));
+    assert(*cached == "Gasoline");
+    std::vector<std::thread> threads;
+    std::atomic<bool> same{true};
+    for (int i = 0; i < 4; ++i)
+    {
+        threads.emplace_back([&] {
+            for (int n = 0; n < 10000; ++n)
+            {
+                same = same && &GetClearName(typeid(Gasoline)) == cached && GetClearName(typeid(Diesel)) == "Diesel";
+            }
+        });
+    }
+    for (auto &t : threads)
+    {
+        t.join();
+    }
+    assert(same);
+    std::cout << "type name: ok" << std::endl;
+}
+
 int main()
 {
+    TestTypeName();
     try
     {
         // 偏特化版本类实例
@@ -0,0 +1,175 @@
+#include <cassert>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "design_pattern.h"
+
+/// 用 mutex + deque 实现的对照组
+template<typename T>
+class LockedQueue {
+public:
+	explicit LockedQueue(size_t capacity) : _capacity(capacity) {}
+	bool try_push(T&& v) {
+		std::lock_guard<std::mutex> _(_lock);
+		if (_q.size() >= _capacity) {
+			return false;
+		}
+		_q.push_back(std::move(v));
+		return true;
+	}
+	bool try_pop(T& out) {
+		std::lock_guard<std::mutex> _(_lock);
+		if (_q.empty()) {
+			return false;
+		}
+		out = std::move(_q.front());
+		_q.pop_front();
+		return true;
+	}
+	template<typename InputIt>
+	size_t try_push_batch(InputIt first, size_t n) {
+		size_t i = 0;
+		for (; i < n && try_push(std::move(*first)); ++i, ++first) {}
+		return i;
+	}
+	template<typename OutputIt>
+	size_t try_pop_batch(OutputIt out, size_t max) {
+		size_t i = 0;
+		for (; i < max && try_pop(*out); ++i, ++out) {}
+		return i;
+	}
+	bool empty() {
+		std::lock_guard<std::mutex> _(_lock);
+		return _q.empty();
+	}
+private:
+	std::mutex _lock;
+	std::deque<T> _q;
+	size_t _capacity;
+};
+
+// 编码为 (producer << 40) | seq，便于消费者检查每个生产者的顺序
+static uint64_t Encode(uint64_t producer, uint64_t seq) {
+	return (producer << 40) | seq;
+}
+
+/// 多线程压力测试：每个元素恰好出队一次，且同一生产者的元素按入队顺序出队
+template<typename Queue>
+static void Stress(const char* name, int producers, int consumers, uint64_t per_producer, size_t batch) {
+	Queue q(1024);
+	std::atomic<uint64_t> consumed{0};
+	std::vector<std::vector<uint64_t>> last(consumers, std::vector<uint64_t>(producers, 0));
+	std::vector<std::atomic<uint64_t>> counts(producers);
+	const uint64_t total = per_producer * producers;
+
+	std::vector<std::thread> threads;
+	for (int p = 0; p < producers; ++p) {
+		threads.emplace_back([&, p] {
+			std::vector<uint64_t> buf;
+			uint64_t seq = 1;
+			while (seq <= per_producer) {
+				if (batch > 1) {
+					buf.clear();
+					for (uint64_t s = seq; s < seq + batch && s <= per_producer; ++s) {
+						buf.push_back(Encode(p, s));
+					}
+					size_t n = q.try_push_batch(buf.begin(), buf.size());
+					seq += n;
+					if (n == 0) {
+						std::this_thread::yield();
+					}
+				} else if (q.try_push(Encode(p, seq))) {
+					++seq;
+				} else {
+					std::this_thread::yield();
+				}
+			}
+		});
+	}
+	for (int c = 0; c < consumers; ++c) {
+		threads.emplace_back([&, c] {
+			std::vector<uint64_t> buf(std::max<size_t>(batch, 1));
+			while (consumed.load(std::memory_order_relaxed) < total) {
+				size_t n = batch > 1 ? q.try_pop_batch(buf.begin(), batch) : q.try_pop(buf[0]) ? 1 : 0;
+				if (n == 0) {
+					std::this_thread::yield();
+					continue;
+				}
+				for (size_t i = 0; i < n; ++i) {
+					uint64_t producer = buf[i] >> 40;
+					uint64_t seq = buf[i] & ((uint64_t(1) << 40) - 1);
+					assert(producer < uint64_t(producers));
+					assert(seq > last[c][producer]);
+					last[c][producer] = seq;
+					counts[producer].fetch_add(1, std::memory_order_relaxed);
+				}
+				consumed.fetch_add(n, std::memory_order_relaxed);
+			}
+		});
+	}
+	for (auto& t : threads) {
+		t.join();
+	}
+	for (auto& c : counts) {
+		assert(c.load() == per_producer);
+	}
+	assert(q.empty());
+	std::cout << "stress " << name << " " << producers << "P" << consumers << "C batch " << batch << ": ok"
+			  << std::endl;
+}
+
+template<typename Queue>
+static void Bench(const char* name, int producers, int consumers, size_t batch) {
+	const uint64_t per_producer = 2000000 / producers;
+	auto t0 = std::chrono::steady_clock::now();
+	Stress<Queue>(name, producers, consumers, per_producer, batch);
+	auto t1 = std::chrono::steady_clock::now();
+	double sec = std::chrono::duration<double>(t1 - t0).count();
+	std::cout << "    " << std::fixed << std::setprecision(2) << per_producer * producers / sec / 1e6 << " Mops/s"
+			  << std::endl;
+}
+
+struct Movable {
+	std::string s;
+	static int alive;
+	Movable() { ++alive; }
+	Movable(std::string v) : s(std::move(v)) { ++alive; }
+	Movable(Movable&& rhs) : s(std::move(rhs.s)) { ++alive; }
+	Movable& operator=(Movable&&) = default;
+	~Movable() { --alive; }
+};
+int Movable::alive = 0;
+
+int main()
+{
+	// 析构时释放队列中残留的元素
+	{
+		SpscQueue<Movable> spsc(4);
+		MpmcQueue<Movable> mpmc(4);
+		assert(spsc.capacity() == 4 && mpmc.capacity() == 4);
+		for (int i = 0; i < 6; ++i) {
+			spsc.try_emplace("spsc");
+			mpmc.try_emplace("mpmc");
+		}
+		Movable m;
+		assert(spsc.try_pop(m) && m.s == "spsc");
+		assert(mpmc.try_pop(m) && m.s == "mpmc");
+	}
+	assert(Movable::alive == 0);
+
+	Stress<SpscQueue<uint64_t>>("spsc", 1, 1, 1000000, 1);
+	Stress<SpscQueue<uint64_t>>("spsc", 1, 1, 1000000, 64);
+	Stress<MpmcQueue<uint64_t>>("mpmc", 4, 4, 200000, 1);
+	Stress<MpmcQueue<uint64_t>>("mpmc", 4, 4, 200000, 32);
+	Stress<MpmcQueue<uint64_t>>("mpmc", 1, 4, 500000, 16);
+
+	std::cout << "---------------- benchmark ----------------" << std::endl;
+	Bench<LockedQueue<uint64_t>>("mutex", 1, 1, 1);
+	Bench<SpscQueue<uint64_t>>("spsc", 1, 1, 1);
+	Bench<SpscQueue<uint64_t>>("spsc", 1, 1, 64);
+	Bench<LockedQueue<uint64_t>>("mutex", 4, 4, 1);
+	Bench<MpmcQueue<uint64_t>>("mpmc", 4, 4, 1);
+	Bench<MpmcQueue<uint64_t>>("mpmc", 4, 4, 32);
+	return 0;
+}
@@ -0,0 +1,1238 @@
+#include <cassert>
+#include <condition_variable>
+#include <future>
+#include <set>
+#include <sys/stat.h>
+#include "multi_download.h"
+#include "loopback_http_server.h"
+
+/// 等待一个下载任务的 RESULT 回调
+struct Waiter {
+	std::mutex lock;
+	std::condition_variable cv;
+	bool done = false;
+	DownloadResult result = E_OK;
+	size_t fileSize = 0;
+
+	MultiDownload<>::DownloadCallback callback() {
+		return [this](const char*, const char*, const CallbackData& data) {
+			std::lock_guard<std::mutex> _(lock);
+			if (data.type == FILESIZE) {
+				fileSize = data.fileSize;
+			} else if (data.type == RESULT) {
+				result = data.result;
+				done = true;
+				cv.notify_all();
+			}
+		};
+	}
+	DownloadResult wait() {
+		std::unique_lock<std::mutex> lk(lock);
+		cv.wait(lk, [this] { return done; });
+		return result;
+	}
+	bool ready() {
+		std::lock_guard<std::mutex> _(lock);
+		return done;
+	}
+};
+
+static double Seconds(std::chrono::steady_clock::time_point since) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - since).count();
+}
+
+static void WaitUntil(const std::function<bool()>& ready) {
+	while (!ready()) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	}
+}
+
+static void TestSegmented() {
+	const uint64_t size = (32 << 20) + 12345;
+	LoopbackHttpServer server;
+	server.addFile("/model.bin", size);
+	MultiDownload<> download(8);
+	Waiter w;
+	assert(download.addSegmentedDownload("model", server.url("/model.bin").c_str(), "segmented.data", 0, 4, w.callback()));
+	assert(w.wait() == E_OK);
+	assert(w.fileSize == size);
+	assert(LoopbackHttpServer::verify("segmented.data", size));
+	// 1 次 HEAD + 至少 4 个分段
+	assert(server.requests() >= 5);
+	unlink("segmented.data");
+	std::cout << "segmented download: ok, requests " << server.requests() << std::endl;
+}
+
+static void TestNoRangeFallback() {
+	const uint64_t size = 8 << 20;
+	LoopbackHttpServer::Options options;
+	options.acceptRanges = false;
+	LoopbackHttpServer server(options);
+	server.addFile("/model.bin", size);
+	MultiDownload<> download(8);
+	Waiter w;
+	assert(download.addSegmentedDownload("model", server.url("/model.bin").c_str(), "fallback.data", 0, 4, w.callback()));
+	assert(w.wait() == E_OK);
+	assert(LoopbackHttpServer::verify("fallback.data", size));
+	assert(server.requests() == 2);
+	unlink("fallback.data");
+	std::cout << "no range fallback: ok" << std::endl;
+}
+
+static void TestSlowSegmentStolen() {
+	const uint64_t size = 24 << 20;
+	const size_t slow = 1 << 20;
+	LoopbackHttpServer::Options options;
+	// 从文件开头开始的连接限速 1MB/s，单独下载第一段需要 6 秒
+	options.bandwidth = [=](const LoopbackHttpServer::Request& req) {
+		return req.hasRange && req.rangeBegin == 0 ? slow : 0;
+	};
+	LoopbackHttpServer server(options);
+	server.addFile("/model.bin", size);
+	MultiDownload<> download(8);
+	std::mutex lock;
+	std::vector<DownloadResult> results;
+	download.setMetricsCallback([&](const char*, const char*, const TransferMetrics& m) {
+		std::lock_guard<std::mutex> _(lock);
+		results.push_back(m.result);
+	});
+	Waiter w;
+	auto start = std::chrono::steady_clock::now();
+	assert(download.addSegmentedDownload("model", server.url("/model.bin").c_str(), "stolen.data", 0, 4, w.callback()));
+	assert(w.wait() == E_OK);
+	double sec = Seconds(start);
+	assert(LoopbackHttpServer::verify("stolen.data", size));
+	assert(server.requests() > 5);
+	download.join();
+	// 范围被缩短的段写满后主动结束连接，指标中不记为写入失败
+	assert(results.size() == server.requests());
+	for (auto r : results) {
+		assert(r == E_OK);
+	}
+	unlink("stolen.data");
+	std::cout << "slow segment stolen: ok, " << sec << " s, requests " << server.requests() << std::endl;
+}
+
+static void TestNotFound() {
+	LoopbackHttpServer server;
+	MultiDownload<> download(8);
+	Waiter w;
+	assert(download.addSegmentedDownload("model", server.url("/missing.bin").c_str(), "missing.data", 0, 4, w.callback()));
+	assert(w.wait() == E_NOTFOUND);
+	assert(access("missing.data", F_OK) != 0 && access("missing.data.part", F_OK) != 0);
+	std::cout << "not found: ok" << std::endl;
+}
+
+static void TestResumeAfterRestart() {
+	const uint64_t size = 48 << 20;
+	LoopbackHttpServer::Options options;
+	options.etag = "\"v1\"";
+	// 限速让第一次下载来得及中断，每个连接 8MB/s
+	std::atomic<bool> throttle(true);
+	options.bandwidth = [&](const LoopbackHttpServer::Request&) {
+		return throttle ? size_t(8 << 20) : size_t(0);
+	};
+	LoopbackHttpServer server(options);
+	server.addFile("/model.bin", size);
+	{
+		MultiDownload<> download(8);
+		Waiter w;
+		assert(download.addSegmentedDownload("model", server.url("/model.bin").c_str(), "resume.data", 0, 2, w.callback()));
+		// 两个连接 16MB/s，1.5 秒后强制停止，保留一部分进度
+		std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+	}
+	assert(access("resume.data", F_OK) != 0);
+	assert(access("resume.data.part", F_OK) == 0 && access("resume.data.journal", F_OK) == 0);
+	uint64_t firstRun = server.bytesSent();
+	throttle = false;
+	MultiDownload<> download(8);
+	Waiter w;
+	assert(download.addSegmentedDownload("model", server.url("/model.bin").c_str(), "resume.data", 0, 4, w.callback()));
+	assert(w.wait() == E_OK);
+	uint64_t secondRun = server.bytesSent() - firstRun;
+	assert(LoopbackHttpServer::verify("resume.data", size));
+	assert(access("resume.data.journal", F_OK) != 0);
+	assert(secondRun < size);
+	unlink("resume.data");
+	std::cout << "resume after restart: ok, first " << firstRun << " second " << secondRun << std::endl;
+}
+
+static void TestResumeRejectedOnChange() {
+	const uint64_t size = 24 << 20;
+	LoopbackHttpServer::Options options;
+	options.etag = "\"v1\"";
+	LoopbackHttpServer server(options);
+	server.addFile("/model.bin", size);
+	// 伪造上一次留下的进度：前一半已完成但内容属于旧版本
+	{
+		std::ofstream part("changed.data.part", std::ios::binary);
+		std::string junk(size / 2, 'x');
+		part.write(junk.data(), junk.size());
+		DownloadJournal journal;
+		journal.url = server.url("/model.bin");
+		journal.size = size;
+		journal.etag = "\"v0\"";
+		journal.done.push_back(DownloadJournal::Range(0, size / 2));
+		assert(journal.save("changed.data.journal"));
+	}
+	MultiDownload<> download(8);
+	Waiter w;
+	assert(download.addSegmentedDownload("model", server.url("/model.bin").c_str(), "changed.data", 0, 4, w.callback()));
+	assert(w.wait() == E_OK);
+	assert(LoopbackHttpServer::verify("changed.data", size));
+	assert(server.bytesSent() >= size);
+	assert(access("changed.data.journal", F_OK) != 0);
+	unlink("changed.data");
+	std::cout << "resume rejected on change: ok" << std::endl;
+}
+
+static void TestConnectionReuse() {
+	LoopbackHttpServer server;
+	server.addFile("/small.bin", 1024);
+	const size_t count = 200;
+	// 每个主机最多 2 个连接，多出的请求排队等待空闲连接
+	MultiDownload<> download(16, 2);
+	std::mutex lock;
+	std::condition_variable cv;
+	size_t done = 0;
+	size_t ok = 0;
+	for (size_t i = 0; i < count; ++i) {
+		assert(download.addDownload("small", server.url("/small.bin").c_str(), 0,
+			[&](const char*, const char*, const CallbackData& data) {
+				if (data.type == RESULT) {
+					std::lock_guard<std::mutex> _(lock);
+					done++;
+					ok += data.result == E_OK;
+					cv.notify_all();
+				}
+			}));
+	}
+	{
+		std::unique_lock<std::mutex> lk(lock);
+		cv.wait(lk, [&] { return done == count; });
+	}
+	assert(ok == count);
+	assert(server.requests() == count);
+	assert(server.connections() <= 2);
+	std::cout << "connection reuse: ok, " << count << " requests over " << server.connections() << " connections" << std::endl;
+}
+
+// 多个事件循环：按主机分配时同一主机的回调总在同一线程上，按负载分配时用到所有循环
+static void TestShardedLoops() {
+	LoopbackHttpServer a, b;
+	a.addFile("/small.bin", 4096);
+	b.addFile("/small.bin", 4096);
+	const size_t count = 1000;
+	for (LoopAssignment assignment : {HOST_AFFINITY, LEAST_LOADED}) {
+		MultiDownload<> download(64, 0, 4, assignment);
+		std::mutex lock;
+		std::condition_variable cv;
+		size_t done = 0;
+		size_t ok = 0;
+		std::map<std::string, std::set<std::thread::id>> threads;
+		for (size_t i = 0; i < count; ++i) {
+			LoopbackHttpServer& server = (i % 2) ? a : b;
+			std::string url = server.url("/small.bin");
+			assert(download.addDownload("small", url.c_str(), 0,
+				[&, url](const char*, const char*, const CallbackData& data) {
+					if (data.type == RESULT) {
+						std::lock_guard<std::mutex> _(lock);
+						threads[url].insert(std::this_thread::get_id());
+						done++;
+						ok += data.result == E_OK;
+						cv.notify_all();
+					}
+				}));
+		}
+		download.join();
+		assert(done == count && ok == count);
+		std::set<std::thread::id> all;
+		for (auto& v : threads) {
+			if (assignment == HOST_AFFINITY) {
+				assert(v.second.size() == 1);
+			}
+			all.insert(v.second.begin(), v.second.end());
+		}
+		if (assignment == LEAST_LOADED) {
+			assert(all.size() == 4);
+		}
+		std::cout << "sharded loops (" << (assignment == HOST_AFFINITY ? "host affinity" : "least loaded")
+				  << "): ok, " << all.size() << " loop threads" << std::endl;
+	}
+}
+
+static void TestScheduler() {
+	typedef DownloadScheduler<int> Scheduler;
+	Scheduler::Clock::time_point t0 = Scheduler::Clock::now();
+	int task;
+	std::string host;
+	{
+		// 同一优先级按截止时间排序
+		Scheduler s;
+		s.push(300, "a", PRIORITY_NORMAL, 300, t0);
+		s.push(100, "a", PRIORITY_NORMAL, 100, t0);
+		s.push(200, "b", PRIORITY_NORMAL, 200, t0);
+		for (int expect : {100, 200, 300}) {
+			assert(s.pop(task, host) && task == expect);
+		}
+		assert(s.empty());
+	}
+	{
+		// 同时入队时高优先级在前；低优先级等待足够久后排到新来的高优先级任务前面
+		Scheduler s;
+		s.push(1, "a", PRIORITY_LOW, 0, t0);
+		s.push(2, "a", PRIORITY_HIGH, 0, t0);
+		assert(s.pop(task, host, t0) && task == 2);
+		s.push(3, "a", PRIORITY_HIGH, 0, t0 + std::chrono::seconds(40));
+		assert(s.pop(task, host, t0 + std::chrono::seconds(40)) && task == 1);
+		assert(s.pop(task, host, t0 + std::chrono::seconds(40)) && task == 3);
+	}
+	{
+		// 优先级先于截止时间：没有超时的高优先级任务不排在超时很短的低优先级任务之后
+		Scheduler s;
+		s.push(3, "a", PRIORITY_LOW, 1000, t0);
+		s.push(2, "a", PRIORITY_NORMAL, 500, t0);
+		s.push(1, "a", PRIORITY_HIGH, 0, t0);
+		for (int expect : {1, 2, 3}) {
+			assert(s.pop(task, host, t0) && task == expect);
+		}
+		// 未到提升时间时低优先级任务排在之后入队的高优先级任务之后
+		s.push(5, "a", PRIORITY_LOW, 1000, t0);
+		s.push(4, "a", PRIORITY_HIGH, 0, t0 + std::chrono::seconds(10));
+		assert(s.pop(task, host, t0 + std::chrono::seconds(10)) && task == 4);
+		assert(s.pop(task, host, t0 + std::chrono::seconds(10)) && task == 5);
+		assert(s.empty());
+	}
+	{
+		// 达到上限的主机不阻塞其他主机
+		Scheduler s;
+		s.setHostLimit(1);
+		s.push(1, "a", PRIORITY_HIGH, 0, t0);
+		s.push(2, "a", PRIORITY_HIGH, 0, t0);
+		s.push(3, "b", PRIORITY_LOW, 0, t0);
+		assert(s.pop(task, host, t0) && task == 1 && host == "a");
+		assert(s.pop(task, host, t0) && task == 3 && host == "b");
+		assert(!s.pop(task, host, t0) && s.size() == 1);
+		s.release("a");
+		assert(s.pop(task, host, t0) && task == 2);
+		s.release("a");
+		s.release("b");
+		assert(s.empty() && s.active("a") == 0);
+	}
+	std::cout << "scheduler: ok" << std::endl;
+}
+
+// 只有一个下载名额时，后到的高优先级请求排在已排队的低优先级请求之前
+static void TestPriority() {
+	LoopbackHttpServer::Options options;
+	// /blocker.bin 的响应等到放行后才发出，期间唯一的并发名额被占用
+	std::promise<void> release;
+	std::shared_future<void> gate = release.get_future().share();
+	options.beforeResponse = [gate](const LoopbackHttpServer::Request& req) {
+		if (req.path == "/blocker.bin") {
+			gate.wait();
+		}
+	};
+	LoopbackHttpServer server(options);
+	server.addFile("/blocker.bin", 1024);
+	server.addFile("/bulk.bin", 256 << 10);
+	server.addFile("/small.bin", 1024);
+	MultiDownload<> download(1);
+	std::mutex lock;
+	std::vector<std::string> order;
+	auto cb = [&](const char* fileId, const char*, const CallbackData& data) {
+		if (data.type == RESULT) {
+			assert(data.result == E_OK);
+			std::lock_guard<std::mutex> _(lock);
+			order.push_back(fileId);
+		}
+	};
+	assert(download.addDownload("blocker", server.url("/blocker.bin").c_str(), 0, cb, PRIORITY_LOW));
+	WaitUntil([&] { return server.requests() == 1; });
+	// 其余请求都在排队，放行后高优先级的先开始
+	for (int i = 0; i < 4; ++i) {
+		assert(download.addDownload("bulk", server.url("/bulk.bin").c_str(), 0, cb, PRIORITY_LOW));
+	}
+	assert(download.addDownload("interactive", server.url("/small.bin").c_str(), 1000, cb, PRIORITY_HIGH));
+	release.set_value();
+	download.join();
+	assert(order.size() == 6 && order[0] == "blocker" && order[1] == "interactive");
+	std::cout << "priority: ok" << std::endl;
+}
+
+// 批量提交：所有请求都完成且回调收到各自的 fileId；对比逐个提交的耗时
+static void TestSubmitBatch() {
+	LoopbackHttpServer server;
+	server.addFile("/small.bin", 512);
+	const size_t count = 5000;
+	MultiDownload<> download(32, 0, 2);
+	std::mutex lock;
+	std::set<std::string> finished;
+	size_t ok = 0;
+	auto cb = [&](const char* fileId, const char*, const CallbackData& data) {
+		if (data.type == RESULT) {
+			std::lock_guard<std::mutex> _(lock);
+			finished.insert(fileId);
+			ok += data.result == E_OK;
+		}
+	};
+	std::vector<MultiDownload<>::Request> requests(count);
+	for (size_t i = 0; i < count; ++i) {
+		requests[i].fileId = "req" + std::to_string(i);
+		requests[i].url = server.url("/small.bin");
+		requests[i].cb = cb;
+	}
+	auto start = std::chrono::steady_clock::now();
+	assert(download.submitBatch(std::move(requests)));
+	double batchSec = Seconds(start);
+	assert(requests.empty());
+	download.join();
+	assert(ok == count && finished.size() == count);
+	// join 之后拒绝提交
+	std::vector<MultiDownload<>::Request> late(1);
+	assert(!download.submitBatch(std::move(late)));
+
+	MultiDownload<> single(32, 0, 2);
+	start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < count; ++i) {
+		single.addDownload("single", server.url("/small.bin").c_str(), 0, nullptr);
+	}
+	double singleSec = Seconds(start);
+	std::cout << "submit batch: ok, " << count << " requests, batch " << batchSec * 1e6 / count
+			  << " us/req, one by one " << singleSec * 1e6 / count << " us/req" << std::endl;
+}
+
+static void TestChecksum() {
+	const uint64_t size = 3 << 20;
+	LoopbackHttpServer server;
+	server.addFile("/model.bin", size);
+	Sha256 sha;
+	Crc32c crc;
+	std::vector<char> content(size);
+	for (uint64_t i = 0; i < size; ++i) {
+		content[i] = LoopbackHttpServer::byteAt(i);
+	}
+	sha.update(content.data(), content.size());
+	crc.update(content.data(), content.size());
+	std::string hex = sha.hexdigest();
+	std::transform(hex.begin(), hex.end(), hex.begin(), ::toupper);
+
+	MultiDownload<> download(4);
+	auto fetch = [&](const std::string& sha256, bool checkCrc, uint32_t crc32c) {
+		unlink("checksum.data");
+		Waiter waiter;
+		MultiDownload<>::Request req;
+		req.fileId = "checksum";
+		req.url = server.url("/model.bin");
+		req.cb = waiter.callback();
+		req.sink = std::make_shared<FileSink>("checksum.data");
+		req.sha256 = sha256;
+		req.checkCrc32c = checkCrc;
+		req.crc32c = crc32c;
+		assert(download.submit(std::move(req)));
+		return waiter.wait();
+	};
+	// 大小写不敏感
+	assert(fetch(hex, true, crc.value()) == E_OK);
+	assert(LoopbackHttpServer::verify("checksum.data", size));
+	// 不一致时文件不保留
+	hex[10] = hex[10] == '0' ? '1' : '0';
+	assert(fetch(hex, false, 0) == E_CHECKSUM);
+	assert(access("checksum.data", F_OK) != 0);
+	assert(fetch("", true, crc.value() ^ 1) == E_CHECKSUM);
+	assert(access("checksum.data", F_OK) != 0);
+	std::cout << "checksum: ok, sha256 " << (sha.hardware() ? "sha-ni" : "portable")
+			  << ", crc32c " << (crc.hardware() ? "sse4.2" : "portable") << std::endl;
+}
+
+/// 每块数据都要处理一段时间的 sink，记录处理期间缓冲区的最大占用
+class SlowSink : public DownloadSink {
+public:
+	SlowSink(MultiDownload<>& download, int delay_us, size_t failAfter = (size_t)-1)
+	:m_download(download)
+	,m_delay(delay_us)
+	,m_failAfter(failAfter)
+	{}
+	bool write(const char* data, size_t size) override {
+		peak = std::max(peak, m_download.bufferedBytes());
+		std::this_thread::sleep_for(std::chrono::microseconds(m_delay));
+		if (received.size() >= m_failAfter) {
+			return false;
+		}
+		received.append(data, size);
+		return true;
+	}
+	bool finish(DownloadResult result) override {
+		finished = result;
+		return true;
+	}
+	std::string received;
+	size_t peak = 0;
+	DownloadResult finished = E_MEMORY;
+private:
+	MultiDownload<>& m_download;
+	int m_delay;
+	size_t m_failAfter;
+};
+
+static void TestBackpressure() {
+	const uint64_t size = 16 << 20;
+	const size_t ringChunks = 4;
+	const size_t chunkSize = 64 << 10;
+	LoopbackHttpServer server;
+	server.addFile("/big.bin", size);
+	server.addFile("/small.bin", 4096);
+	std::vector<char> content(size);
+	for (uint64_t i = 0; i < size; ++i) {
+		content[i] = LoopbackHttpServer::byteAt(i);
+	}
+	Crc32c crc;
+	crc.update(content.data(), content.size());
+
+	MultiDownload<> download(8);
+	download.setBackpressure(2, ringChunks, chunkSize);
+	// 慢消费者：数据被反复暂停与恢复，摘要仍然正确
+	auto slow = std::make_shared<SlowSink>(download, 2000);
+	Waiter big;
+	MultiDownload<>::Request req;
+	req.fileId = "big";
+	req.url = server.url("/big.bin");
+	req.cb = big.callback();
+	req.sink = slow;
+	req.checkCrc32c = true;
+	req.crc32c = crc.value();
+	auto start = std::chrono::steady_clock::now();
+	assert(download.submit(std::move(req)));
+
+	// 慢任务不影响其他任务，CONTENT 回调按顺序在 FILESIZE 之后、RESULT 之前
+	const size_t count = 20;
+	std::mutex lock;
+	std::condition_variable cv;
+	size_t done = 0;
+	std::vector<std::string> events(count);
+	for (size_t i = 0; i < count; ++i) {
+		download.addDownload(std::to_string(i).c_str(), server.url("/small.bin").c_str(), 0,
+			[&, i](const char*, const char*, const CallbackData& data) {
+				std::lock_guard<std::mutex> _(lock);
+				if (data.type == FILESIZE) {
+					events[i] += "S";
+				} else if (data.type == CONTENT) {
+					events[i] += "C";
+				} else {
+					events[i] += data.result == E_OK ? "R" : "E";
+					done++;
+					cv.notify_all();
+				}
+			});
+	}
+	{
+		std::unique_lock<std::mutex> lk(lock);
+		cv.wait(lk, [&] { return done == count; });
+	}
+	double smallSec = Seconds(start);
+	// 小任务全部完成时慢任务仍在传输
+	assert(!big.ready());
+	for (auto& e : events) {
+		assert(e.size() >= 3 && e.front() == 'S' && e.back() == 'R' && e.find_first_not_of('C', 1) == e.size() - 1);
+	}
+	assert(big.wait() == E_OK);
+	double bigSec = Seconds(start);
+	assert(slow->finished == E_OK);
+	assert(slow->received.size() == size && memcmp(slow->received.data(), content.data(), size) == 0);
+	assert(slow->peak <= 8 * ringChunks * chunkSize);
+	assert(download.bufferedBytes() == 0);
+
+	// sink 失败时暂停的任务被恢复并中止
+	uint64_t sentBefore = server.bytesSent();
+	auto failing = std::make_shared<SlowSink>(download, 100, 1 << 20);
+	Waiter aborted;
+	assert(download.addDownload("fail", server.url("/big.bin").c_str(), 0, failing, aborted.callback()));
+	assert(aborted.wait() == E_WRITEFAIL);
+	assert(failing->finished == E_WRITEFAIL);
+	assert(server.bytesSent() - sentBefore < size);
+	download.join();
+	std::cout << "backpressure: ok, small requests " << smallSec << " s, slow consumer " << bigSec
+			  << " s, peak buffered " << slow->peak << " bytes" << std::endl;
+}
+
+// 内存、文件与 mmap 三种请求体，服务器收到的内容与原始数据一致
+static void TestUploadSources() {
+	std::mutex lock;
+	std::vector<std::pair<std::string, std::string>> bodies;
+	LoopbackHttpServer::Options options;
+	options.onBody = [&](const std::string& head, const std::string& body) {
+		std::lock_guard<std::mutex> _(lock);
+		bodies.emplace_back(head, body);
+	};
+	LoopbackHttpServer server(options);
+	server.addFile("/upload", 0);
+
+	auto content = std::make_shared<std::string>((5 << 20) + 321, '\0');
+	for (size_t i = 0; i < content->size(); ++i) {
+		(*content)[i] = LoopbackHttpServer::byteAt(i * 7);
+	}
+	{
+		std::ofstream out("upload.data", std::ios::binary);
+		out.write(content->data(), content->size());
+	}
+	auto file = std::make_shared<FileSource>("upload.data");
+	auto mapped = std::make_shared<MappedFileSource>("upload.data");
+	assert(file->valid() && mapped->valid());
+	assert(!file->data() && mapped->data());
+	assert(!FileSource("missing.data").valid());
+
+	MultiDownload<> download(4);
+	std::shared_ptr<UploadSource> sources[] = {std::make_shared<BufferSource>(content), file, mapped};
+	for (auto& source : sources) {
+		Waiter waiter;
+		assert(download.addPost("upload", server.url("/upload").c_str(), source, 0, waiter.callback()));
+		assert(waiter.wait() == E_OK);
+	}
+	unlink("upload.data");
+	assert(bodies.size() == 3);
+	for (auto& body : bodies) {
+		assert(body.first.find("Content-Length: " + std::to_string(content->size())) != std::string::npos);
+		assert(body.second == *content);
+	}
+	std::cout << "upload sources: ok" << std::endl;
+}
+
+static void TestHistogram() {
+	// 桶连续覆盖整个取值范围，每个值落在自己的桶内
+	for (size_t i = 1; i < Histogram::kBuckets; ++i) {
+		assert(Histogram::upperBound(i) > Histogram::upperBound(i - 1));
+		assert(Histogram::bucket(Histogram::upperBound(i - 1) + 1) == i);
+		assert(Histogram::bucket(Histogram::upperBound(i)) == i);
+	}
+	assert(Histogram::bucket(UINT64_MAX) == Histogram::kBuckets - 1);
+	Histogram h;
+	for (uint64_t v = 1; v <= 100000; ++v) {
+		h.record(v);
+	}
+	HistogramSnapshot snap = h.snapshot();
+	assert(snap.count == 100000 && snap.max == 100000);
+	for (double p : {0.5, 0.9, 0.99}) {
+		double exact = p * 100000;
+		assert(snap.percentile(p) >= exact && snap.percentile(p) <= exact * 1.125);
+	}
+	assert(snap.percentile(1) == 100000);
+	std::cout << "histogram: ok" << std::endl;
+}
+
+// 每次传输的指标汇总到 stats，分段下载的进度按间隔合并
+static void TestMetricsAndProgress() {
+	const uint64_t size = 8 << 20;
+	LoopbackHttpServer::Options options;
+	options.latency_ms = 20;
+	options.bandwidth = [](const LoopbackHttpServer::Request&) {
+		return size_t(8 << 20);
+	};
+	LoopbackHttpServer server(options);
+	server.addFile("/model.bin", size);
+
+	MultiDownload<> download(8);
+	download.setProgressInterval(100);
+	std::mutex lock;
+	std::vector<TransferMetrics> metrics;
+	download.setMetricsCallback([&](const char*, const char*, const TransferMetrics& m) {
+		std::lock_guard<std::mutex> _(lock);
+		metrics.push_back(m);
+	});
+	std::vector<std::pair<uint64_t, uint64_t>> progress;
+	Waiter waiter;
+	auto cb = waiter.callback();
+	assert(download.addSegmentedDownload("model", server.url("/model.bin").c_str(), "metrics.data", 0, 2,
+		[&](const char* fileId, const char* url, const CallbackData& data) {
+			if (data.type == PROGRESS) {
+				progress.emplace_back(data.downloaded, data.total);
+				return;
+			}
+			cb(fileId, url, data);
+		}, false));
+	auto start = std::chrono::steady_clock::now();
+	assert(waiter.wait() == E_OK);
+	double sec = Seconds(start);
+	unlink("metrics.data");
+	// 每个连接 8MB/s，2 段约 0.5 秒
+	assert(progress.size() >= 3 && progress.size() <= sec * 10 + 1);
+	for (size_t i = 0; i < progress.size(); ++i) {
+		assert(progress[i].second == size && progress[i].first <= size);
+		assert(i == 0 || progress[i].first >= progress[i - 1].first);
+	}
+
+	// 背压模式下进度与数据在消费线程上按顺序回调
+	{
+		MultiDownload<> buffered(2);
+		buffered.setBackpressure(1);
+		buffered.setProgressInterval(100);
+		Waiter done;
+		auto doneCb = done.callback();
+		uint64_t received = 0;
+		size_t count = 0;
+		assert(buffered.addDownload("buffered", server.url("/model.bin").c_str(), 0,
+			[&](const char* fileId, const char* url, const CallbackData& data) {
+				if (data.type == CONTENT) {
+					received += data.size;
+				} else if (data.type == PROGRESS) {
+					assert(data.downloaded <= size && data.total == size);
+					count++;
+				} else {
+					doneCb(fileId, url, data);
+				}
+			}));
+		assert(done.wait() == E_OK && received == size && count >= 3);
+	}
+
+	Waiter missing;
+	assert(download.addDownload("missing", server.url("/missing.bin").c_str(), 0, missing.callback()));
+	assert(missing.wait() == E_NOTFOUND);
+
+	DownloadStats stats = download.stats();
+	std::lock_guard<std::mutex> _(lock);
+	// 探测、至少 2 段与 404
+	assert(stats.transfers == metrics.size() && stats.transfers >= 4);
+	assert(stats.failed == 1 && stats.results[E_NOTFOUND] == 1);
+	assert(stats.bytesDownloaded >= size);
+	assert(stats.newConnections >= 1 && stats.dns.count == stats.newConnections);
+	assert(stats.ttfb.count == stats.transfers && stats.ttfb.percentile(0.5) >= 20000);
+	assert(stats.total.max >= stats.ttfb.max);
+	for (auto& m : metrics) {
+		assert(m.ttfb_us <= m.total_us && m.tls_us == 0);
+		assert(m.result != E_OK || m.responseCode == 200 || m.responseCode == 206);
+	}
+	std::cout << "metrics and progress: ok, " << stats.transfers << " transfers, " << progress.size()
+			  << " progress callbacks in " << sec << " s, ttfb p50 " << stats.ttfb.percentile(0.5) << " us" << std::endl;
+}
+
+static void TestMirrorRanking() {
+	MirrorStats stats;
+	std::vector<std::string> urls = {"http://a:1/f", "http://b:2/f", "http://c:3/f"};
+	// 没有记录时保持原顺序
+	assert(stats.rank(urls, 1 << 20) == urls);
+	stats.success("a:1", 50, 1 << 20, 1.0);     // 1MB/s
+	stats.success("b:2", 80, 1 << 20, 0.1);     // 10MB/s
+	stats.success("c:3", 10, 1 << 20, 0.1);
+	stats.failure("c:3");
+	// 大文件按吞吐，c 连续失败排在最后
+	std::vector<std::string> ranked = stats.rank(urls, 1 << 20);
+	assert(ranked[0] == urls[1] && ranked[1] == urls[0] && ranked[2] == urls[2]);
+	// 小文件主要看首字节耗时
+	ranked = stats.rank(urls, 1 << 10);
+	assert(ranked[0] == urls[0] && ranked[1] == urls[1]);
+	// 成功后连续失败清零
+	stats.success("c:3", 10, 1 << 20, 0.1);
+	assert(stats.rank(urls, 1 << 20)[0] == urls[2]);
+	MirrorStats::Estimate e;
+	assert(stats.estimate("c:3", e) && e.failures == 0 && e.samples == 2 && !stats.estimate("d:4", e));
+
+	// 没有测量值的镜像排在有测量值的之后，只失败过的排在从未尝试过的之后
+	MirrorStats fresh;
+	std::vector<std::string> mirrors = {"http://d:4/f", "http://e:5/f", "http://f:6/f"};
+	fresh.failure("d:4");
+	fresh.success("f:6", 500, 1 << 10, 0.5);
+	ranked = fresh.rank(mirrors, 1 << 20);
+	assert(ranked[0] == mirrors[2] && ranked[1] == mirrors[1] && ranked[2] == mirrors[0]);
+	// 只失败过的镜像第一次成功后用实际的首字节耗时，不会因为从 0 开始平均而排到最前
+	fresh.success("d:4", 900, 1 << 10, 0.5);
+	assert(fresh.estimate("d:4", e) && e.ttfb_ms == 900 && e.samples == 1);
+	ranked = fresh.rank(mirrors, 1 << 20);
+	assert(ranked[0] == mirrors[2] && ranked[1] == mirrors[0] && ranked[2] == mirrors[1]);
+
+	LatencyWindow window(4);
+	for (int i = 1; i <= 6; ++i) {
+		window.add(i * 10);
+	}
+	// 只保留最近 4 个样本
+	assert(window.size() == 4 && window.percentile(0) == 30 && window.percentile(0.99) == 60);
+	std::cout << "mirror ranking: ok" << std::endl;
+}
+
+static bool Matches(const std::string& body, uint64_t size) {
+	if (body.size() != size) {
+		return false;
+	}
+	for (uint64_t i = 0; i < size; ++i) {
+		if (body[i] != LoopbackHttpServer::byteAt(i)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/// 收集 CONTENT 的 Waiter
+struct BodyWaiter : Waiter {
+	std::string body;
+	std::atomic<size_t> received{0};    // 其他线程可读的已收到字节数
+
+	MultiDownload<>::DownloadCallback callback() {
+		auto cb = Waiter::callback();
+		return [this, cb](const char* fileId, const char* url, const CallbackData& data) {
+			if (data.type == CONTENT) {
+				body.append(data.data, data.size);
+				received += data.size;
+				return;
+			}
+			cb(fileId, url, data);
+		};
+	}
+};
+
+static void TestHedging() {
+	const uint64_t size = 512 << 10;
+	LoopbackHttpServer::Options slowOptions;
+	slowOptions.latency_ms = 500;
+	LoopbackHttpServer slow(slowOptions);
+	LoopbackHttpServer fast;
+	slow.addFile("/model.bin", size);
+	fast.addFile("/model.bin", size);
+
+	MultiDownload<> download(8);
+	HedgePolicy policy;
+	policy.initialDelay_ms = 50;
+	policy.backoff_ms = 20;
+	download.setHedgePolicy(policy);
+	std::mutex lock;
+	std::vector<TransferMetrics> metrics;
+	download.setMetricsCallback([&](const char*, const char*, const TransferMetrics& m) {
+		std::lock_guard<std::mutex> _(lock);
+		metrics.push_back(m);
+	});
+
+	// 主 URL 迟迟没有响应，约 50ms 后向镜像发出备用请求，镜像胜出后取消主 URL
+	MultiDownload<>::Request request;
+	request.fileId = "hedged";
+	request.url = slow.url("/model.bin");
+	request.mirrors.push_back(fast.url("/model.bin"));
+	BodyWaiter hedged;
+	request.cb = hedged.callback();
+	auto start = std::chrono::steady_clock::now();
+	assert(download.submit(std::move(request)));
+	assert(hedged.wait() == E_OK);
+	double sec = Seconds(start);
+	assert(hedged.fileSize == size && Matches(hedged.body, size));
+	assert(slow.requests() <= 1 && fast.requests() == 1);
+	MirrorStats::Estimate e;
+	assert(download.mirrorStats().estimate(urlAuthority(fast.url("/")), e) && e.throughput > 0);
+	{
+		std::lock_guard<std::mutex> _(lock);
+		// 第 0 个尝试被取消，第 1 个成功
+		assert(metrics.size() == 2);
+		for (auto& m : metrics) {
+			assert(m.result == (m.retries == 0 ? E_CANCELLED : E_OK));
+		}
+	}
+
+	// 404 的镜像不再重试，立即换到下一个
+	request = MultiDownload<>::Request();
+	request.url = fast.url("/missing.bin");
+	request.mirrors.push_back(fast.url("/model.bin"));
+	BodyWaiter failover;
+	request.cb = failover.callback();
+	assert(download.submit(std::move(request)));
+	assert(failover.wait() == E_OK && Matches(failover.body, size));
+
+	// 单个 URL 的 503 按退避重试：前 2 个请求失败，第 3 个成功
+	LoopbackHttpServer::Options flakyOptions;
+	flakyOptions.failureRate = 0.7;
+	{
+		LoopbackHttpServer flaky(flakyOptions);
+		flaky.addFile("/model.bin", size);
+		request = MultiDownload<>::Request();
+		request.url = flaky.url("/model.bin");
+		request.hedge = true;
+		BodyWaiter retried;
+		request.cb = retried.callback();
+		metrics.clear();
+		assert(download.submit(std::move(request)));
+		assert(retried.wait() == E_OK && Matches(retried.body, size));
+		std::lock_guard<std::mutex> _(lock);
+		assert(metrics.size() == 3 && metrics[2].result == E_OK && metrics[2].retries == 2);
+	}
+	// 尝试次数用完时返回最后一次失败的结果，没有数据交给用户
+	{
+		LoopbackHttpServer flaky(flakyOptions);
+		flaky.addFile("/model.bin", size);
+		policy.maxAttempts = 2;
+		download.setHedgePolicy(policy);
+		request = MultiDownload<>::Request();
+		request.url = flaky.url("/model.bin");
+		request.hedge = true;
+		BodyWaiter exhausted;
+		request.cb = exhausted.callback();
+		assert(download.submit(std::move(request)));
+		assert(exhausted.wait() == E_RESPONSE_CODE && exhausted.body.empty());
+	}
+	download.join();
+	std::cout << "hedging: ok, " << sec << " s" << std::endl;
+}
+
+static void TestCancel() {
+	LoopbackHttpServer::Options options;
+	options.latency_ms = 300;
+	LoopbackHttpServer server(options);
+	server.addFile("/model.bin", 1 << 20);
+	// 并发 1，第二个请求在排队
+	MultiDownload<> download(1);
+	auto token = std::make_shared<CancelToken>();
+	Waiter running;
+	Waiter queued;
+	Waiter other;
+	MultiDownload<>::Request request;
+	request.url = server.url("/model.bin");
+	request.cancelToken = token;
+	request.cb = running.callback();
+	assert(download.submit(std::move(request)));
+	request = MultiDownload<>::Request();
+	request.url = server.url("/model.bin");
+	request.cancelToken = token;
+	request.cb = queued.callback();
+	assert(download.submit(std::move(request)));
+	assert(download.addDownload("other", server.url("/model.bin").c_str(), 0, other.callback()));
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	auto start = std::chrono::steady_clock::now();
+	download.cancel(token);
+	assert(running.wait() == E_CANCELLED && queued.wait() == E_CANCELLED);
+	double sec = Seconds(start);
+	// 没有这个 token 的请求不受影响，排队中被取消的请求不会发出
+	assert(other.wait() == E_OK);
+	assert(server.requests() <= 2);
+
+	// 对冲请求与分段下载的所有尝试都被取消
+	auto hedgeToken = std::make_shared<CancelToken>();
+	request = MultiDownload<>::Request();
+	request.url = server.url("/model.bin");
+	request.mirrors.push_back(server.url("/model.bin"));
+	request.cancelToken = hedgeToken;
+	Waiter hedged;
+	request.cb = hedged.callback();
+	assert(download.submit(std::move(request)));
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	download.cancel(hedgeToken);
+	assert(hedged.wait() == E_CANCELLED);
+	download.join();
+	std::cout << "cancel: ok, " << sec << " s" << std::endl;
+}
+
+static void TestBandwidthLimit() {
+	const uint64_t size = 1 << 20;
+	LoopbackHttpServer server;
+	server.addFile("/model.bin", size);
+	server.addFile("/bulk.bin", 16 << 20);
+	server.addFile("/large.bin", 4 << 20);
+	MultiDownload<> download(8);
+	// 全局 2MB/s，两个 1MB 的请求共享，扣除开始时 200KB 的突发约 0.9 秒
+	download.setBandwidthLimit(2 << 20);
+	auto start = std::chrono::steady_clock::now();
+	Waiter first;
+	Waiter second;
+	assert(download.addDownload("first", server.url("/model.bin").c_str(), 0, first.callback()));
+	assert(download.addDownload("second", server.url("/model.bin").c_str(), 0, second.callback()));
+	assert(first.wait() == E_OK && second.wait() == E_OK);
+	double shared = Seconds(start);
+	assert(shared > 0.7);
+
+	// 限速暂停中被取消的任务撤销恢复定时器，句柄被下一个任务复用后照常完成
+	{
+		auto token = std::make_shared<CancelToken>();
+		MultiDownload<>::Request request;
+		request.url = server.url("/bulk.bin");
+		request.cancelToken = token;
+		Waiter cancelled;
+		request.cb = cancelled.callback();
+		uint64_t sent = server.bytesSent();
+		assert(download.submit(std::move(request)));
+		WaitUntil([&] { return server.bytesSent() > sent + (512 << 10); });
+		download.cancel(token);
+		assert(cancelled.wait() == E_CANCELLED);
+		BodyWaiter next;
+		assert(download.addDownload("next", server.url("/model.bin").c_str(), 0, next.callback()));
+		assert(next.wait() == E_OK && Matches(next.body, size));
+	}
+
+	// 低优先级的批量传输占满全局限速时，高优先级请求不受影响
+	Waiter bulk;
+	assert(download.addDownload("bulk", server.url("/bulk.bin").c_str(), 0, bulk.callback(), PRIORITY_LOW));
+	std::this_thread::sleep_for(std::chrono::milliseconds(200));
+	start = std::chrono::steady_clock::now();
+	Waiter urgent;
+	assert(download.addDownload("urgent", server.url("/model.bin").c_str(), 0, urgent.callback(), PRIORITY_HIGH));
+	assert(urgent.wait() == E_OK);
+	double high = Seconds(start);
+	assert(!bulk.ready());
+	// 运行中解除限速，暂停的批量传输不重新开始，直接完成（限速下需要约 8 秒）
+	uint64_t requests = server.requests();
+	download.setBandwidthLimit(0);
+	assert(bulk.wait() == E_OK);
+	assert(server.requests() == requests);
+
+	// curl 控制的单个传输上限。curl 一次读取循环可收下 1MB 以上，用较大的文件才看得出
+	MultiDownload<>::Request request;
+	request.url = server.url("/large.bin");
+	request.maxRecvSpeed = 8 << 20;
+	Waiter capped;
+	request.cb = capped.callback();
+	start = std::chrono::steady_clock::now();
+	assert(download.submit(std::move(request)));
+	assert(capped.wait() == E_OK);
+	double cappedSec = Seconds(start);
+	assert(cappedSec > 0.3);
+	download.join();
+
+	// 背压模式下按主机与优先级限速，其他主机不受影响
+	LoopbackHttpServer other;
+	other.addFile("/model.bin", size);
+	MultiDownload<> buffered(8);
+	buffered.setBackpressure(2);
+	buffered.setHostBandwidthLimit(urlAuthority(server.url("/")), 1 << 20);
+	buffered.setPriorityBandwidthLimit(PRIORITY_LOW, 1 << 20);
+	start = std::chrono::steady_clock::now();
+	Waiter limited;
+	Waiter low;
+	Waiter unlimited;
+	assert(buffered.addDownload("limited", server.url("/model.bin").c_str(), 0, limited.callback()));
+	assert(buffered.addDownload("low", other.url("/model.bin").c_str(), 0, low.callback(), PRIORITY_LOW));
+	assert(buffered.addDownload("unlimited", other.url("/model.bin").c_str(), 0, unlimited.callback()));
+	assert(unlimited.wait() == E_OK);
+	assert(!limited.ready() && !low.ready());
+	assert(limited.wait() == E_OK && low.wait() == E_OK);
+	double perHost = Seconds(start);
+	assert(perHost > 0.7);
+	buffered.join();
+	std::cout << "bandwidth limit: ok, shared " << shared << " s, high priority " << high << " s, capped "
+			  << cappedSec << " s, per host " << perHost << " s" << std::endl;
+}
+
+static void TestDownloadCache() {
+	const uint64_t size = 2 << 20;
+	LoopbackHttpServer::Options options;
+	options.etag = "\"v1\"";
+	LoopbackHttpServer server(options);
+	server.addFile("/model.bin", size);
+	server.addFile("/other.bin", size);
+	const std::string url = server.url("/model.bin");
+	assert(system("rm -rf cache.test") == 0);
+	auto cache = std::make_shared<DownloadCache>("cache.test", size * 3 / 2);
+	assert(cache->open());
+	{
+		// 冷启动：分段下载后存入缓存
+		MultiDownload<> download(4);
+		download.setCache(cache);
+		Waiter waiter;
+		assert(download.addSegmentedDownload("model", url.c_str(), "cache.data", 0, 4, waiter.callback()));
+		assert(waiter.wait() == E_OK && LoopbackHttpServer::verify("cache.data", size));
+		assert(cache->usage() == size);
+	}
+	// 重启后（另一个缓存实例，相当于另一个进程）只发一个条件请求，没有响应体
+	uint64_t requests = server.requests();
+	uint64_t sent = server.bytesSent();
+	{
+		auto restarted = std::make_shared<DownloadCache>("cache.test", size * 3 / 2);
+		MultiDownload<> download(4);
+		download.setCache(restarted);
+		unlink("cache.data");
+		Waiter segmented;
+		assert(download.addSegmentedDownload("model", url.c_str(), "cache.data", 0, 4, segmented.callback()));
+		assert(segmented.wait() == E_OK && segmented.fileSize == size && LoopbackHttpServer::verify("cache.data", size));
+		assert(server.requests() == requests + 1 && server.bytesSent() == sent);
+		// 与缓存中的对象是同一个 inode
+		struct stat st;
+		assert(stat("cache.data", &st) == 0 && st.st_nlink == 2);
+		Waiter file;
+		assert(download.addDownloadToFile("file", url.c_str(), "cache.data", 0, file.callback()));
+		assert(file.wait() == E_OK && LoopbackHttpServer::verify("cache.data", size));
+		assert(server.requests() == requests + 2 && server.bytesSent() == sent);
+		assert(access("cache.data.part", F_OK) != 0 && access("cache.data.link", F_OK) != 0);
+	}
+	// 内容变化后返回 200，重新下载并更新缓存
+	server.setEtag("\"v2\"");
+	{
+		MultiDownload<> download(4);
+		download.setCache(cache);
+		Waiter changed;
+		assert(download.addDownloadToFile("file", url.c_str(), "cache.data", 0, changed.callback()));
+		assert(changed.wait() == E_OK && server.bytesSent() == sent + size);
+		DownloadCache::Entry entry;
+		assert(cache->lookup(url, entry) && entry.etag == "\"v2\"" && entry.size == size);
+		// 超过容量上限时淘汰最久未用的
+		Waiter other;
+		assert(download.addDownloadToFile("other", server.url("/other.bin").c_str(), "cache2.data", 0, other.callback()));
+		assert(other.wait() == E_OK);
+		assert(!cache->lookup(url, entry) && cache->lookup(server.url("/other.bin"), entry));
+		assert(cache->usage() == size);
+	}
+	// 取出只更新记录的使用时间，不修改与对象共用 inode 的已下载文件
+	DownloadCache::Entry pinned;
+	assert(cache->lookup(server.url("/other.bin"), pinned));
+	struct stat before, after;
+	assert(stat("cache2.data", &before) == 0);
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	assert(cache->materialize(pinned, "cache3.data"));
+	assert(stat("cache2.data", &after) == 0 && after.st_nlink == 3);
+	assert(after.st_mtim.tv_sec == before.st_mtim.tv_sec && after.st_mtim.tv_nsec == before.st_mtim.tv_nsec);
+	// 查找之后对象被另一个进程淘汰，仍从查找时打开的对象取出
+	DownloadCache evictor("cache.test", size * 3 / 2);
+	assert(evictor.store("http://elsewhere/model.bin", "cache.data", "\"x\"", ""));
+	DownloadCache::Entry evicted;
+	assert(!cache->lookup(server.url("/other.bin"), evicted));
+	assert(cache->materialize(pinned, "cache4.data") && LoopbackHttpServer::verify("cache4.data", size));
+	assert(stat("cache4.data", &after) == 0 && after.st_nlink == 1);
+	unlink("cache3.data");
+	unlink("cache4.data");
+	// 按内容寻址时相同内容的 URL 共用一个对象；多个实例并发存入与取出，各自持有文件锁
+	assert(system("rm -rf cache.test") == 0);
+	std::vector<std::thread> threads;
+	std::atomic<int> hits{0};
+	for (int t = 0; t < 4; ++t) {
+		threads.emplace_back([t, size, &hits] {
+			DownloadCache shared("cache.test", 64 << 20, true, t % 2 ? DownloadCache::REFLINK : DownloadCache::HARDLINK);
+			assert(shared.open());
+			std::string out = "cache.out" + std::to_string(t);
+			for (int i = 0; i < 30; ++i) {
+				std::string key = "http://mirror" + std::to_string(i % 5) + "/model.bin";
+				assert(shared.store(key, "cache2.data", "\"e\"", ""));
+				DownloadCache::Entry entry;
+				if (shared.lookup(key, entry)) {
+					assert(shared.materialize(entry, out) && LoopbackHttpServer::verify(out, size));
+					hits++;
+				}
+			}
+			unlink(out.c_str());
+		});
+	}
+	for (auto& t : threads) {
+		t.join();
+	}
+	assert(hits == 120 && DownloadCache("cache.test", 0).usage() == size);
+	unlink("cache.data");
+	unlink("cache2.data");
+	assert(system("rm -rf cache.test") == 0);
+	std::cout << "download cache: ok" << std::endl;
+}
+
+static void TestCoalescing() {
+	const uint64_t size = 4 << 20;
+	LoopbackHttpServer::Options options;
+	options.bandwidth = [](const LoopbackHttpServer::Request&) {
+		return size_t(8 << 20);
+	};
+	// /missing.bin 的响应等到放行后才发出
+	std::promise<void> release;
+	std::shared_future<void> gate = release.get_future().share();
+	options.beforeResponse = [gate](const LoopbackHttpServer::Request& req) {
+		if (req.path == "/missing.bin") {
+			gate.wait();
+		}
+	};
+	LoopbackHttpServer server(options);
+	server.addFile("/model.bin", size);
+	const std::string url = server.url("/model.bin");
+	MultiDownload<> download(8);
+	download.setCoalescing(true, 1 << 20);
+
+	// 同时提交的相同请求共用一个传输
+	uint64_t requests = server.requests();
+	std::vector<std::unique_ptr<BodyWaiter>> waiters;
+	for (int i = 0; i < 5; ++i) {
+		waiters.emplace_back(new BodyWaiter);
+		assert(download.addDownload(("same" + std::to_string(i)).c_str(), url.c_str(), 0, waiters.back()->callback()));
+	}
+	for (auto& w : waiters) {
+		assert(w->wait() == E_OK && w->fileSize == size && Matches(w->body, size));
+	}
+	assert(server.requests() == requests + 1);
+
+	// 传输开始后加入的请求从补发缓冲区取得已收到的数据
+	requests = server.requests();
+	BodyWaiter leader;
+	BodyWaiter early;
+	assert(download.addDownload("leader", url.c_str(), 0, leader.callback()));
+	// 服务器限速，开始收到数据后还要约 100ms 才超过补发缓冲区
+	WaitUntil([&] { return leader.received > 0; });
+	assert(download.addDownload("early", url.c_str(), 0, early.callback()));
+	assert(leader.wait() == E_OK && early.wait() == E_OK);
+	assert(Matches(leader.body, size) && Matches(early.body, size) && early.fileSize == size);
+	assert(server.requests() == requests + 1);
+
+	// 超过缓冲区上限后没有可补发的来源，另起传输
+	requests = server.requests();
+	BodyWaiter first;
+	BodyWaiter late;
+	assert(download.addDownload("first", url.c_str(), 0, first.callback()));
+	WaitUntil([&] { return first.received > (1 << 20); });
+	assert(download.addDownload("late", url.c_str(), 0, late.callback()));
+	assert(first.wait() == E_OK && late.wait() == E_OK);
+	assert(Matches(first.body, size) && Matches(late.body, size));
+	assert(server.requests() == requests + 2);
+
+	// 第一个请求写文件时从文件补发
+	struct CountingFileSink : FileSink {
+		std::atomic<size_t> written{0};
+		using FileSink::FileSink;
+		bool write(const char* data, size_t size) override {
+			written += size;
+			return FileSink::write(data, size);
+		}
+	};
+	requests = server.requests();
+	auto sink = std::make_shared<CountingFileSink>("coalesce.data");
+	assert(sink->open());
+	Waiter file;
+	BodyWaiter reader;
+	assert(download.addDownload("file", url.c_str(), 0, sink, file.callback()));
+	WaitUntil([&] { return sink->written > (1 << 20); });
+	assert(download.addDownload("reader", url.c_str(), 0, reader.callback()));
+	assert(file.wait() == E_OK && reader.wait() == E_OK);
+	assert(LoopbackHttpServer::verify("coalesce.data", size) && Matches(reader.body, size));
+	assert(server.requests() == requests + 1);
+	unlink("coalesce.data");
+
+	// 失败的结果同样共享；优先级或超时不同的请求不合并
+	requests = server.requests();
+	std::vector<MultiDownload<>::Request> batch(4);
+	Waiter missing[4];
+	for (int i = 0; i < 4; ++i) {
+		batch[i].fileId = "missing";
+		batch[i].url = server.url("/missing.bin");
+		batch[i].cb = missing[i].callback();
+	}
+	batch[2].priority = PRIORITY_HIGH;
+	batch[3].timeout_ms = 5000;
+	assert(download.submitBatch(std::move(batch)));
+	WaitUntil([&] { return server.requests() == requests + 3; });
+	release.set_value();
+	for (auto& w : missing) {
+		assert(w.wait() == E_NOTFOUND);
+	}
+	assert(server.requests() == requests + 3);
+	download.join();
+	std::cout << "coalescing: ok" << std::endl;
+}
+
+int main()
+{
+	curl_global_init(CURL_GLOBAL_ALL);
+	TestSegmented();
+	TestNoRangeFallback();
+	TestSlowSegmentStolen();
+	TestNotFound();
+	TestResumeAfterRestart();
+	TestResumeRejectedOnChange();
+	TestConnectionReuse();
+	TestShardedLoops();
+	TestScheduler();
+	TestPriority();
+	TestSubmitBatch();
+	TestChecksum();
+	TestBackpressure();
+	TestUploadSources();
+	TestHistogram();
+	TestMetricsAndProgress();
+	TestMirrorRanking();
+	TestHedging();
+	TestCancel();
+	TestBandwidthLimit();
+	TestDownloadCache();
+	TestCoalescing();
+	curl_global_cleanup();
+	return 0;
+}
@@ -0,0 +1,216 @@
+#include <cassert>
+#include <chrono>
+#include <iostream>
+#include "design_pattern.h"
+
+static std::mutex g_log_lock;
+static void Log(const std::string &msg)
+{
+    std::lock_guard<std::mutex> _(g_log_lock);
+    std::cout << "[" << std::this_thread::get_id() << "] " << msg << std::endl;
+}
+
+// 模拟耗时的初始化
+static void Work(int ms)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+class Config : public EagerSingleton<Config>
+{
+  public:
+    Config() { Work(100); Log("Config"); }
+    ~Config() { Log("~Config"); }
+    int port = 8080;
+};
+
+class Logger : public EagerSingleton<Logger, Config>
+{
+  public:
+    Logger() { assert(Config::Initialized()); Work(100); Log("Logger"); }
+    ~Logger() { assert(Config::Initialized()); Log("~Logger"); }
+};
+
+class ModelCache : public EagerSingleton<ModelCache, Config>
+{
+  public:
+    ModelCache() { assert(Config::Initialized()); Work(100); Log("ModelCache"); }
+    ~ModelCache() { Log("~ModelCache"); }
+};
+
+class Server : public EagerSingleton<Server, Logger, ModelCache>
+{
+  public:
+    Server() : port(Config::Instance().port) { assert(Logger::Initialized() && ModelCache::Initialized()); Log("Server"); }
+    ~Server() { Log("~Server"); }
+    int port;
+};
+
+struct RequestStats
+{
+    // 只有所属线程写入，relaxed load + store 即可，无需加锁的 fetch_add
+    std::atomic<uint64_t> requests{0};
+    std::atomic<uint64_t> bytes{0};
+
+    void Add(uint64_t n)
+    {
+        requests.store(requests.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        bytes.store(bytes.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    // 已退出线程的分片被复用前并入汇总
+    void merge(const RequestStats &other)
+    {
+        requests.store(requests.load(std::memory_order_relaxed) + other.requests.load(std::memory_order_relaxed),
+                       std::memory_order_relaxed);
+        bytes.store(bytes.load(std::memory_order_relaxed) + other.bytes.load(std::memory_order_relaxed),
+                    std::memory_order_relaxed);
+    }
+};
+
+template <typename Tag>
+static uint64_t TotalRequests()
+{
+    return ThreadLocalSingleton<RequestStats, Tag>::combine(
+        uint64_t(0), [](uint64_t sum, const RequestStats &s) { return sum + s.requests.load(); });
+}
+
+static void TestThreadLocalSingleton()
+{
+    const int thread_num = 4;
+    const int loops = 10000000;
+
+    std::atomic<uint64_t> shared_requests{0};
+    auto t0 = std::chrono::steady_clock::now();
+    {
+        std::vector<std::thread> threads;
+        for (int i = 0; i < thread_num; ++i)
+        {
+            threads.emplace_back([&] {
+                for (int n = 0; n < loops; ++n)
+                {
+                    shared_requests.fetch_add(1, std::memory_order_relaxed);
+                }
+            });
+        }
+        for (auto &t : threads)
+        {
+            t.join();
+        }
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    {
+        std::vector<std::thread> threads;
+        for (int i = 0; i < thread_num; ++i)
+        {
+            threads.emplace_back([&] {
+                for (int n = 0; n < loops; ++n)
+                {
+                    ThreadLocalSingleton<RequestStats>::Instance().Add(2);
+                }
+            });
+        }
+        for (auto &t : threads)
+        {
+            t.join();
+        }
+    }
+    auto t2 = std::chrono::steady_clock::now();
+
+    // 线程已退出，数据仍保留在各自的分片中
+    auto requests = ThreadLocalSingleton<RequestStats>::combine(
+        uint64_t(0), [](uint64_t sum, const RequestStats &s) { return sum + s.requests.load(); });
+    auto bytes = ThreadLocalSingleton<RequestStats>::combine(
+        uint64_t(0), [](uint64_t sum, const RequestStats &s) { return sum + s.bytes.load(); });
+    assert(requests == shared_requests.load());
+    assert(bytes == 2 * requests);
+
+    // 新线程复用已退出线程留下的分片，旧分片的数据并入汇总，合计不变
+    std::thread([] { ThreadLocalSingleton<RequestStats>::Instance().Add(0); }).join();
+    assert(ThreadLocalSingleton<RequestStats>::shard_count() == thread_num);
+    assert(TotalRequests<void>() == requests + 1);
+
+    using ms = std::chrono::milliseconds;
+    std::cout << "shared atomic:        " << std::chrono::duration_cast<ms>(t1 - t0).count() << " ms" << std::endl;
+    std::cout << "ThreadLocalSingleton: " << std::chrono::duration_cast<ms>(t2 - t1).count() << " ms, shards "
+              << ThreadLocalSingleton<RequestStats>::shard_count() << std::endl;
+}
+
+struct ReuseTag;
+struct ExitTag;
+
+// 析构时使用单例，先于单例构造因而后于其析构
+struct LateUser
+{
+    ~LateUser() { ThreadLocalSingleton<RequestStats, ExitTag>::Instance().Add(1); }
+};
+
+static void TestThreadLocalReuse()
+{
+    // 复用已退出线程的分片时重新构造，新线程看不到旧状态，旧状态仍计入 combine()
+    std::thread([] { ThreadLocalSingleton<RequestStats, ReuseTag>::Instance().Add(5); }).join();
+    uint64_t seen = 1;
+    std::thread([&] {
+        auto &stats = ThreadLocalSingleton<RequestStats, ReuseTag>::Instance();
+        seen = stats.requests.load();
+        stats.Add(1);
+    }).join();
+    assert(seen == 0);
+    assert((ThreadLocalSingleton<RequestStats, ReuseTag>::shard_count() == 1));
+    assert(TotalRequests<ReuseTag>() == 2);
+    for (int i = 0; i < 8; ++i)
+    {
+        std::thread([] { ThreadLocalSingleton<RequestStats, ReuseTag>::Instance().Add(1); }).join();
+    }
+    assert((ThreadLocalSingleton<RequestStats, ReuseTag>::shard_count() == 1));
+    assert(TotalRequests<ReuseTag>() == 10);
+
+    // 归还分片之后再调用 Instance() 得到共享的备用实例，写入仍计入 combine()，分片数不随线程增长
+    for (int i = 0; i < 4; ++i)
+    {
+        std::thread([] {
+            static thread_local LateUser user;
+            (void)user;
+            ThreadLocalSingleton<RequestStats, ExitTag>::Instance().Add(1);
+        }).join();
+    }
+    assert(TotalRequests<ExitTag>() == 8);
+    assert((ThreadLocalSingleton<RequestStats, ExitTag>::shard_count() == 2));
+    std::cout << "thread local reuse: ok" << std::endl;
+}
+
+class CycleA;
+class CycleB;
+class CycleA : public EagerSingleton<CycleA, CycleB> {};
+class CycleB : public EagerSingleton<CycleB, CycleA> {};
+
+int main()
+{
+    Server::Regist();
+
+    auto t0 = std::chrono::steady_clock::now();
+    SingletonRegistry::Instance().Initialize(4);
+    auto t1 = std::chrono::steady_clock::now();
+
+    // Logger 与 ModelCache 并行构造，总耗时约 200ms 而非 300ms
+    std::cout << "initialize: " << std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count() << " ms"
+              << std::endl;
+    std::cout << "server port: " << Server::Instance().port << std::endl;
+
+    SingletonRegistry::Instance().Shutdown();
+    assert(!Server::Initialized() && !Config::Initialized());
+
+    try
+    {
+        CycleA::Regist();
+        SingletonRegistry::Instance().Initialize();
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << '\n';
+    }
+
+    TestThreadLocalSingleton();
+    TestThreadLocalReuse();
+    return 0;
+}
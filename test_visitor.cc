@@ -0,0 +1,96 @@
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include "design_pattern.h"
+
+struct Circle { double r; };
+struct Rect { double w, h; };
+struct Label { std::string text; };
+
+using Shape = std::variant<Circle, Rect, Label>;
+
+struct ShapePrinter : Vistor<Circle, Rect, Label> {
+	void visit(const Circle& c) const override { std::cout << "Circle " << c.r << std::endl; }
+	void visit(const Rect& r) const override { std::cout << "Rect " << r.w << "x" << r.h << std::endl; }
+	void visit(const Label& l) const override { std::cout << "Label " << l.text << std::endl; }
+};
+
+int main()
+{
+	ShapePrinter printer;
+	const Vistor<Circle, Rect, Label>& vistor = printer;
+	vistor.visit(Circle{1.0});
+	vistor.visit(Label{"hello"});
+
+	auto area = overloaded{
+		[](const Circle& c) { return 3.14159 * c.r * c.r; },
+		[](const Rect& r) { return r.w * r.h; },
+		[](const Label&) { return 0.0; },
+	};
+
+	std::vector<Shape> shapes;
+	for (int i = 0; i < 1000000; ++i) {
+		switch (i % 3) {
+		case 0: shapes.emplace_back(Circle{double(i % 7)}); break;
+		case 1: shapes.emplace_back(Rect{double(i % 5), 2.0}); break;
+		default: shapes.emplace_back(Label{"x"}); break;
+		}
+	}
+
+	auto t0 = std::chrono::steady_clock::now();
+	double sum_std = 0;
+	for (auto& s : shapes) {
+		sum_std += std::visit(area, s);
+	}
+	auto t1 = std::chrono::steady_clock::now();
+	double sum_static = 0;
+	for (auto& s : shapes) {
+		sum_static += visit_static(area, s);
+	}
+	auto t2 = std::chrono::steady_clock::now();
+	double sum_batched = 0;
+	visit_batched(shapes, [&](const auto& s) { sum_batched += area(s); });
+	auto t3 = std::chrono::steady_clock::now();
+
+	// 顺序无关时先原地归并同类型元素，之后每种类型只分发一次
+	std::vector<Shape> grouped = shapes;
+	auto g0 = std::chrono::steady_clock::now();
+	group_by_type(grouped);
+	auto g1 = std::chrono::steady_clock::now();
+	double sum_grouped = 0;
+	visit_batched(grouped, [&](const auto& s) { sum_grouped += area(s); });
+	auto g2 = std::chrono::steady_clock::now();
+	for (size_t i = 1; i < grouped.size(); ++i) {
+		assert(grouped[i - 1].index() <= grouped[i].index());
+	}
+
+	VariantBatch<Circle, Rect, Label> batch;
+	for (auto& s : shapes) {
+		batch.push(s);
+	}
+	auto t4 = std::chrono::steady_clock::now();
+	double sum_container = 0;
+	batch.visit([&](const auto& s) { sum_container += area(s); });
+	auto t5 = std::chrono::steady_clock::now();
+
+	assert(batch.size() == shapes.size());
+	assert(batch.of<Circle>().size() == (shapes.size() + 2) / 3);
+	// 与 std::visit 顺序相同的结果逐位相等，按类型重排后的求和顺序不同，只允许舍入误差
+	auto close = [&](double sum) { return std::abs(sum - sum_std) <= 1e-9 * sum_std; };
+	assert(sum_static == sum_std);
+	assert(sum_batched == sum_std);
+	assert(close(sum_grouped));
+	assert(close(sum_container));
+	std::cout << std::fixed << sum_std << " " << sum_static << " " << sum_batched << " " << sum_grouped << " " << sum_container << std::endl;
+
+	using us = std::chrono::microseconds;
+	std::cout << "std::visit:     " << std::chrono::duration_cast<us>(t1 - t0).count() << " us" << std::endl;
+	std::cout << "visit_static:   " << std::chrono::duration_cast<us>(t2 - t1).count() << " us" << std::endl;
+	std::cout << "visit_batched:  " << std::chrono::duration_cast<us>(t3 - t2).count() << " us" << std::endl;
+	std::cout << "group_by_type:  " << std::chrono::duration_cast<us>(g1 - g0).count() << " us" << std::endl;
+	std::cout << "  then batched: " << std::chrono::duration_cast<us>(g2 - g1).count() << " us" << std::endl;
+	std::cout << "VariantBatch:   " << std::chrono::duration_cast<us>(t5 - t4).count() << " us" << std::endl;
+	return 0;
+}